@@ -0,0 +1,1170 @@
+/* JACK I/O abstraction with process-cycle capture and replay
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* All calls that a process() callback makes into JACK go through the
+ * jio_* wrappers below. With the JACK backend they map 1:1 to libjack,
+ * optionally recording every input (port buffers, transport position)
+ * to a capture file. The replay backend reads such a file and invokes
+ * the very same process callback without a JACK server, as fast as
+ * possible. The simulation backend runs the process callback on a
+ * freely advancing clock with a programmable transport and can loop
+ * output ports back to input ports.
+ *
+ * Every backend measures the execution time of the process callback
+ * (log2 histogram, WCET and fraction of the period used); the
+ * statistics are printed by the non-realtime thread on request.
+ *
+ * The sample clock (frames since the first cycle) is mapped to host
+ * time, CLOCK_MONOTONIC and CLOCK_REALTIME, by a DLL that follows the
+ * start of each JACK cycle. Replay and simulation use a nominal clock
+ * that starts with the first cycle.
+ *
+ * Capture file layout (native byte order):
+ *   jio_file_header, n_ports * jio_file_port,
+ *   then per cycle: JIO_REC_CYCLE followed by the input records of
+ *   that cycle (JIO_REC_MIDI, JIO_REC_AUDIO, JIO_REC_TRANSPORT).
+ *
+ * The port table holds the latencies that the application last read
+ * with jio_port_get_latency_range(), it is re-written when the capture
+ * ends. Replay returns those values, so latency compensation matches
+ * the captured session. Version 1 files (JIOCAP01) have no latencies.
+ */
+
+#ifndef JACKIO_H
+#define JACKIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <jack/jack.h>
+#include <jack/transport.h>
+#include <jack/ringbuffer.h>
+#include <jack/midiport.h>
+
+#include "rtmem.h"
+
+#define JIO_MAX_PORTS (8)
+#define JIO_MIDI_EVENTS (1024)
+#define JIO_MIDI_DATA (16384)
+#define JIO_CAPTURE_SEC (0.5) // capture ring: data at the current period
+#define JIO_CAPTURE_MIDI (1024) // capture ring: expected MIDI bytes per port and cycle
+#define JIO_MAX_PERIOD (65536) // largest supported period, e.g. freewheel exports
+#define JIO_MAGIC "JIOCAP02"
+#define JIO_MAGIC_V1 "JIOCAP01" // no port latencies
+#define JIO_TIMING_BINS (32) // log2 of process() execution time [ns]
+#define JIO_DLL_BW (0.5) // host clock DLL bandwidth [Hz]
+
+enum {
+	JIO_JACK = 0,
+	JIO_REPLAY,
+	JIO_SIM
+};
+
+enum {
+	JIO_REC_CYCLE = 1,
+	JIO_REC_MIDI,
+	JIO_REC_AUDIO,
+	JIO_REC_TRANSPORT
+};
+
+#define JIO_PORT_INPUT (1)
+#define JIO_PORT_MIDI  (2)
+
+typedef struct {
+	char magic[8];
+	uint32_t samplerate;
+	uint32_t n_ports;
+} jio_file_header;
+
+typedef struct {
+	char name[32];
+	uint32_t flags;
+	uint32_t latency[2][2]; // [JackCaptureLatency, JackPlaybackLatency][min, max]
+} jio_file_port;
+
+#define JIO_FILE_PORT_V1 (offsetof(jio_file_port, latency))
+
+typedef struct {
+	uint16_t type;
+	uint16_t port;
+	uint32_t size; // payload bytes
+} jio_record;
+
+typedef struct {
+	uint64_t fcnt;
+	uint32_t nframes;
+	uint32_t pad;
+} jio_cycle;
+
+typedef struct {
+	uint32_t state;
+	uint32_t pad;
+	jack_position_t pos;
+} jio_transport;
+
+/* MIDI port buffer used by all non-JACK backends */
+typedef struct {
+	uint32_t time;
+	uint32_t size;
+	uint32_t offset;
+} jio_midi_event;
+
+typedef struct {
+	uint32_t n_events;
+	uint32_t used;
+	jio_midi_event ev[JIO_MIDI_EVENTS];
+	jack_midi_data_t data[JIO_MIDI_DATA];
+} jio_midi_buffer;
+
+typedef struct {
+	char name[32];
+	uint32_t flags;
+	jack_port_t *jport;
+	void *buf;       // non-JACK backends: jio_midi_buffer or float[buf_size]
+	size_t buf_size;
+	jack_latency_range_t latency[2]; // last read (JACK) or from the replay file
+} jio_port;
+
+static struct {
+	int backend;
+	jack_client_t *client;
+	uint32_t samplerate;
+	JackProcessCallback process;
+	void *process_arg;
+	jio_port ports[JIO_MAX_PORTS];
+	int n_ports;
+
+	/* period and freewheel, jio_set_buffer_size_callback() */
+	jack_nframes_t period;
+	volatile int freewheel;
+	JackBufferSizeCallback bufsize_cb;
+	void *bufsize_arg;
+	JackFreewheelCallback freewheel_cb;
+	void *freewheel_arg;
+
+	/* capture */
+	volatile int capture;
+	FILE *cap_file;
+	jack_ringbuffer_t *cap_rb;
+	char *cap_stage;
+	size_t cap_stage_size;
+	size_t cap_len;
+	int cap_overflow;
+	uint32_t cap_recorded; // bitmask of ports captured in this cycle
+	uint64_t cap_fcnt;
+	volatile unsigned long cap_dropped;
+	volatile int cap_run;
+	pthread_t cap_thread;
+	pthread_mutex_t cap_lock;
+	pthread_cond_t cap_ready;
+
+	/* replay and simulation */
+	jack_transport_state_t tp_state;
+	jack_position_t tp_pos;
+	unsigned long long out_events;
+	uint32_t out_hash;
+
+	/* replay */
+	FILE *rp_file;
+	int rp_map[JIO_MAX_PORTS]; // file port index -> jio port index
+	jio_file_port rp_ports[JIO_MAX_PORTS];
+	uint32_t rp_n_ports;
+
+	/* simulation */
+	jack_nframes_t sim_period;
+	uint64_t sim_fcnt;
+	int sim_link[JIO_MAX_PORTS]; // input port index -> output port index
+
+	/* process timing, written by the process thread only */
+	uint64_t tm_cycles;
+	uint64_t tm_sum_ns;
+	uint64_t tm_max_ns;
+	uint64_t tm_sum_load;  // ppm of period
+	uint64_t tm_max_load;  // ppm of period
+	uint64_t tm_overruns;  // cycles that took longer than the period
+	uint64_t tm_hist[JIO_TIMING_BINS];
+	double tm_interval;    // seconds between reports, 0: on request only
+	struct timespec tm_next;
+	volatile int tm_request;
+
+	/* host clock, written and read by the process thread only */
+	uint64_t clk_frames;   // sample-time at the start of this cycle
+	jack_nframes_t clk_period;
+	double clk_t0, clk_t1; // CLOCK_MONOTONIC [usec] of this and the next cycle
+	double clk_e2;         // filtered period [usec]
+	double clk_b, clk_c;   // loop coefficients
+	int64_t clk_origin;    // replay and simulation: CLOCK_MONOTONIC of sample 0
+	int64_t clk_realtime;  // CLOCK_REALTIME - CLOCK_MONOTONIC [usec]
+	uint64_t clk_resets;
+} jio = {
+	.backend = JIO_JACK,
+	.samplerate = 48000,
+	.period = 1024,
+	.cap_lock = PTHREAD_MUTEX_INITIALIZER,
+	.cap_ready = PTHREAD_COND_INITIALIZER,
+};
+
+/************************************************
+ * helpers
+ */
+
+static inline uint32_t jio_hash(uint32_t h, const void *data, size_t len) {
+	/* FNV-1a */
+	const unsigned char *d = (const unsigned char*) data;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h = (h ^ d[i]) * 16777619u;
+	}
+	return h;
+}
+
+static inline void jio_midi_buffer_clear(jio_midi_buffer *mb) {
+	mb->n_events = 0;
+	mb->used = 0;
+}
+
+static inline int jio_midi_buffer_add(jio_midi_buffer *mb, uint32_t time, const jack_midi_data_t *data, size_t size) {
+	if (mb->n_events >= JIO_MIDI_EVENTS || mb->used + size > JIO_MIDI_DATA) {
+		return -1;
+	}
+	jio_midi_event *ev = &mb->ev[mb->n_events++];
+	ev->time = time;
+	ev->size = size;
+	ev->offset = mb->used;
+	memcpy(&mb->data[mb->used], data, size);
+	mb->used += size;
+	return 0;
+}
+
+static inline int jio_port_index(const jio_port *p) {
+	return p - jio.ports;
+}
+
+/************************************************
+ * capture (RT side)
+ */
+
+static inline void jio_stage(uint16_t type, uint16_t port, const void *data, uint32_t size) {
+	jio_record r;
+	if (jio.cap_len + sizeof(jio_record) + size > jio.cap_stage_size) {
+		jio.cap_overflow = 1;
+		return;
+	}
+	r.type = type;
+	r.port = port;
+	r.size = size;
+	memcpy(jio.cap_stage + jio.cap_len, &r, sizeof(jio_record));
+	jio.cap_len += sizeof(jio_record);
+	if (size > 0) {
+		memcpy(jio.cap_stage + jio.cap_len, data, size);
+		jio.cap_len += size;
+	}
+}
+
+static inline void jio_capture_port(jio_port *p, void *buf, jack_nframes_t nframes) {
+	const int idx = jio_port_index(p);
+	if (jio.cap_recorded & (1 << idx)) {
+		return;
+	}
+	jio.cap_recorded |= 1 << idx;
+
+	if (!(p->flags & JIO_PORT_MIDI)) {
+		jio_stage(JIO_REC_AUDIO, idx, buf, nframes * sizeof(jack_default_audio_sample_t));
+		return;
+	}
+
+	/* MIDI payload: { uint32_t time, uint32_t size, data[size] }* */
+	const size_t hdr = jio.cap_len;
+	uint32_t n, nevents = jack_midi_get_event_count(buf);
+	jio_stage(JIO_REC_MIDI, idx, NULL, 0);
+	if (jio.cap_overflow) {
+		return;
+	}
+	for (n = 0; n < nevents; ++n) {
+		jack_midi_event_t ev;
+		uint32_t evh[2];
+		if (jack_midi_event_get(&ev, buf, n)) continue;
+		if (jio.cap_len + sizeof(evh) + ev.size > jio.cap_stage_size) {
+			jio.cap_overflow = 1;
+			return;
+		}
+		evh[0] = ev.time;
+		evh[1] = ev.size;
+		memcpy(jio.cap_stage + jio.cap_len, evh, sizeof(evh));
+		jio.cap_len += sizeof(evh);
+		memcpy(jio.cap_stage + jio.cap_len, ev.buffer, ev.size);
+		jio.cap_len += ev.size;
+	}
+	((jio_record*)(jio.cap_stage + hdr))->size = jio.cap_len - hdr - sizeof(jio_record);
+}
+
+static inline void jio_capture_begin(jack_nframes_t nframes) {
+	jio_cycle c;
+	c.fcnt = jio.cap_fcnt;
+	c.nframes = nframes;
+	c.pad = 0;
+	jio.cap_len = 0;
+	jio.cap_overflow = 0;
+	jio.cap_recorded = 0;
+	jio_stage(JIO_REC_CYCLE, 0, &c, sizeof(jio_cycle));
+}
+
+static inline void jio_capture_end(jack_nframes_t nframes) {
+	jio.cap_fcnt += nframes;
+	if (jio.cap_overflow || jack_ringbuffer_write_space(jio.cap_rb) < jio.cap_len) {
+		jio.cap_dropped++;
+		return;
+	}
+	jack_ringbuffer_write(jio.cap_rb, jio.cap_stage, jio.cap_len);
+	if (pthread_mutex_trylock (&jio.cap_lock) == 0) {
+		pthread_cond_signal (&jio.cap_ready);
+		pthread_mutex_unlock (&jio.cap_lock);
+	}
+}
+
+/************************************************
+ * process timing (RT side)
+ */
+
+/* single writer: relaxed load + store, no locked read-modify-write */
+#define JIO_RELAXED_ADD(VAR, VAL) \
+	__atomic_store_n(&(VAR), __atomic_load_n(&(VAR), __ATOMIC_RELAXED) + (VAL), __ATOMIC_RELAXED)
+#define JIO_RELAXED_MAX(VAR, VAL) \
+	if ((VAL) > __atomic_load_n(&(VAR), __ATOMIC_RELAXED)) __atomic_store_n(&(VAR), (VAL), __ATOMIC_RELAXED)
+
+static inline void jio_timing_add(jack_nframes_t nframes, const struct timespec *t0, const struct timespec *t1) {
+	const int64_t dt = (t1->tv_sec - t0->tv_sec) * 1000000000LL + (t1->tv_nsec - t0->tv_nsec);
+	const uint64_t ns = dt > 0 ? dt : 0;
+	const uint64_t load = nframes > 0 ? ns * jio.samplerate / (nframes * 1000ULL) : 0;
+	int bin = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+	if (bin >= JIO_TIMING_BINS) bin = JIO_TIMING_BINS - 1;
+
+	JIO_RELAXED_ADD(jio.tm_hist[bin], 1);
+	JIO_RELAXED_ADD(jio.tm_sum_ns, ns);
+	JIO_RELAXED_ADD(jio.tm_sum_load, load);
+	JIO_RELAXED_MAX(jio.tm_max_ns, ns);
+	JIO_RELAXED_MAX(jio.tm_max_load, load);
+	if (load > 1000000) {
+		JIO_RELAXED_ADD(jio.tm_overruns, 1);
+	}
+	JIO_RELAXED_ADD(jio.tm_cycles, 1);
+}
+
+/************************************************
+ * host clock (RT side)
+ *
+ * Second order DLL (F. Adriaensen, "Using a DLL to filter time", 2005).
+ * With JACK the start of each cycle is taken from jack_get_cycle_times()
+ * and moved from JACK's time base to CLOCK_MONOTONIC by an offset that
+ * is measured every cycle. The loop is reset after a period change,
+ * during freewheeling and when a cycle starts more than one period off
+ * (xrun, suspend).
+ */
+
+static inline int64_t jio_timespec_usec(const struct timespec *ts) {
+	return ts->tv_sec * 1000000LL + ts->tv_nsec / 1000;
+}
+
+static inline void jio_clock_update(jack_nframes_t nframes) {
+	const double period = nframes * 1e6 / jio.samplerate;
+	struct timespec ts;
+	int64_t mono;
+	double t;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	jio.clk_realtime = jio_timespec_usec(&ts);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono = jio_timespec_usec(&ts);
+	jio.clk_realtime -= mono;
+
+	if (jio.backend == JIO_JACK) {
+		jack_nframes_t cur_frames;
+		jack_time_t cur_usecs, next_usecs;
+		float period_usecs;
+		const jack_time_t jnow = jack_get_time();
+		if (jack_get_cycle_times(jio.client, &cur_frames, &cur_usecs, &next_usecs, &period_usecs)) {
+			cur_usecs = jack_frames_to_time(jio.client, jack_last_frame_time(jio.client));
+		}
+		t = mono + ((int64_t) cur_usecs - (int64_t) jnow);
+	} else {
+		if (jio.clk_frames == 0) {
+			jio.clk_origin = mono;
+		}
+		t = jio.clk_origin + jio.clk_frames * 1e6 / jio.samplerate;
+	}
+
+	if (jio.clk_period != nframes || jio.freewheel || fabs(t - jio.clk_t1) > period) {
+		const double w = 2.0 * M_PI * JIO_DLL_BW * period / 1e6;
+		jio.clk_b = sqrt(2.0) * w;
+		jio.clk_c = w * w;
+		jio.clk_e2 = period;
+		jio.clk_t0 = t;
+		jio.clk_t1 = t + period;
+		if (jio.clk_period != 0) {
+			++jio.clk_resets;
+		}
+		jio.clk_period = nframes;
+	} else {
+		const double e = t - jio.clk_t1;
+		jio.clk_t0 = jio.clk_t1;
+		jio.clk_t1 += jio.clk_b * e + jio.clk_e2;
+		jio.clk_e2 += jio.clk_c * e;
+	}
+}
+
+/* CLOCK_MONOTONIC [usec] of @sample (frames since the first cycle),
+ * extrapolated from the current cycle; process thread only */
+static inline int64_t jio_sample_to_monotonic(uint64_t sample) {
+	const double d = (double)(int64_t)(sample - jio.clk_frames);
+	return llrint(jio.clk_t0 + d * (jio.clk_t1 - jio.clk_t0) / jio.clk_period);
+}
+
+static inline int64_t jio_monotonic_to_realtime(int64_t usec) {
+	return usec + jio.clk_realtime;
+}
+
+/* invoke the process callback, used by all backends */
+static inline int jio_run_process(jack_nframes_t nframes) {
+	struct timespec t0, t1;
+	int rv;
+	jio_clock_update(nframes);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	rv = jio.process(nframes, jio.process_arg);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	jio.clk_frames += nframes;
+	if (!jio.freewheel) {
+		/* DSP load is meaningless faster than realtime */
+		jio_timing_add(nframes, &t0, &t1);
+	}
+	return rv;
+}
+
+static inline int jio_jack_process(jack_nframes_t nframes, void *arg) {
+	int rv;
+	const int capture = jio.capture;
+	if (capture) jio_capture_begin(nframes);
+	rv = jio_run_process(nframes);
+	if (capture) jio_capture_end(nframes);
+	return rv;
+}
+
+/* capture staging for one cycle of @nframes */
+static inline size_t jio_capture_per_cycle(jack_nframes_t nframes) {
+	size_t per_cycle = sizeof(jio_record) * (2 + jio.n_ports) + sizeof(jio_cycle) + sizeof(jio_transport);
+	int i;
+	for (i = 0; i < jio.n_ports; ++i) {
+		const uint32_t flags = jio.ports[i].flags;
+		if (!(flags & JIO_PORT_INPUT)) continue;
+		if (flags & JIO_PORT_MIDI) {
+			per_cycle += JIO_MIDI_DATA;
+		} else {
+			per_cycle += nframes * sizeof(jack_default_audio_sample_t);
+		}
+	}
+	return per_cycle;
+}
+
+/* capture ring: JIO_CAPTURE_SEC of typical data at the current period,
+ * and at least two worst-case cycles */
+static inline size_t jio_capture_ring_size(void) {
+	const jack_nframes_t period = jio.period > 0 ? jio.period : 256;
+	size_t typical = sizeof(jio_record) * (2 + jio.n_ports) + sizeof(jio_cycle) + sizeof(jio_transport);
+	int i;
+	for (i = 0; i < jio.n_ports; ++i) {
+		const uint32_t flags = jio.ports[i].flags;
+		if (!(flags & JIO_PORT_INPUT)) continue;
+		if (flags & JIO_PORT_MIDI) {
+			typical += JIO_CAPTURE_MIDI;
+		} else {
+			typical += period * sizeof(jack_default_audio_sample_t);
+		}
+	}
+	const size_t size = typical * ceil(JIO_CAPTURE_SEC * jio.samplerate / period);
+	const size_t min = 2 * jio_capture_per_cycle(period);
+	return size > min ? size : min;
+}
+
+/* JACK does not run process() while the buffer-size changes; the capture
+ * stage is allocated for JIO_MAX_PERIOD, the ring is not re-sized */
+static inline int jio_jack_buffer_size(jack_nframes_t nframes, void *arg) {
+	jio.period = nframes;
+	if (jio.capture && 2 * jio_capture_per_cycle(nframes) > jio.cap_rb->size) {
+		fprintf(stderr, "capture: buffer too small for %u frames/period, cycles may be lost.\n", nframes);
+	}
+	if (jio.bufsize_cb) {
+		return jio.bufsize_cb(nframes, jio.bufsize_arg);
+	}
+	return 0;
+}
+
+static inline void jio_jack_freewheel(int starting, void *arg) {
+	jio.freewheel = starting;
+	if (jio.freewheel_cb) {
+		jio.freewheel_cb(starting, jio.freewheel_arg);
+	}
+}
+
+/************************************************
+ * process-callback API
+ */
+
+static inline void *jio_port_get_buffer(jio_port *p, jack_nframes_t nframes) {
+	if (jio.backend == JIO_JACK) {
+		void *buf = jack_port_get_buffer(p->jport, nframes);
+		if (jio.capture && (p->flags & JIO_PORT_INPUT)) {
+			jio_capture_port(p, buf, nframes);
+		}
+		return buf;
+	}
+	return p->buf;
+}
+
+static inline uint32_t jio_midi_get_event_count(void *buf) {
+	if (jio.backend == JIO_JACK) {
+		return jack_midi_get_event_count(buf);
+	}
+	return ((jio_midi_buffer*)buf)->n_events;
+}
+
+static inline int jio_midi_event_get(jack_midi_event_t *ev, void *buf, uint32_t idx) {
+	if (jio.backend == JIO_JACK) {
+		return jack_midi_event_get(ev, buf, idx);
+	}
+	jio_midi_buffer *mb = (jio_midi_buffer*) buf;
+	if (idx >= mb->n_events) {
+		return -1;
+	}
+	ev->time = mb->ev[idx].time;
+	ev->size = mb->ev[idx].size;
+	ev->buffer = &mb->data[mb->ev[idx].offset];
+	return 0;
+}
+
+static inline void jio_midi_clear_buffer(void *buf) {
+	if (jio.backend == JIO_JACK) {
+		jack_midi_clear_buffer(buf);
+		return;
+	}
+	jio_midi_buffer_clear((jio_midi_buffer*) buf);
+}
+
+static inline int jio_midi_event_write(void *buf, jack_nframes_t time, const jack_midi_data_t *data, size_t size) {
+	if (jio.backend == JIO_JACK) {
+		return jack_midi_event_write(buf, time, data, size);
+	}
+	uint32_t t = time;
+	jio.out_events++;
+	jio.out_hash = jio_hash(jio.out_hash, &t, sizeof(uint32_t));
+	jio.out_hash = jio_hash(jio.out_hash, data, size);
+	return jio_midi_buffer_add((jio_midi_buffer*) buf, time, data, size);
+}
+
+static inline jack_transport_state_t jio_transport_query(jack_position_t *pos) {
+	if (jio.backend == JIO_JACK) {
+		jack_transport_state_t state = jack_transport_query(jio.client, pos);
+		if (jio.capture && !(jio.cap_recorded & (1u << JIO_MAX_PORTS))) {
+			jio_transport t;
+			jio.cap_recorded |= 1u << JIO_MAX_PORTS;
+			t.state = state;
+			t.pad = 0;
+			memcpy(&t.pos, pos, sizeof(jack_position_t));
+			jio_stage(JIO_REC_TRANSPORT, 0, &t, sizeof(jio_transport));
+		}
+		return state;
+	}
+	memcpy(pos, &jio.tp_pos, sizeof(jack_position_t));
+	return jio.tp_state;
+}
+
+/************************************************
+ * setup
+ */
+
+static inline void jio_set_process_callback(jack_client_t *client, JackProcessCallback cb, void *arg) {
+	jio.client = client;
+	jio.process = cb;
+	jio.process_arg = arg;
+	if (client) {
+		jio.samplerate = jack_get_sample_rate(client);
+		jio.period = jack_get_buffer_size(client);
+		jack_set_process_callback(client, jio_jack_process, NULL);
+		jack_set_buffer_size_callback(client, jio_jack_buffer_size, NULL);
+		jack_set_freewheel_callback(client, jio_jack_freewheel, NULL);
+		jack_set_thread_init_callback(client, rtmem_thread_init, NULL);
+		rtmem.stack_pending = 1;
+	}
+}
+
+/* @cb is called with the new period before process() runs with it,
+ * (not in the realtime thread, and never concurrently with process());
+ * also by the replay and simulation backends. */
+static inline void jio_set_buffer_size_callback(JackBufferSizeCallback cb, void *arg) {
+	jio.bufsize_cb = cb;
+	jio.bufsize_arg = arg;
+}
+
+/* @cb is called when JACK enters (1) or leaves (0) freewheel mode */
+static inline void jio_set_freewheel_callback(JackFreewheelCallback cb, void *arg) {
+	jio.freewheel_cb = cb;
+	jio.freewheel_arg = arg;
+}
+
+static inline jack_nframes_t jio_period(void) {
+	return jio.period;
+}
+
+static inline int jio_freewheeling(void) {
+	return jio.freewheel;
+}
+
+/* not in the process callback; replay returns the captured values,
+ * simulation none */
+static inline void jio_port_get_latency_range(jio_port *p, jack_latency_callback_mode_t mode, jack_latency_range_t *range) {
+	if (jio.backend == JIO_JACK) {
+		jack_port_get_latency_range(p->jport, mode, range);
+		p->latency[mode == JackPlaybackLatency] = *range;
+		return;
+	}
+	*range = p->latency[mode == JackPlaybackLatency];
+}
+
+static inline jio_port *jio_port_register(const char *name, const char *type, unsigned long flags) {
+	jio_port *p;
+	if (jio.n_ports >= JIO_MAX_PORTS) {
+		return NULL;
+	}
+	p = &jio.ports[jio.n_ports];
+	memset(p, 0, sizeof(jio_port));
+	strncpy(p->name, name, sizeof(p->name) - 1);
+	if (flags & JackPortIsInput) p->flags |= JIO_PORT_INPUT;
+	if (!strcmp(type, JACK_DEFAULT_MIDI_TYPE)) p->flags |= JIO_PORT_MIDI;
+
+	if (jio.backend == JIO_JACK) {
+		if (!(p->jport = jack_port_register(jio.client, name, type, flags, 0))) {
+			return NULL;
+		}
+	} else if (p->flags & JIO_PORT_MIDI) {
+		p->buf = calloc(1, sizeof(jio_midi_buffer));
+	}
+	if (jio.backend == JIO_REPLAY) {
+		uint32_t i, m;
+		for (i = 0; i < jio.rp_n_ports; ++i) {
+			const jio_file_port *fp = &jio.rp_ports[i];
+			if (strcmp(fp->name, p->name) || fp->flags != p->flags) continue;
+			for (m = 0; m < 2; ++m) {
+				p->latency[m].min = fp->latency[m][0];
+				p->latency[m].max = fp->latency[m][1];
+			}
+		}
+	}
+	jio.sim_link[jio.n_ports] = -1;
+	++jio.n_ports;
+	return p;
+}
+
+static inline uint32_t jio_samplerate(void) {
+	return jio.samplerate;
+}
+
+/************************************************
+ * capture (non-RT side)
+ */
+
+static inline void *jio_capture_thread(void *arg) {
+	jack_ringbuffer_data_t vec[2];
+	int i;
+	pthread_mutex_lock (&jio.cap_lock);
+	while (1) {
+		jack_ringbuffer_get_read_vector(jio.cap_rb, vec);
+		for (i = 0; i < 2; ++i) {
+			if (vec[i].len == 0) continue;
+			if (fwrite(vec[i].buf, 1, vec[i].len, jio.cap_file) != vec[i].len) {
+				fprintf(stderr, "capture: write error.\n");
+			}
+			jack_ringbuffer_read_advance(jio.cap_rb, vec[i].len);
+		}
+		if (!jio.cap_run) break;
+		pthread_cond_wait (&jio.cap_ready, &jio.cap_lock);
+	}
+	pthread_mutex_unlock (&jio.cap_lock);
+	return NULL;
+}
+
+static inline void jio_capture_header(void) {
+	jio_file_header hdr;
+	int i, m;
+	memcpy(hdr.magic, JIO_MAGIC, 8);
+	hdr.samplerate = jio.samplerate;
+	hdr.n_ports = jio.n_ports;
+	fwrite(&hdr, sizeof(jio_file_header), 1, jio.cap_file);
+	for (i = 0; i < jio.n_ports; ++i) {
+		jio_file_port fp;
+		memset(&fp, 0, sizeof(jio_file_port));
+		memcpy(fp.name, jio.ports[i].name, sizeof(fp.name));
+		fp.flags = jio.ports[i].flags;
+		for (m = 0; m < 2; ++m) {
+			fp.latency[m][0] = jio.ports[i].latency[m].min;
+			fp.latency[m][1] = jio.ports[i].latency[m].max;
+		}
+		fwrite(&fp, sizeof(jio_file_port), 1, jio.cap_file);
+	}
+}
+
+/* call after all ports have been registered and before activating the client */
+static inline int jio_capture_start(const char *path) {
+	const size_t per_cycle = jio_capture_per_cycle(JIO_MAX_PERIOD);
+
+	if (jio.backend != JIO_JACK || !jio.client) {
+		return -1;
+	}
+	if (!(jio.cap_file = fopen(path, "wb"))) {
+		fprintf(stderr, "cannot open capture file '%s'.\n", path);
+		return -1;
+	}
+	jio_capture_header();
+
+	jio.cap_stage_size = per_cycle;
+	jio.cap_stage = rtmem_alloc(per_cycle);
+	jio.cap_rb = rtmem_ringbuffer(jio_capture_ring_size());
+	if (!jio.cap_stage || !jio.cap_rb) {
+		fclose(jio.cap_file);
+		jio.cap_file = NULL;
+		return -1;
+	}
+	jio.cap_run = 1;
+	if (pthread_create(&jio.cap_thread, NULL, jio_capture_thread, NULL)) {
+		fclose(jio.cap_file);
+		jio.cap_file = NULL;
+		return -1;
+	}
+	jio.capture = 1;
+	return 0;
+}
+
+static inline void jio_capture_stop(void) {
+	if (!jio.cap_file) {
+		return;
+	}
+	jio.capture = 0;
+	pthread_mutex_lock (&jio.cap_lock);
+	jio.cap_run = 0;
+	pthread_cond_signal (&jio.cap_ready);
+	pthread_mutex_unlock (&jio.cap_lock);
+	pthread_join(jio.cap_thread, NULL);
+	/* latencies are known once the client is connected */
+	if (fseek(jio.cap_file, 0, SEEK_SET) == 0) {
+		jio_capture_header();
+	} else {
+		fprintf(stderr, "capture: cannot update port latencies (file not seekable).\n");
+	}
+	fclose(jio.cap_file);
+	jio.cap_file = NULL;
+	rtmem_ringbuffer_free(jio.cap_rb);
+	rtmem_free(jio.cap_stage);
+	if (jio.cap_dropped > 0) {
+		fprintf(stderr, "capture: %lu cycles were lost (disk too slow).\n", jio.cap_dropped);
+	}
+}
+
+/************************************************
+ * replay
+ */
+
+/* call before registering ports */
+static inline int jio_replay_open(const char *path) {
+	jio_file_header hdr;
+	size_t port_size = sizeof(jio_file_port);
+	uint32_t i;
+	if (!(jio.rp_file = fopen(path, "rb"))) {
+		fprintf(stderr, "cannot open replay file '%s'.\n", path);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(jio_file_header), 1, jio.rp_file) != 1
+			|| (memcmp(hdr.magic, JIO_MAGIC, 8) && memcmp(hdr.magic, JIO_MAGIC_V1, 8))) {
+		hdr.n_ports = ~0;
+	} else if (!memcmp(hdr.magic, JIO_MAGIC_V1, 8)) {
+		port_size = JIO_FILE_PORT_V1;
+	}
+	memset(jio.rp_ports, 0, sizeof(jio.rp_ports));
+	for (i = 0; hdr.n_ports <= JIO_MAX_PORTS && i < hdr.n_ports; ++i) {
+		if (fread(&jio.rp_ports[i], port_size, 1, jio.rp_file) != 1) {
+			hdr.n_ports = ~0;
+			break;
+		}
+		jio.rp_ports[i].name[sizeof(jio.rp_ports[i].name) - 1] = '\0';
+	}
+	if (hdr.n_ports > JIO_MAX_PORTS) {
+		fprintf(stderr, "invalid replay file '%s'.\n", path);
+		fclose(jio.rp_file);
+		jio.rp_file = NULL;
+		return -1;
+	}
+	jio.backend = JIO_REPLAY;
+	jio.samplerate = hdr.samplerate;
+	jio.rp_n_ports = hdr.n_ports;
+	return 0;
+}
+
+static inline int jio_replay_map_ports(void) {
+	uint32_t i;
+	int k;
+	for (i = 0; i < jio.rp_n_ports; ++i) {
+		const jio_file_port *fp = &jio.rp_ports[i];
+		jio.rp_map[i] = -1;
+		for (k = 0; k < jio.n_ports; ++k) {
+			if (!strcmp(fp->name, jio.ports[k].name) && fp->flags == jio.ports[k].flags) {
+				jio.rp_map[i] = k;
+			}
+		}
+		if (jio.rp_map[i] < 0) {
+			fprintf(stderr, "replay: ignoring data for port '%s'.\n", fp->name);
+		}
+	}
+	return 0;
+}
+
+static inline void jio_port_clear(jio_port *p, jack_nframes_t nframes) {
+	if (p->flags & JIO_PORT_MIDI) {
+		jio_midi_buffer_clear((jio_midi_buffer*) p->buf);
+		return;
+	}
+	if (p->buf_size < nframes) {
+		free(p->buf);
+		p->buf = malloc(nframes * sizeof(jack_default_audio_sample_t));
+		p->buf_size = nframes;
+	}
+	memset(p->buf, 0, nframes * sizeof(jack_default_audio_sample_t));
+}
+
+static inline void jio_replay_prepare(jack_nframes_t nframes) {
+	int k;
+	for (k = 0; k < jio.n_ports; ++k) {
+		jio_port_clear(&jio.ports[k], nframes);
+	}
+	jio.tp_state = JackTransportStopped;
+	memset(&jio.tp_pos, 0, sizeof(jack_position_t));
+	jio.tp_pos.frame_rate = jio.samplerate;
+}
+
+static inline void jio_replay_apply(const jio_record *r, const char *payload, jack_nframes_t nframes) {
+	jio_port *p;
+	if (r->type == JIO_REC_TRANSPORT && r->size == sizeof(jio_transport)) {
+		const jio_transport *t = (const jio_transport*) payload;
+		jio.tp_state = (jack_transport_state_t) t->state;
+		memcpy(&jio.tp_pos, &t->pos, sizeof(jack_position_t));
+		return;
+	}
+	if (r->port >= jio.rp_n_ports || jio.rp_map[r->port] < 0) {
+		return;
+	}
+	p = &jio.ports[jio.rp_map[r->port]];
+
+	if (r->type == JIO_REC_AUDIO && !(p->flags & JIO_PORT_MIDI)) {
+		size_t len = r->size;
+		if (len > nframes * sizeof(jack_default_audio_sample_t)) {
+			len = nframes * sizeof(jack_default_audio_sample_t);
+		}
+		memcpy(p->buf, payload, len);
+	}
+	else if (r->type == JIO_REC_MIDI && (p->flags & JIO_PORT_MIDI)) {
+		uint32_t off = 0;
+		while (off + 2 * sizeof(uint32_t) <= r->size) {
+			uint32_t evh[2];
+			memcpy(evh, payload + off, sizeof(evh));
+			off += sizeof(evh);
+			if (off + evh[1] > r->size) break;
+			jio_midi_buffer_add((jio_midi_buffer*) p->buf, evh[0], (const jack_midi_data_t*) payload + off, evh[1]);
+			off += evh[1];
+		}
+	}
+}
+
+/* run all cycles of the replay file through the process callback,
+ * idle() is called after each cycle (e.g. to flush messages)
+ */
+static inline int jio_replay_run(void (*idle)(void)) {
+	jio_record r;
+	jio_cycle cycle;
+	int have_cycle = 0;
+	char *payload = NULL;
+	size_t payload_size = 0;
+	unsigned long long n_cycles = 0, n_frames = 0;
+	struct timespec t0, t1;
+
+	if (jio.backend != JIO_REPLAY || !jio.process || jio_replay_map_ports()) {
+		return -1;
+	}
+
+	jio.out_hash = 2166136261u;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	while (1) {
+		const int eof = fread(&r, sizeof(jio_record), 1, jio.rp_file) != 1;
+		if (!eof && r.size > payload_size) {
+			free(payload);
+			payload_size = r.size;
+			payload = malloc(payload_size);
+		}
+		if (!eof && r.size > 0 && fread(payload, 1, r.size, jio.rp_file) != r.size) {
+			fprintf(stderr, "replay: truncated file.\n");
+			break;
+		}
+
+		if (eof || r.type == JIO_REC_CYCLE) {
+			if (have_cycle) {
+				jio_run_process(cycle.nframes);
+				if (idle) idle();
+				++n_cycles;
+				n_frames += cycle.nframes;
+			}
+			if (eof) break;
+			if (r.size != sizeof(jio_cycle)) {
+				fprintf(stderr, "replay: invalid cycle record.\n");
+				break;
+			}
+			memcpy(&cycle, payload, sizeof(jio_cycle));
+			if (cycle.nframes != jio.period) {
+				jio.period = cycle.nframes;
+				if (jio.bufsize_cb) jio.bufsize_cb(cycle.nframes, jio.bufsize_arg);
+			}
+			jio_replay_prepare(cycle.nframes);
+			have_cycle = 1;
+			continue;
+		}
+		if (have_cycle) {
+			jio_replay_apply(&r, payload, cycle.nframes);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	const double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	const double duration = n_frames / (double) jio.samplerate;
+	fprintf(stderr, "replay: %llu cycles, %.1f sec in %.3f sec (%.1fx realtime), %llu events out, checksum %08x\n",
+			n_cycles, duration, elapsed, elapsed > 0 ? duration / elapsed : 0,
+			jio.out_events, jio.out_hash);
+
+	free(payload);
+	fclose(jio.rp_file);
+	jio.rp_file = NULL;
+	return 0;
+}
+
+/************************************************
+ * simulation
+ */
+
+/* call before registering ports */
+static inline void jio_sim_open(uint32_t samplerate, jack_nframes_t period) {
+	jio.backend = JIO_SIM;
+	jio.samplerate = samplerate;
+	jio.sim_period = period;
+	jio.period = period;
+	jio.sim_fcnt = 0;
+	jio.out_hash = 2166136261u;
+	jio.tp_state = JackTransportStopped;
+	memset(&jio.tp_pos, 0, sizeof(jack_position_t));
+	jio.tp_pos.frame_rate = samplerate;
+}
+
+/* data written to output port @src is received on input port @dst
+ * in the following cycle (just like a feedback connection in JACK) */
+static inline int jio_sim_connect(jio_port *src, jio_port *dst) {
+	if (jio.backend != JIO_SIM
+			|| (src->flags & JIO_PORT_INPUT) || !(dst->flags & JIO_PORT_INPUT)
+			|| (src->flags & JIO_PORT_MIDI) != (dst->flags & JIO_PORT_MIDI)) {
+		return -1;
+	}
+	jio.sim_link[jio_port_index(dst)] = jio_port_index(src);
+	return 0;
+}
+
+static inline void jio_sim_transport(jack_transport_state_t state, jack_nframes_t frame) {
+	jio.tp_state = state;
+	jio.tp_pos.frame = frame;
+}
+
+static inline void jio_sim_set_period(jack_nframes_t period) {
+	jio.sim_period = period;
+	if (period != jio.period) {
+		jio.period = period;
+		if (jio.bufsize_cb) jio.bufsize_cb(period, jio.bufsize_arg);
+	}
+}
+
+/* monotonic sample-time at the start of the next cycle */
+static inline uint64_t jio_sim_time(void) {
+	return jio.sim_fcnt;
+}
+
+/* run one process cycle and advance the clock and transport */
+static inline int jio_sim_cycle(void) {
+	int k;
+	const jack_nframes_t nframes = jio.sim_period;
+
+	for (k = 0; k < jio.n_ports; ++k) {
+		jio_port *p = &jio.ports[k];
+		if (!(p->flags & JIO_PORT_INPUT)) continue;
+		if (jio.sim_link[k] < 0) {
+			jio_port_clear(p, nframes);
+			continue;
+		}
+		jio_port *src = &jio.ports[jio.sim_link[k]];
+		if (p->flags & JIO_PORT_MIDI) {
+			memcpy(p->buf, src->buf, sizeof(jio_midi_buffer));
+		} else {
+			jio_port_clear(p, nframes);
+			if (src->buf) {
+				memcpy(p->buf, src->buf, (src->buf_size < nframes ? src->buf_size : nframes) * sizeof(jack_default_audio_sample_t));
+			}
+		}
+	}
+	for (k = 0; k < jio.n_ports; ++k) {
+		if (!(jio.ports[k].flags & JIO_PORT_INPUT)) {
+			jio_port_clear(&jio.ports[k], nframes);
+		}
+	}
+
+	const int rv = jio_run_process(nframes);
+
+	jio.sim_fcnt += nframes;
+	if (jio.tp_state == JackTransportRolling) {
+		jio.tp_pos.frame += nframes;
+	} else if (jio.tp_state == JackTransportStarting) {
+		jio.tp_state = JackTransportRolling;
+	}
+	return rv;
+}
+
+/************************************************
+ * process timing (non-RT side)
+ */
+
+static inline void jio_timing_fmt(char *buf, size_t len, double ns) {
+	if (ns < 1e3) {
+		snprintf(buf, len, "%.0f ns", ns);
+	} else if (ns < 1e6) {
+		snprintf(buf, len, "%.1f us", ns / 1e3);
+	} else {
+		snprintf(buf, len, "%.1f ms", ns / 1e6);
+	}
+}
+
+static inline void jio_timing_print(FILE *f) {
+	uint64_t hist[JIO_TIMING_BINS];
+	char lo[16], hi[16];
+	int k;
+
+	const uint64_t cycles = __atomic_load_n(&jio.tm_cycles, __ATOMIC_RELAXED);
+	const uint64_t sum_ns = __atomic_load_n(&jio.tm_sum_ns, __ATOMIC_RELAXED);
+	const uint64_t max_ns = __atomic_load_n(&jio.tm_max_ns, __ATOMIC_RELAXED);
+	const uint64_t sum_load = __atomic_load_n(&jio.tm_sum_load, __ATOMIC_RELAXED);
+	const uint64_t max_load = __atomic_load_n(&jio.tm_max_load, __ATOMIC_RELAXED);
+	const uint64_t overruns = __atomic_load_n(&jio.tm_overruns, __ATOMIC_RELAXED);
+	for (k = 0; k < JIO_TIMING_BINS; ++k) {
+		hist[k] = __atomic_load_n(&jio.tm_hist[k], __ATOMIC_RELAXED);
+	}
+
+	if (cycles == 0) {
+		fprintf(f, "process(): no cycles.\n");
+		return;
+	}
+	jio_timing_fmt(lo, sizeof(lo), sum_ns / (double) cycles);
+	jio_timing_fmt(hi, sizeof(hi), max_ns);
+	fprintf(f, "process(): %llu cycles, mean %s, WCET %s, period used: mean %.2f%% max %.2f%%, overruns: %llu\n",
+			(unsigned long long) cycles, lo, hi,
+			sum_load / (double) cycles / 1e4, max_load / 1e4,
+			(unsigned long long) overruns);
+	for (k = 0; k < JIO_TIMING_BINS; ++k) {
+		if (hist[k] == 0) continue;
+		jio_timing_fmt(lo, sizeof(lo), (double)(1ULL << k));
+		jio_timing_fmt(hi, sizeof(hi), (double)(1ULL << (k + 1)));
+		fprintf(f, "  %9s .. %9s %12llu %6.2f%%\n", lo, hi,
+				(unsigned long long) hist[k], 100.0 * hist[k] / cycles);
+	}
+	fflush(f);
+}
+
+/* @usec CLOCK_REALTIME as UTC, ISO 8601 with microseconds */
+static inline void jio_format_realtime(char *buf, size_t len, int64_t usec) {
+	const time_t sec = usec / 1000000;
+	struct tm tm;
+	char tmp[24];
+	gmtime_r(&sec, &tm);
+	strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf, len, "%s.%06dZ", tmp, (int)(usec % 1000000));
+}
+
+/* print timing statistics every @sec seconds (0: on request only) */
+static inline void jio_timing_interval(double sec) {
+	jio.tm_interval = sec;
+	clock_gettime(CLOCK_REALTIME, &jio.tm_next);
+	jio.tm_next.tv_sec += (time_t) sec;
+	jio.tm_next.tv_nsec += (sec - (time_t) sec) * 1e9;
+	if (jio.tm_next.tv_nsec >= 1000000000L) {
+		jio.tm_next.tv_nsec -= 1000000000L;
+		++jio.tm_next.tv_sec;
+	}
+}
+
+/* async-signal safe, e.g. from a SIGUSR1 handler */
+static inline void jio_timing_request(void) {
+	jio.tm_request = 1;
+}
+
+/* call from the non-RT thread: print if requested or due */
+static inline void jio_timing_poll(FILE *f) {
+	struct timespec now;
+	int due = 0;
+	if (jio.tm_interval > 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		due = now.tv_sec > jio.tm_next.tv_sec
+			|| (now.tv_sec == jio.tm_next.tv_sec && now.tv_nsec >= jio.tm_next.tv_nsec);
+	}
+	if (!due && !jio.tm_request) {
+		return;
+	}
+	jio.tm_request = 0;
+	if (due) {
+		jio_timing_interval(jio.tm_interval);
+	}
+	jio_timing_print(f);
+}
+
+/* pthread_cond_wait() that also wakes up for periodic timing reports */
+static inline int jio_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	if (jio.tm_interval > 0) {
+		return pthread_cond_timedwait(cond, mutex, &jio.tm_next);
+	}
+	return pthread_cond_wait(cond, mutex);
+}
+
+static inline void jio_cleanup(void) {
+	int k;
+	jio_capture_stop();
+	for (k = 0; k < jio.n_ports; ++k) {
+		free(jio.ports[k].buf);
+		jio.ports[k].buf = NULL;
+	}
+	jio.n_ports = 0;
+}
+
+#endif
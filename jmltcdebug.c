@@ -30,7 +30,6 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
-#include <sys/mman.h>
 
 #ifndef WIN32
 #include <signal.h>
@@ -42,11 +41,20 @@
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 
+#include "jackio.h"
+#include "mtcparse.h"
+#include "metrics.h"
+#include "mtcgen.h"
+#include "mtcindex.h"
+#include "mtcshm.h"
+
 #include <ltc.h>
+#include "ltcparse.h"
+#include "ltcedge.h"
 #include <timecode/timecode.h>
 #define LTC_QUEUE_LEN (42)
 
-#define RBSIZE (80)
+#define RBSIZE (256) // > timecodes decoded in a JIO_MAX_PERIOD cycle
 
 typedef struct {
 	int ltcid;
@@ -58,83 +66,89 @@ typedef struct {
 	int type;
 	int tick;
 	unsigned long long int tme;
+	double start;  // @tme, LTC: to a fraction of a sample
+	int64_t mono;  // host time of @start [usec]
+	int64_t real;
+
+	/* LTC signal quality */
+	float volume;  // dBFS
+	float jitter;  // bit-period standard deviation [samples]
+	int duration;  // frame length [samples]
+	int reverse;
+	float fit;     // rms of the sync word edge fit [samples], -1: not refined
 } timecode;
 
 typedef struct {
-	timecode tc;
-	int full_tc;
-	int have_first_full;
+	MTCParser parser;
+	int ltcid;
 } MTCtc;
 
+/* failover, see below */
+static int fo_nprio = 0;
+static MTCShm fo_shm;
+static void failover_activity(int src, unsigned long long tme);
+static void failover_frame(int src, int type, int32_t fn, unsigned long long tme, int reverse);
+static void failover_cycle(unsigned long long now, jack_nframes_t nframes);
+static void failover_print(void);
+
 /* global Vars */
 static MTCtc *mtctimecode = NULL;
 static MTCtc *mtctimecode2 = NULL;
 
 static LTCDecoder *decoder = NULL;
 static LTCDecoder *decoder2 = NULL;
+static LTCEdge ltc_edge[2];
 static jack_ringbuffer_t *rb = NULL;
 static pthread_mutex_t msg_thread_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
 
-const char MTCTYPE[4][10] = {
-	"24fps",
-	"25fps",
-	"29fps",
-	"30fps",
-};
-
-const double expected_tme[4] = {
-	24, 25, 30000.0/1001.0, 30
-};
-
 static TimecodeRate const* mtctc[4];
 
+/* statistics per source: MTC1, MTC2, LTC1, LTC2
+ * relaxed atomics (read by the metrics thread) */
+static uint64_t m_frames[4];
+static uint64_t m_tc[4];
+static uint64_t m_ltc_errors[2];
+static uint64_t m_dropped = 0;
+
 /* options */
 char newline = '\r'; // or '\n';
 
 static int fps_num = 25; // LTC
 static int fps_den = 1;
 
-/************************************************
- * parse MTC message data
- */
+static char *capture_file = NULL;
+static char *replay_file = NULL;
+static char *metrics_path = NULL;
+static double timing_interval = 0;
+
+static float bit_jitter(const LTCFrameExt *frame) {
+	int i;
+	float sum = 0, sum2 = 0;
+	for (i = 0; i < LTC_FRAME_BIT_COUNT; ++i) {
+		sum  += frame->biphase_tics[i];
+		sum2 += frame->biphase_tics[i] * frame->biphase_tics[i];
+	}
+	const float mean = sum / LTC_FRAME_BIT_COUNT;
+	const float var = sum2 / LTC_FRAME_BIT_COUNT - mean * mean;
+	return var > 0 ? sqrtf(var) : 0;
+}
 
-#define SE(ARG) mtc->tc.tick=ARG; mtc->full_tc|=1<<(ARG);
-#define SL(ARG) ARG = ( ARG &(~0xf)) | (data&0xf);
-#define SH(ARG) ARG = ( ARG &(~0xf0)) | ((data&0xf)<<4);
-
-static int parse_timecode(MTCtc *mtc, int data) {
-	int rv = 0;
-	switch (data>>4) {
-		case 0x0: // #0000 frame LSN
-			SE(1); SL(mtc->tc.frame); break;
-		case 0x1: // #0001 frame MSN
-			SE(2); SH(mtc->tc.frame); break;
-		case 0x2: // #0010 sec LSN
-			SE(3); SL(mtc->tc.sec); break;
-		case 0x3: // #0011 sec MSN
-			SE(4); SH(mtc->tc.sec); break;
-		case 0x4: // #0100 min LSN
-			SE(5); SL(mtc->tc.min); break;
-		case 0x5: // #0101 min MSN
-			SE(6); SH(mtc->tc.min); break;
-		case 0x6: // #0110 hour LSN
-			SE(7); SL(mtc->tc.hour); break;
-		case 0x7: // #0111 hour MSN and type
-			SE(0);mtc->tc.hour= (mtc->tc.hour&(~0xf0)) | ((data&1)<<4);
-			mtc->tc.type = (data>>1)&3;
-			if (mtc->full_tc!=0xff) break;
-#if 0
-			printf("->- %02i:%02i:%02i.%02i[%s]\n",mtc->tc.hour,mtc->tc.min,mtc->tc.sec,mtc->tc.frame,MTCTYPE[mtc->tc.type]);
-#endif
-			mtc->full_tc = 0; rv = 1; mtc->have_first_full = 1;
-		default:
-			;
+/* nominal frames per second of @t */
+static int timecode_fps(const timecode *t) {
+	if (t->ltcid < 0) {
+		return (int) ceil(expected_tme[t->type]);
 	}
-	return rv;
+	return (fps_num + fps_den - 1) / fps_den;
 }
 
-static void dequeue_ltc(LTCDecoder *d, int id) {
+static void stat_timecode(const timecode *t) {
+	const int i = t->ltcid < 0 ? -t->ltcid - 1 : t->ltcid + 1;
+	METRIC_INC(m_frames[i]);
+	METRIC_SET(m_tc[i], METRIC_TC(t->hour, t->min, t->sec, t->frame, timecode_fps(t)));
+}
+
+static void dequeue_ltc(LTCDecoder *d, int id, LTCEdge *e) {
   LTCFrameExt frame;
   while (ltc_decoder_read(d,&frame)) {
 		timecode ltc;
@@ -147,9 +161,29 @@ static void dequeue_ltc(LTCDecoder *d, int id) {
 		ltc.min   = stime.mins;
 		ltc.hour  = stime.hours;
 		ltc.tme   = frame.off_start;
+		ltc.start = ltcedge_refine(e, &frame);
+		ltc.fit   = e->fit_rms;
+		ltc.mono  = jio_sample_to_monotonic(ltc.tme) + llrint((ltc.start - ltc.tme) * 1e6 / jio_samplerate());
+		ltc.real  = jio_monotonic_to_realtime(ltc.mono);
+
+		ltc.volume   = frame.volume;
+		ltc.duration = frame.off_end - frame.off_start + 1;
+		ltc.reverse  = frame.reverse;
+		ltc.jitter   = bit_jitter(&frame);
+		stat_timecode(&ltc);
+
+		if (fo_nprio > 0) {
+			const int type = frame.ltc.dfbit ? 2 : (fps_num == 24 ? 0 : (fps_num == 30 ? 3 : 1));
+			failover_activity(id + 1, frame.off_end);
+			failover_frame(id + 1, type,
+					mtcindex_tc2fn(type, ltc.hour, ltc.min, ltc.sec, ltc.frame),
+					frame.off_start, frame.reverse);
+		}
 
 		if (jack_ringbuffer_write_space(rb) >= sizeof(timecode)) {
 			jack_ringbuffer_write(rb, (void *) &ltc, sizeof(timecode));
+		} else {
+			METRIC_INC(m_dropped);
 		}
 		if (pthread_mutex_trylock (&msg_thread_lock) == 0) {
 			pthread_cond_signal (&data_ready);
@@ -158,15 +192,30 @@ static void dequeue_ltc(LTCDecoder *d, int id) {
 	}
 }
 
+/* the decoder queue holds LTC_QUEUE_LEN frames, dequeue between chunks
+ * so that large periods (freewheel) do not overflow it */
+static void decode_ltc(LTCDecoder *d, int id, jack_nframes_t nframes, jack_default_audio_sample_t *in, ltc_off_t posinfo) {
+	LTCEdge *e = &ltc_edge[id - 1];
+	jack_nframes_t off;
+	ltcedge_period(e, in, nframes, posinfo);
+	for (off = 0; off < nframes; off += LTCPARSE_CHUNK) {
+		const jack_nframes_t n = nframes - off < LTCPARSE_CHUNK ? nframes - off : LTCPARSE_CHUNK;
+		parse_ltc(d, n, in + off, posinfo + off);
+		dequeue_ltc(d, id, e);
+	}
+	ltcedge_retain(e);
+}
+
 /************************************************
  * jack-audio/midi
  */
 
 jack_client_t *j_client = NULL;
-jack_port_t   *mtc_input_port1;
-jack_port_t   *mtc_input_port2;
-jack_port_t   *ltc_input_port1;
-jack_port_t   *ltc_input_port2;
+jio_port      *mtc_input_port1;
+jio_port      *mtc_input_port2;
+jio_port      *ltc_input_port1;
+jio_port      *ltc_input_port2;
+jio_port      *mtc_output_port = NULL;
 
 static uint32_t j_samplerate = 48000;
 static unsigned long long qf_tme = 0;
@@ -174,19 +223,25 @@ static unsigned long long ff_tme = 0;
 static volatile unsigned long long monotonic_cnt = 0;
 static jack_nframes_t j_latency1 = 0;
 static jack_nframes_t j_latency2 = 0;
+static jack_nframes_t j_mtc_latency[2] = { 0, 0 }; // failover only
 
 static void process_jmidi_event(MTCtc *mtc, jack_midi_event_t *ev, unsigned long long mfcnt) {
 	if (ev->size==2 && ev->buffer[0] == 0xf1) {
 #if 0 // DEBUG quarter-frames
 		printf("QF: %d [%02x %02x ] @%lld dt:%lld\n",
-				mtc->tc.tick, ev->buffer[0], ev->buffer[1],
+				mtc->parser.tc.tick, ev->buffer[0], ev->buffer[1],
 				mfcnt + ev->time, mfcnt + ev->time - qf_tme);
 #endif
-		if (parse_timecode(mtc, ev->buffer[1])) {
+		if (fo_nprio > 0) {
+			failover_activity(-1 - mtc->ltcid, mfcnt + ev->time - j_mtc_latency[-1 - mtc->ltcid]);
+		}
+		if (parse_timecode(&mtc->parser, ev->buffer[1])) {
+			const MTCTime *t = &mtc->parser.tc;
+			timecode tc;
 #if 0 // Warn large delta
 			long ffdiff = mfcnt + ev->time - ff_tme;
-			long expect = (long) rint(j_samplerate * 2.0 / expected_tme[mtc->tc.type]);
-			if (mtc->have_first_full) {
+			long expect = (long) rint(j_samplerate * 2.0 / expected_tme[t->type]);
+			if (mtc->parser.have_first_full) {
 				printf("->- 8qf delta-time: expected %ld - have %ld %s\n",
 						expect, ffdiff,
 						(abs(ffdiff - expect) > 20.0)?"!!!!!!!!!!!!!":""
@@ -194,15 +249,33 @@ static void process_jmidi_event(MTCtc *mtc, jack_midi_event_t *ev, unsigned long
 			}
 #endif
 			ff_tme = mfcnt + ev->time;
-			mtc->tc.tme = ff_tme - rint(j_samplerate / expected_tme[mtc->tc.type] * 7.0 / 4.0); // 7 quarter-frames
+			memset(&tc, 0, sizeof(timecode));
+			tc.ltcid = mtc->ltcid;
+			tc.frame = t->frame;
+			tc.sec   = t->sec;
+			tc.min   = t->min;
+			tc.hour  = t->hour;
+			tc.type  = t->type;
+			tc.tick  = t->tick;
+			tc.tme = ff_tme - rint(j_samplerate / expected_tme[t->type] * 7.0 / 4.0); // 7 quarter-frames
+			tc.start = tc.tme;
+			tc.mono = jio_sample_to_monotonic(tc.tme);
+			tc.real = jio_monotonic_to_realtime(tc.mono);
+			stat_timecode(&tc);
+			if (fo_nprio > 0) {
+				failover_frame(-1 - mtc->ltcid, t->type,
+						mtcindex_tc2fn(t->type, t->hour, t->min, t->sec, t->frame), tc.tme - j_mtc_latency[-1 - mtc->ltcid], 0);
+			}
 #ifdef DEBUG_JACK_SYNC
-			fprintf(stdout, "->- %02i:%02i:%02i.%02i [%s] %lld",mtc->tc.hour,mtc->tc.min,mtc->tc.sec,mtc->tc.frame,MTCTYPE[mtc->tc.type], mtc->tc.tme);
+			fprintf(stdout, "->- %02i:%02i:%02i.%02i [%s] %lld",tc.hour,tc.min,tc.sec,tc.frame,MTCTYPE[tc.type], tc.tme);
 			TimecodeTime tj;
-			timecode_sample_to_time(&tj, mtctc[mtc->tc.type], j_samplerate, mtc->tc.tme);
+			timecode_sample_to_time(&tj, mtctc[tc.type], j_samplerate, tc.tme);
 			fprintf(stdout, " == %02i:%02i:%02i.%02i.%03d\n",tj.hour,tj.minute,tj.second,tj.frame, tj.subframe);
 #else
 			if (jack_ringbuffer_write_space(rb) >= sizeof(timecode)) {
-				jack_ringbuffer_write(rb, (void *) &mtc->tc, sizeof(timecode));
+				jack_ringbuffer_write(rb, (void *) &tc, sizeof(timecode));
+			} else {
+				METRIC_INC(m_dropped);
 			}
 
 			if (pthread_mutex_trylock (&msg_thread_lock) == 0) {
@@ -215,44 +288,29 @@ static void process_jmidi_event(MTCtc *mtc, jack_midi_event_t *ev, unsigned long
 	}
 }
 
-static int parse_ltc(LTCDecoder *d, jack_nframes_t nframes, jack_default_audio_sample_t *in, ltc_off_t posinfo) {
-  jack_nframes_t i;
-  unsigned char sound[8192];
-  if (nframes > 8192) return 1;
-
-  for (i = 0; i < nframes; i++) {
-    const int snd=(int)rint((127.0*in[i])+128.0);
-    sound[i] = (unsigned char) (snd&0xff);
-  }
-  ltc_decoder_write(d, sound, nframes, posinfo);
-  return 0;
-}
-
 static int process(jack_nframes_t nframes, void *arg) {
 	jack_default_audio_sample_t *in;
-	void *jack_midi_buf = jack_port_get_buffer(mtc_input_port1, nframes);
-	int nevents = jack_midi_get_event_count(jack_midi_buf);
+	void *jack_midi_buf = jio_port_get_buffer(mtc_input_port1, nframes);
+	int nevents = jio_midi_get_event_count(jack_midi_buf);
 	int n;
 
 #ifdef DEBUG_JACK_SYNC
 	jack_position_t pos;
-	jack_transport_query (j_client, &pos);
+	jio_transport_query (&pos);
 	//printf( "%u\n",  pos.frame);
 
 #else
 
-  in = jack_port_get_buffer (ltc_input_port1, nframes);
-  parse_ltc(decoder, nframes, in, monotonic_cnt - j_latency1);
-	dequeue_ltc(decoder, 1);
+  in = jio_port_get_buffer (ltc_input_port1, nframes);
+	decode_ltc(decoder, 1, nframes, in, monotonic_cnt - j_latency1);
 
-  in = jack_port_get_buffer (ltc_input_port2, nframes);
-  parse_ltc(decoder2, nframes, in, monotonic_cnt - j_latency2);
-	dequeue_ltc(decoder2, 2);
+  in = jio_port_get_buffer (ltc_input_port2, nframes);
+	decode_ltc(decoder2, 2, nframes, in, monotonic_cnt - j_latency2);
 #endif
 
 	for (n=0; n<nevents; n++) {
 		jack_midi_event_t ev;
-		jack_midi_event_get(&ev, jack_midi_buf, n);
+		jio_midi_event_get(&ev, jack_midi_buf, n);
 #ifdef DEBUG_JACK_SYNC
 		process_jmidi_event(mtctimecode, &ev, pos.frame);
 #else
@@ -261,27 +319,38 @@ static int process(jack_nframes_t nframes, void *arg) {
 	}
 
 #ifndef DEBUG_JACK_SYNC
-	jack_midi_buf = jack_port_get_buffer(mtc_input_port2, nframes);
-	nevents = jack_midi_get_event_count(jack_midi_buf);
+	jack_midi_buf = jio_port_get_buffer(mtc_input_port2, nframes);
+	nevents = jio_midi_get_event_count(jack_midi_buf);
 	for (n=0; n<nevents; n++) {
 		jack_midi_event_t ev;
-		jack_midi_event_get(&ev, jack_midi_buf, n);
+		jio_midi_event_get(&ev, jack_midi_buf, n);
 		process_jmidi_event(mtctimecode2, &ev, monotonic_cnt);
 	}
 #endif
+	if (fo_nprio > 0) {
+		failover_cycle(monotonic_cnt, nframes);
+	}
 	monotonic_cnt += nframes;
 	return 0;
 }
 
 int jack_latency_cb(void *arg) {
   jack_latency_range_t jlty;
+	if (mtc_input_port1) {
+		jio_port_get_latency_range(mtc_input_port1, JackCaptureLatency, &jlty);
+		j_mtc_latency[0] = jlty.max;
+	}
+	if (mtc_input_port2) {
+		jio_port_get_latency_range(mtc_input_port2, JackCaptureLatency, &jlty);
+		j_mtc_latency[1] = jlty.max;
+	}
   if (ltc_input_port1) {
-		jack_port_get_latency_range(ltc_input_port1, JackCaptureLatency, &jlty);
+		jio_port_get_latency_range(ltc_input_port1, JackCaptureLatency, &jlty);
 		j_latency1 = jlty.max;
 		printf("# LTC1 port latency: %d\n", j_latency1);
 	}
   if (ltc_input_port2) {
-		jack_port_get_latency_range(ltc_input_port2, JackCaptureLatency, &jlty);
+		jio_port_get_latency_range(ltc_input_port2, JackCaptureLatency, &jlty);
 		j_latency2 = jlty.max;
 		printf("# LTC2 port latency: %d\n", j_latency2);
 	}
@@ -299,13 +368,17 @@ void cleanup(void) {
 		jack_deactivate (j_client);
 		jack_client_close (j_client);
 	}
-	if (rb) {
-		jack_ringbuffer_free(rb);
-	}
+	metrics_stop();
+	jio_cleanup();
+	rtmem_ringbuffer_free(rb);
   ltc_decoder_free(decoder);
   ltc_decoder_free(decoder2);
-	free(mtctimecode);
-	free(mtctimecode2);
+	ltcedge_free(&ltc_edge[0]);
+	ltcedge_free(&ltc_edge[1]);
+	rtmem_free(mtctimecode);
+	rtmem_free(mtctimecode2);
+	mtcshm_close(&fo_shm);
+	rtmem_release();
 	j_client = NULL;
 }
 
@@ -330,7 +403,7 @@ static int init_jack(const char *client_name) {
 		client_name = jack_get_client_name(j_client);
 		fprintf (stderr, "jack-client name: `%s'\n", client_name);
 	}
-	jack_set_process_callback (j_client, process, 0);
+	jio_set_process_callback (j_client, process, 0);
   jack_set_graph_order_callback (j_client, jack_latency_cb, NULL);
 
 #ifndef WIN32
@@ -342,35 +415,550 @@ static int init_jack(const char *client_name) {
 }
 
 static int jack_portsetup(void) {
-	if ((mtc_input_port1 = jack_port_register(j_client, "mtc_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+	if ((mtc_input_port1 = jio_port_register("mtc_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput)) == 0) {
 		fprintf (stderr, "cannot register mtc input port !\n");
 		return (-1);
 	}
-	if ((mtc_input_port2 = jack_port_register(j_client, "mtc_in2", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+	if ((mtc_input_port2 = jio_port_register("mtc_in2", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput)) == 0) {
 		fprintf (stderr, "cannot register mtc input port !\n");
 		return (-1);
 	}
-	if ((ltc_input_port1 = jack_port_register(j_client, "ltc_in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0)) == 0) {
+	if ((ltc_input_port1 = jio_port_register("ltc_in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput)) == 0) {
 		fprintf (stderr, "cannot register ltc input port !\n");
 		return (-1);
 	}
-	if ((ltc_input_port2 = jack_port_register(j_client, "ltc_in2", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0)) == 0) {
+	if ((ltc_input_port2 = jio_port_register("ltc_in2", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput)) == 0) {
 		fprintf (stderr, "cannot register ltc input port !\n");
 		return (-1);
 	}
+	if (fo_nprio > 0
+			&& (mtc_output_port = jio_port_register("mtc_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput)) == 0) {
+		fprintf (stderr, "cannot register mtc output port !\n");
+		return (-1);
+	}
   decoder = ltc_decoder_create(j_samplerate * fps_den / fps_num, LTC_QUEUE_LEN);
   decoder2 = ltc_decoder_create(j_samplerate * fps_den / fps_num, LTC_QUEUE_LEN);
-	mtctimecode = calloc(1, sizeof(MTCtc));
-	mtctimecode->tc.ltcid = -1;
-	mtctimecode2 = calloc(1, sizeof(MTCtc));
-	mtctimecode2->tc.ltcid = -2;
+	if (ltcedge_init(&ltc_edge[0], j_samplerate, (double) fps_num / fps_den)
+			|| ltcedge_init(&ltc_edge[1], j_samplerate, (double) fps_num / fps_den)) {
+		fprintf (stderr, "cannot allocate LTC history !\n");
+		return (-1);
+	}
+	mtctimecode = rtmem_alloc(sizeof(MTCtc));
+	mtctimecode->ltcid = -1;
+	mtctimecode2 = rtmem_alloc(sizeof(MTCtc));
+	mtctimecode2->ltcid = -2;
 	return (0);
 }
 
-static void my_port_connect(char *port, jack_port_t *p) {
-	if (port && jack_connect(j_client, port, jack_port_name(p))) {
-		fprintf(stderr, "cannot connect port %s to %s\n", port, jack_port_name(p));
+static void my_port_connect(char *port, jio_port *p) {
+	if (port && jack_connect(j_client, port, jack_port_name(p->jport))) {
+		fprintf(stderr, "cannot connect port %s to %s\n", port, jack_port_name(p->jport));
+	}
+}
+
+
+/************************************************
+ * MTC/LTC offset analysis
+ *
+ * Every received frame is keyed by its timecode value. Frames with the
+ * same key from two different sources form a pair-sample; the difference
+ * of their start (LTC: to a fraction of a sample) is accumulated per
+ * source-pair. When a source jumps (locate, rewind), the history of all
+ * sources is cleared, so that new frames do not pair with stale ones.
+ */
+
+#define N_SOURCES (4) // MTC1, MTC2, LTC1, LTC2
+#define N_PAIRS (N_SOURCES * (N_SOURCES - 1) / 2)
+#define HISTLEN (64) // per source, must cover max. latency between sources
+#define JUMP_TOLERANCE (2) // frames, drop-frame timecode skips labels
+
+typedef struct {
+	long long int key;
+	double start;
+} tcstamp;
+
+typedef struct {
+	unsigned long long int n;
+	double mean, m2;    // offset mean, sum of squared deviations
+	double xmean, xm2;  // time mean, sum of squared deviations
+	double cxy;         // co-moment of time and offset
+	double min, max;
+} pairstats;
+
+static const char SRCNAME[N_SOURCES][5] = { "MTC1", "MTC2", "LTC1", "LTC2" };
+static tcstamp   src_hist[N_SOURCES][HISTLEN];
+static long long int src_last_key[N_SOURCES]; // -1: none
+static unsigned long long int src_last_tme[N_SOURCES];
+static pairstats pair_stats[N_PAIRS];
+static unsigned long long int analysis_last = 0;
+
+/* options */
+static double analysis_interval = 0; // seconds, 0: off
+
+static int source_index(const timecode *t) {
+	return t->ltcid < 0 ? -1 - t->ltcid : 1 + t->ltcid;
+}
+
+static int pair_index(int a, int b) {
+	// a < b
+	return a * (2 * N_SOURCES - a - 1) / 2 + (b - a - 1);
+}
+
+static long long int timecode_key(const timecode *t) {
+	const int fps = timecode_fps(t);
+	return (((long long int) t->hour * 60 + t->min) * 60 + t->sec) * fps + t->frame;
+}
+
+static void pairstats_add(pairstats *p, double x, double offset) {
+	const double y = offset;
+	p->n++;
+	const double dx = x - p->xmean;
+	const double dy = y - p->mean;
+	p->xmean += dx / p->n;
+	p->mean  += dy / p->n;
+	p->xm2   += dx * (x - p->xmean);
+	p->m2    += dy * (y - p->mean);
+	p->cxy   += dx * (y - p->mean);
+	if (p->n == 1 || offset < p->min) p->min = offset;
+	if (p->n == 1 || offset > p->max) p->max = offset;
+}
+
+static void analysis_reset(void) {
+	int s, i;
+	for (s = 0; s < N_SOURCES; ++s) {
+		for (i = 0; i < HISTLEN; ++i) {
+			src_hist[s][i].key = -1;
+		}
+	}
+}
+
+/* true if the timecode of @t does not continue the last one of its source */
+static int analysis_jump(int src, const timecode *t, long long int key) {
+	if (src_last_key[src] < 0 || t->tme < src_last_tme[src]) {
+		return src_last_key[src] >= 0;
+	}
+	const long long int expect = rint((double)(t->tme - src_last_tme[src]) * timecode_fps(t) / j_samplerate);
+	return llabs(llabs(key - src_last_key[src]) - expect) > JUMP_TOLERANCE;
+}
+
+static void analysis_add(const timecode *t) {
+	int i;
+	const int src = source_index(t);
+	const long long int key = timecode_key(t);
+	const int slot = key % HISTLEN;
+
+	if (analysis_jump(src, t, key)) {
+		analysis_reset();
+	}
+	src_last_key[src] = key;
+	src_last_tme[src] = t->tme;
+
+	src_hist[src][slot].key = key;
+	src_hist[src][slot].start = t->start;
+
+	for (i = 0; i < N_SOURCES; ++i) {
+		if (i == src) continue;
+		tcstamp *o = &src_hist[i][slot];
+		if (o->key != key) continue;
+		/* offset is always reported as "second minus first" */
+		if (i < src) {
+			pairstats_add(&pair_stats[pair_index(i, src)], o->start, t->start - o->start);
+		} else {
+			pairstats_add(&pair_stats[pair_index(src, i)], t->start, o->start - t->start);
+		}
+	}
+}
+
+static void analysis_print(void) {
+	int a, b;
+	fprintf(stdout, "%-9s %10s %10s %8s %8s %8s %10s\n",
+			"# pair", "count", "mean[spl]", "stddev", "min", "max", "drift[ppm]");
+	for (a = 0; a < N_SOURCES; ++a) {
+		for (b = a + 1; b < N_SOURCES; ++b) {
+			const pairstats *p = &pair_stats[pair_index(a, b)];
+			if (p->n == 0) continue;
+			fprintf(stdout, "%s-%s %10llu %10.2f %8.2f %8.2f %8.2f %+10.3f\n",
+					SRCNAME[a], SRCNAME[b], p->n, p->mean,
+					p->n > 1 ? sqrt(p->m2 / (p->n - 1)) : 0,
+					p->min, p->max,
+					p->xm2 > 0 ? 1e6 * p->cxy / p->xm2 : 0);
+		}
 	}
+	fflush(stdout);
+}
+
+static void analysis_init(void) {
+	int s;
+	memset(pair_stats, 0, sizeof(pair_stats));
+	analysis_reset();
+	for (s = 0; s < N_SOURCES; ++s) {
+		src_last_key[s] = -1;
+	}
+}
+
+
+/************************************************
+ * LTC signal quality
+ *
+ * Frames that are missing between two consecutive decoded frames of the
+ * same channel are counted as decode errors. A gap of more than
+ * LTC_MAX_DROPOUT frames is considered a relocate or signal loss, not
+ * an error.
+ */
+
+#define LTC_MAX_DROPOUT (50)
+
+typedef struct {
+	long long int key;
+	unsigned long long int tme;
+	unsigned long long int decoded;
+	unsigned long long int missed;
+	float volume;
+	float jitter;
+	int reverse;
+} ltcquality;
+
+static ltcquality ltc_quality[2];
+
+/* options */
+static int print_quality = 0;
+static int print_hosttime = 0;
+
+static double ltc_frame_duration(void) {
+	return (double) j_samplerate * fps_den / fps_num;
+}
+
+static void quality_update(const timecode *t) {
+	ltcquality *q = &ltc_quality[t->ltcid - 1];
+	const long long int key = timecode_key(t);
+
+	if (q->decoded > 0 && t->tme > q->tme) {
+		const long long int expect = rint((t->tme - q->tme) / ltc_frame_duration());
+		const long long int have = llabs(key - q->key);
+		if (expect > 1 && expect <= LTC_MAX_DROPOUT && have == expect) {
+			q->missed += expect - 1;
+			METRIC_SET(m_ltc_errors[t->ltcid - 1], q->missed);
+		}
+	}
+	q->key = key;
+	q->tme = t->tme;
+	q->decoded++;
+	q->volume = t->volume;
+	q->jitter = t->jitter;
+	q->reverse = t->reverse;
+}
+
+static double quality_error_rate(const ltcquality *q) {
+	if (q->decoded == 0) return 0;
+	return 100.0 * q->missed / (double)(q->decoded + q->missed);
+}
+
+static void quality_print(void) {
+	int i;
+	for (i = 0; i < 2; ++i) {
+		const ltcquality *q = &ltc_quality[i];
+		if (q->decoded == 0) continue;
+		fprintf(stdout, "# LTC%d decoded: %llu missed: %llu error-rate: %.3f%% level: %.1fdBFS jitter: %.2f%s\n",
+				i + 1, q->decoded, q->missed, quality_error_rate(q),
+				q->volume, q->jitter, q->reverse ? " (reverse)" : "");
+	}
+	fflush(stdout);
+}
+
+static void analysis_process(const timecode *t) {
+	analysis_add(t);
+	if (analysis_last == 0) {
+		analysis_last = t->tme;
+	} else if (t->tme >= analysis_last + analysis_interval * j_samplerate) {
+		analysis_last = t->tme;
+		analysis_print();
+		if (print_quality) quality_print();
+	}
+}
+
+
+/************************************************
+ * failover
+ *
+ * Each input is tracked by a position estimate: its last frame, the
+ * sample-time where that frame started and the measured frame-duration,
+ * updated by a second order loop. An input is healthy after FO_MIN_RUN
+ * consecutive frames, as long as it stays active (a quarter-frame within
+ * 1/2 frame, an LTC frame within 1.25 frames), its timing jitter is
+ * below 1/8 frame and it is not outvoted: with three or more inputs, an
+ * input that disagrees by more than 1/2 frame with a majority of the
+ * others is ignored.
+ *
+ * All inputs are stamped on one timebase, compensated for the capture
+ * latency of their port (the printed MTC times are not): the sample-time
+ * at which the signal was at the input of the audio/MIDI interface. At
+ * the start of a cycle (sample-time @now) an input can have delivered
+ * data up to now + nframes - latency.
+ *
+ * The first healthy input in order of priority is selected. Returning
+ * to a higher priority input requires FO_HOLD frames of good signal.
+ *
+ * The output is a virtual transport that runs at the speed of the
+ * selected input and slews towards its position by at most FO_SLEW,
+ * so switching inputs does not jump (unless they are more than two
+ * frames apart: a locate). Without any healthy input it continues at the
+ * last speed for FO_FLYWHEEL frames and then stops. The cost per cycle
+ * is fixed, O(N_SOURCES^2).
+ */
+
+#define FO_MIN_RUN  (4)    // frames
+#define FO_HOLD     (25)   // frames
+#define FO_FLYWHEEL (10)   // frames
+#define FO_SLEW     (0.01) // max. speed correction
+
+typedef struct {
+	int valid;
+	int type;                // MTC type
+	int32_t fn0;             // last frame ..
+	double t0;               // .. started at this sample-time
+	double spf;              // samples per frame
+	double jitter;           // mean abs. deviation from the estimate [samples]
+	unsigned long long seen; // last quarter-frame or LTC frame, latency compensated
+	int32_t run;             // consecutive frames
+	int reverse;
+	/* per cycle */
+	int healthy;
+	double pos;              // seconds at the cycle start
+} fosource;
+
+static fosource fo_src[N_SOURCES];
+static int fo_prio[N_SOURCES];  // inputs, in order of priority
+static int fo_selected = -1;    // relaxed atomic, read by the main thread
+static int fo_score[N_SOURCES]; // [%], relaxed atomics
+
+/* output */
+static MTCGen fo_gen;
+static int fo_rolling = 0;
+static int fo_type = -1;
+static double fo_pos = 0;       // seconds at the cycle start
+static double fo_speed = 1.0;
+static double fo_lost = 0;      // samples without a healthy input
+
+static uint64_t m_fo_switches = 0;
+static uint64_t m_fo_source = 0;
+
+/* options */
+static char *failover_list = NULL;
+static char *shm_name = NULL;
+
+static double fo_nominal_spf(int type) {
+	return j_samplerate / expected_tme[type];
+}
+
+/* max. time between quarter-frames (MTC) or LTC frames */
+static double fo_timeout(int src) {
+	return fo_src[src].spf * (src < 2 ? 0.5 : 1.25);
+}
+
+/* capture latency of input @src */
+static jack_nframes_t fo_latency(int src) {
+	switch (src) {
+		case 0: return j_mtc_latency[0];
+		case 1: return j_mtc_latency[1];
+		case 2: return j_latency1;
+		default: return j_latency2;
+	}
+}
+
+static void failover_activity(int src, unsigned long long tme) {
+	fosource *s = &fo_src[src];
+	if ((double)(long long)(tme - s->seen) >= fo_timeout(src)) {
+		/* resumed after a dropout, the estimate is stale */
+		s->run = 0;
+	}
+	s->seen = tme;
+}
+
+/* frame @fn of input @src started at sample-time @tme */
+static void failover_frame(int src, int type, int32_t fn, unsigned long long tme, int reverse) {
+	fosource *s = &fo_src[src];
+	const double nominal = fo_nominal_spf(type);
+
+	s->reverse = reverse;
+	if (s->valid && type == s->type && !reverse && fn > s->fn0 && fn - s->fn0 <= 8) {
+		const int32_t d = fn - s->fn0;
+		const double predict = s->t0 + d * s->spf;
+		const double err = tme - predict;
+		if (fabs(err) < nominal / 4) {
+			s->jitter += .1 * (fabs(err) - s->jitter);
+			s->t0 = predict + .25 * err;
+			s->spf += .05 * err / d;
+			s->fn0 = fn;
+			s->run += d;
+			return;
+		}
+	}
+	/* first frame, locate, dropout */
+	s->valid  = 1;
+	s->type   = type;
+	s->fn0    = fn;
+	s->t0     = tme;
+	s->spf    = nominal;
+	s->jitter = 0;
+	s->run    = 0;
+}
+
+static void failover_select(unsigned long long now, jack_nframes_t nframes) {
+	int outvoted[N_SOURCES];
+	int i, j, k, best = -1;
+
+	for (i = 0; i < N_SOURCES; ++i) {
+		fosource *s = &fo_src[i];
+		s->healthy = s->valid && !s->reverse && s->run >= FO_MIN_RUN
+			&& (double)(long long)(now + nframes - fo_latency(i) - s->seen) < fo_timeout(i)
+			&& s->jitter < s->spf / 8;
+		s->pos = s->valid ? (s->fn0 + (now - s->t0) / s->spf) / expected_tme[s->type] : 0;
+	}
+
+	for (i = 0; i < N_SOURCES; ++i) {
+		int agree = 0, disagree = 0;
+		outvoted[i] = 0;
+		if (!fo_src[i].healthy) {
+			METRIC_SET(fo_score[i], 0);
+			continue;
+		}
+		for (j = 0; j < N_SOURCES; ++j) {
+			if (j == i || !fo_src[j].healthy) continue;
+			if (fabs(fo_src[i].pos - fo_src[j].pos) < .5 / expected_tme[fo_src[i].type]) {
+				++agree;
+			} else {
+				++disagree;
+			}
+		}
+		outvoted[i] = disagree >= 2 && disagree > agree;
+		METRIC_SET(fo_score[i], outvoted[i] ? 0 :
+				(int) (100 * (1 - 8 * fo_src[i].jitter / fo_src[i].spf) * (agree + 1) / (agree + disagree + 1)));
+	}
+
+	for (k = 0; k < fo_nprio; ++k) {
+		i = fo_prio[k];
+		if (!fo_src[i].healthy || outvoted[i]) continue;
+		if (i != fo_selected && fo_selected >= 0 && fo_src[fo_selected].healthy && !outvoted[fo_selected]
+				&& fo_src[i].run < FO_HOLD) {
+			/* higher priority input is back, but not for long enough */
+			continue;
+		}
+		best = i;
+		break;
+	}
+
+	if (best != fo_selected) {
+		METRIC_INC(m_fo_switches);
+		METRIC_SET(m_fo_source, best + 1);
+		__atomic_store_n(&fo_selected, best, __ATOMIC_RELAXED);
+	}
+}
+
+static void failover_cycle(unsigned long long now, jack_nframes_t nframes) {
+	jack_position_t pos;
+
+	failover_select(now, nframes);
+
+	if (fo_selected >= 0) {
+		const fosource *s = &fo_src[fo_selected];
+		const double err = s->pos - fo_pos;
+		if (!fo_rolling || s->type != fo_type || fabs(err) > 2.0 / expected_tme[s->type]) {
+			/* start, rate change or the input located */
+			if (s->type != fo_type) {
+				static const int num[4] = { 24, 25, 30000, 30 };
+				fo_gen.framerate.num = num[s->type];
+				fo_gen.framerate.den = s->type == 2 ? 1001 : 1;
+				fo_gen.framerate.drop = s->type == 2;
+				mtcgen_set_rate(&fo_gen);
+				fo_type = s->type;
+			}
+			fo_pos = s->pos;
+		} else {
+			const double max = FO_SLEW * nframes / j_samplerate;
+			fo_pos += err > max ? max : (err < -max ? -max : err);
+		}
+		fo_speed = fo_nominal_spf(s->type) / s->spf;
+		fo_rolling = 1;
+		fo_lost = 0;
+	} else if (fo_rolling) {
+		fo_lost += nframes;
+		if (fo_lost > FO_FLYWHEEL * fo_nominal_spf(fo_type)) {
+			fo_rolling = 0;
+		}
+	}
+
+	memset(&pos, 0, sizeof(jack_position_t));
+	pos.frame_rate = j_samplerate;
+	const int64_t sample_pos = fo_pos > 0 ? llrint(fo_pos * j_samplerate) : 0;
+
+	void *out = jio_port_get_buffer(mtc_output_port, nframes);
+	if (fo_type < 0) {
+		jio_midi_clear_buffer(out);
+	} else {
+		mtcgen_process_at(&fo_gen, fo_rolling ? JackTransportRolling : JackTransportStopped, &pos, sample_pos, nframes, out);
+	}
+
+	if (fo_shm.shm && fo_type >= 0) {
+		mtcshm_pos p;
+		memset(&p, 0, sizeof(mtcshm_pos));
+		p.state      = fo_rolling;
+		p.source     = fo_selected;
+		p.type       = fo_type;
+		p.samplerate = j_samplerate;
+		p.position   = fo_pos;
+		p.speed      = fo_rolling ? fo_speed : 0;
+		p.sample     = now;
+		p.usec       = jio_sample_to_monotonic(now);
+		p.hour       = fo_gen.tc_time.hour;
+		p.minute     = fo_gen.tc_time.minute;
+		p.second     = fo_gen.tc_time.second;
+		p.frame      = fo_gen.tc_time.frame;
+		mtcshm_write(&fo_shm, &p);
+	}
+
+	if (fo_rolling) {
+		fo_pos += fo_speed * nframes / j_samplerate;
+	}
+}
+
+/* parse the comma separated list of inputs, e.g. "ltc1,mtc1,ltc2" */
+static int failover_parse(char *list) {
+	char *tok, *save = NULL;
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		int i, k;
+		for (i = 0; i < N_SOURCES; ++i) {
+			if (!strcasecmp(tok, SRCNAME[i])) break;
+		}
+		if (i == N_SOURCES) {
+			fprintf(stderr, "invalid failover input '%s', expected mtc1, mtc2, ltc1 or ltc2.\n", tok);
+			return -1;
+		}
+		for (k = 0; k < fo_nprio; ++k) {
+			if (fo_prio[k] == i) break;
+		}
+		if (k == fo_nprio) {
+			fo_prio[fo_nprio++] = i;
+		}
+	}
+	return fo_nprio > 0 ? 0 : -1;
+}
+
+static void failover_print(void) {
+	static int printed = -1;
+	const int sel = __atomic_load_n(&fo_selected, __ATOMIC_RELAXED);
+	int k;
+	if (fo_nprio == 0 || sel == printed) {
+		return;
+	}
+	fprintf(stdout, "%s# failover: %s -> %s, score:",
+			newline == '\r' ? "\n" : "",
+			printed < 0 ? "none" : SRCNAME[printed], sel < 0 ? "none" : SRCNAME[sel]);
+	for (k = 0; k < fo_nprio; ++k) {
+		fprintf(stdout, " %s:%d%%", SRCNAME[fo_prio[k]], __atomic_load_n(&fo_score[fo_prio[k]], __ATOMIC_RELAXED));
+	}
+	fprintf(stdout, "\n");
+	fflush(stdout);
+	printed = sel;
 }
 
 
@@ -380,8 +968,17 @@ static void my_port_connect(char *port, jack_port_t *p) {
 
 static struct option const long_options[] =
 {
+  {"analyze", required_argument, 0, 'a'},
+  {"capture", required_argument, 0, 'c'},
+  {"failover", required_argument, 0, 'F'},
   {"help", no_argument, 0, 'h'},
+  {"host-time", no_argument, 0, 'H'},
+  {"metrics", required_argument, 0, 'M'},
   {"newline", no_argument, 0, 'n'},
+  {"quality", no_argument, 0, 'q'},
+  {"replay", required_argument, 0, 'r'},
+  {"shm", required_argument, 0, 'S'},
+  {"timing", required_argument, 0, 'T'},
   {"version", no_argument, 0, 'V'},
   {NULL, 0, NULL, 0}
 };
@@ -390,13 +987,49 @@ static void usage (int status) {
   printf ("jmtcdump - JACK MIDI Timecode dump.\n\n");
   printf ("Usage: jmtcdump [ OPTIONS ] [JACK-port]\n\n");
   printf ("Options:\n\
+  -a, --analyze <sec>        compare all MTC and LTC inputs, print\n\
+                             offset statistics every <sec> seconds\n\
+  -c, --capture <file>       record all process-cycle input to <file>\n\
+  -F, --failover <list>      follow the best of the inputs in <list>, in\n\
+                             order of priority, e.g. ltc1,mtc1,ltc2 and\n\
+                             send it as MTC on port mtc_out\n\
   -h, --help                 display this help and exit\n\
+  -H, --host-time            also print the time at which each frame\n\
+                             started: UTC and CLOCK_MONOTONIC seconds\n\
+  -M, --metrics <path>       serve counters in Prometheus text format on\n\
+                             unix-domain socket <path>\n\
   -n, --newline              print a newline after each Timecode\n\
+  -q, --quality              report LTC signal level, bit-jitter, frame\n\
+                             duration deviation and decode error-rate\n\
+  -r, --replay <file>        process a capture-file instead of using JACK\n\
+  -S, --shm <name>           publish the failover position in POSIX\n\
+                             shared-memory <name>, see mtcshm.h\n\
+  -T, --timing <sec>         print process() timing statistics every <sec>\n\
+                             seconds (also on SIGUSR1)\n\
   -V, --version              print version information and exit\n\
 \n");
   printf ("\n\
 This tool subscribes to a JACK Midi Port and prints received Midi\n\
 time code to stdout.\n\
+\n\
+In failover mode an input qualifies after 4 consecutive frames, and\n\
+fails when it drops out for more than 1/2 frame (MTC) or 1 1/4 frames\n\
+(LTC), when its timing jitter exceeds 1/8 frame, or when the majority\n\
+of the other inputs disagree with it by more than 1/2 frame. The output\n\
+follows the first qualified input without jumps, and continues for 10\n\
+frames when all inputs fail. A higher priority input is selected again\n\
+after it was good for 25 frames.\n\
+\n\
+Host times are derived from the JACK sample clock, filtered against the\n\
+start of each process cycle. LTC frames are compensated for the capture\n\
+latency of their port, MTC is not. Failover compensates all inputs.\n\
+\n\
+LTC frame starts are refined to a fraction of a sample: a line is fitted\n\
+through the interpolated mid-level crossings of the sync word, the end\n\
+of one frame's sync word is the start of the next frame. -q reports the\n\
+rms residual of the fit (fit:, in samples). Reverse or weak frames keep\n\
+the decoder's whole-sample position (fit: -). 'jmtcbench -A' measures\n\
+the error of the refined start on synthetic signals.\n\
 \n");
   printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
           "Website and manual: <https://github.com/x42/mtc-tools>\n"
@@ -408,14 +1041,51 @@ static int decode_switches (int argc, char **argv) {
 	int c;
 
 	while ((c = getopt_long (argc, argv,
+			   "a:"	/* analyze */
+			   "c:"	/* capture */
+			   "F:"	/* failover */
 			   "h"	/* help */
+			   "H"	/* host-time */
+			   "M:"	/* metrics */
 			   "n"	/* newline */
+			   "q"	/* quality */
+			   "r:"	/* replay */
+			   "S:"	/* shm */
+			   "T:"	/* timing */
 			   "V",	/* version */
 			   long_options, (int *) 0)) != EOF) {
 		switch (c) {
+			case 'a':
+				analysis_interval = atof(optarg);
+				if (analysis_interval <= 0) analysis_interval = 1.0;
+				break;
+			case 'c':
+				capture_file = optarg;
+				break;
+			case 'F':
+				failover_list = optarg;
+				break;
+			case 'H':
+				print_hosttime = 1;
+				break;
+			case 'M':
+				metrics_path = optarg;
+				break;
 			case 'n':
 				newline = '\n';
 				break;
+			case 'q':
+				print_quality = 1;
+				break;
+			case 'r':
+				replay_file = optarg;
+				break;
+			case 'S':
+				shm_name = optarg;
+				break;
+			case 'T':
+				timing_interval = atof(optarg);
+				break;
 			case 'V':
 				printf ("jmtcdump version %s\n\n", VERSION);
 				printf ("Copyright (C) GPL 2012 Robin Gareus <robin@gareus.org>\n");
@@ -439,6 +1109,63 @@ void wearedone(int sig) {
 	pthread_cond_signal (&data_ready);
 }
 
+void dumptiming(int sig) {
+	jio_timing_request();
+	pthread_cond_signal (&data_ready);
+}
+
+static void format_hosttime(char *buf, size_t len, const timecode *t) {
+	char rt[40];
+	if (!print_hosttime) {
+		buf[0] = '\0';
+		return;
+	}
+	jio_format_realtime(rt, sizeof(rt), t->real);
+	snprintf(buf, len, " %s %lld.%06lld", rt, (long long) t->mono / 1000000, (long long) t->mono % 1000000);
+}
+
+static const char *format_fit(char *buf, size_t len, float fit) {
+	if (fit < 0) {
+		return "    -";
+	}
+	snprintf(buf, len, "%5.3f", fit);
+	return buf;
+}
+
+static void print_timecode(void) {
+	while ((jack_ringbuffer_read_space (rb) / sizeof(timecode)) > 0) {
+		timecode t;
+		char ht[64];
+		char fit[16];
+		jack_ringbuffer_read(rb, (char*) &t, sizeof(timecode));
+		format_hosttime(ht, sizeof(ht), &t);
+		if (t.ltcid > 0)
+			quality_update(&t);
+		if (analysis_interval > 0)
+			analysis_process(&t);
+		else if (t.ltcid<0)
+			fprintf(stdout, "MTC%d %02i:%02i:%02i.%02i [%s] %lld%s%c",
+					abs(t.ltcid),
+					t.hour,t.min,t.sec,t.frame,MTCTYPE[t.type], t.tme, ht, newline);
+		else if (print_quality)
+			fprintf(stdout, "%sLTC%d %02i:%02i:%02i.%02i ------- %.2f %5.1fdBFS jitter:%5.2f dur:%+4.0f fit:%s%s err:%.3f%%%s%c",
+					(newline=='\r' ? "\t\t\t\t":""),
+					abs(t.ltcid),
+					t.hour,t.min,t.sec,t.frame, t.start,
+					t.volume, t.jitter, t.duration - ltc_frame_duration(),
+					format_fit(fit, sizeof(fit), t.fit),
+					t.reverse ? " REV" : "",
+					quality_error_rate(&ltc_quality[t.ltcid - 1]), ht, newline);
+		else
+			fprintf(stdout, "%sLTC%d %02i:%02i:%02i.%02i ------- %.2f%s%c",
+					(newline=='\r' ? "\t\t\t\t":""),
+					abs(t.ltcid),
+					t.hour,t.min,t.sec,t.frame, t.start, ht, newline);
+		fflush(stdout);
+	}
+	failover_print();
+}
+
 int main (int argc, char ** argv) {
 	mtctc[0] = timecode_FPS24;
 	mtctc[1] = timecode_FPS25;
@@ -447,17 +1174,66 @@ int main (int argc, char ** argv) {
 
 	decode_switches (argc, argv);
 
-	if (init_jack("jmtcdump"))
+	if (failover_list && failover_parse(failover_list))
 		goto out;
+	if (shm_name && !fo_nprio) {
+		fprintf(stderr, "--shm requires --failover.\n");
+		goto out;
+	}
+
+	if (replay_file) {
+		if (jio_replay_open(replay_file))
+			goto out;
+		jio_set_process_callback (NULL, process, 0);
+		j_samplerate = jio_samplerate();
+	} else if (init_jack("jmtcdump")) {
+		goto out;
+	}
 	if (jack_portsetup())
 		goto out;
+	if (replay_file)
+		jack_latency_cb(NULL); // captured port latencies
+
+	rb = rtmem_ringbuffer(RBSIZE * sizeof(timecode));
+	analysis_init();
+	mtcgen_init(&fo_gen, j_samplerate);
+
+	if (shm_name && mtcshm_create(&fo_shm, shm_name)) {
+		fprintf(stderr, "cannot create shared-memory segment '%s'.\n", shm_name);
+		goto out;
+	}
 
-	rb = jack_ringbuffer_create(RBSIZE * sizeof(timecode));
+	if (replay_file) {
+		jio_replay_run(print_timecode);
+		if (timing_interval > 0)
+			jio_timing_print(stderr);
+		goto out;
+	}
+	if (capture_file && jio_capture_start(capture_file))
+		goto out;
 
-	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
-		fprintf(stderr, "Warning: Can not lock memory.\n");
+	if (metrics_path) {
+		metrics_add("mtc1_frames_decoded_total", "Complete MTC timecodes decoded on mtc_in", METRIC_COUNTER, &m_frames[0]);
+		metrics_add("mtc2_frames_decoded_total", "Complete MTC timecodes decoded on mtc_in2", METRIC_COUNTER, &m_frames[1]);
+		metrics_add("ltc1_frames_decoded_total", "LTC frames decoded on ltc_in", METRIC_COUNTER, &m_frames[2]);
+		metrics_add("ltc2_frames_decoded_total", "LTC frames decoded on ltc_in2", METRIC_COUNTER, &m_frames[3]);
+		metrics_add("ltc1_decode_errors_total", "LTC frames missing between decoded frames on ltc_in", METRIC_COUNTER, &m_ltc_errors[0]);
+		metrics_add("ltc2_decode_errors_total", "LTC frames missing between decoded frames on ltc_in2", METRIC_COUNTER, &m_ltc_errors[1]);
+		metrics_add("ringbuffer_dropped_total", "Decoded timecodes dropped, message ringbuffer full", METRIC_COUNTER, &m_dropped);
+		metrics_add("mtc1_timecode", "Last decoded timecode on mtc_in", METRIC_TIMECODE, &m_tc[0]);
+		metrics_add("mtc2_timecode", "Last decoded timecode on mtc_in2", METRIC_TIMECODE, &m_tc[1]);
+		metrics_add("ltc1_timecode", "Last decoded timecode on ltc_in", METRIC_TIMECODE, &m_tc[2]);
+		metrics_add("ltc2_timecode", "Last decoded timecode on ltc_in2", METRIC_TIMECODE, &m_tc[3]);
+		if (fo_nprio > 0) {
+			metrics_add("failover_switches_total", "Failover input changes", METRIC_COUNTER, &m_fo_switches);
+			metrics_add("failover_input", "Selected failover input, 1..4: MTC1, MTC2, LTC1, LTC2, 0: none", METRIC_GAUGE, &m_fo_source);
+		}
+		if (metrics_start(metrics_path, "jmltcdebug"))
+			goto out;
 	}
 
+	rtmem_lock(stderr);
+
 	// -=-=-= RUN =-=-=-
 
 	if (jack_activate (j_client)) {
@@ -477,25 +1253,16 @@ int main (int argc, char ** argv) {
 
 #ifndef _WIN32
 	signal(SIGINT, wearedone);
+	signal(SIGUSR1, dumptiming);
 #endif
+	if (timing_interval > 0)
+		jio_timing_interval(timing_interval);
 
 	pthread_mutex_lock (&msg_thread_lock);
 	while (run && j_client) {
-		while ((jack_ringbuffer_read_space (rb) / sizeof(timecode)) > 0) {
-			timecode t;
-			jack_ringbuffer_read(rb, (char*) &t, sizeof(timecode));
-			if (t.ltcid<0)
-				fprintf(stdout, "MTC%d %02i:%02i:%02i.%02i [%s] %lld%c",
-						abs(t.ltcid),
-						t.hour,t.min,t.sec,t.frame,MTCTYPE[t.type], t.tme, newline);
-			else
-				fprintf(stdout, "%sLTC%d %02i:%02i:%02i.%02i ------- %lld%c",
-						(newline=='\r' ? "\t\t\t\t":""),
-						abs(t.ltcid),
-						t.hour,t.min,t.sec,t.frame, t.tme, newline);
-			fflush(stdout);
-		}
-		pthread_cond_wait (&data_ready, &msg_thread_lock);
+		print_timecode();
+		jio_timing_poll(stderr);
+		jio_cond_wait (&data_ready, &msg_thread_lock);
 	}
 	pthread_mutex_unlock (&msg_thread_lock);
 
@@ -0,0 +1,1001 @@
+/* MTC/LTC micro-benchmarks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include <jack/jack.h>
+#include <jack/transport.h>
+#include <jack/midiport.h>
+#include <timecode/timecode.h>
+#include <ltc.h>
+
+#include "jackio.h"
+#include "mtcgen.h"
+#include "mtcparse.h"
+#include "ltcparse.h"
+#include "ltcedge.h"
+
+/* options */
+static double min_time = 0.5; // seconds per benchmark
+static int machine = 0;
+static const char *filter = NULL;
+static int scale_streams = 0;   // > 0: run the multi-stream benchmark
+static int scale_threads = 0;   // 0: one per CPU
+static uint32_t scale_rate = 48000;
+static jack_nframes_t scale_period = 256;
+static int scale_cycles = 4000;
+static int accuracy = 0;
+
+static volatile int sink; // defeat dead-code elimination
+
+/************************************************
+ * timing
+ */
+
+static inline double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline unsigned long long now_cycles(void) {
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+typedef struct {
+	double ns;
+	unsigned long long cycles;
+	unsigned long long ops;
+	unsigned long long events;
+} benchrun;
+
+#define BENCH_BEGIN(R) \
+	double _t0 = now_ns(); \
+	unsigned long long _c0 = now_cycles(); \
+	memset(&(R), 0, sizeof(benchrun)); \
+	do {
+
+#define BENCH_END(R) \
+		(R).ns = now_ns() - _t0; \
+	} while ((R).ns < min_time * 1e9); \
+	(R).cycles = now_cycles() - _c0;
+
+static int selected(const char *name) {
+	return !filter || strstr(name, filter);
+}
+
+static void report_header(void) {
+	if (machine) {
+		printf("# name\tparam\tops\tns_per_op\tcycles_per_op\tevents_per_s\n");
+	} else {
+		printf("%-24s %-26s %12s %12s %14s\n", "benchmark", "parameters", "ns/op", "cycles/op", "events/s");
+	}
+}
+
+static void report(const char *name, const char *param, const benchrun *r) {
+	const double ns_op = r->ops ? r->ns / r->ops : 0;
+	const double cy_op = r->ops ? (double) r->cycles / r->ops : 0;
+	const double ev_s = r->ns > 0 ? r->events * 1e9 / r->ns : 0;
+	if (machine) {
+		printf("%s\t%s\t%llu\t%.3f\t%.1f\t%.0f\n", name, param, r->ops, ns_op, cy_op, ev_s);
+	} else {
+		printf("%-24s %-26s %12.2f %12.1f %14.0f\n", name, param, ns_op, cy_op, ev_s);
+	}
+	fflush(stdout);
+}
+
+/************************************************
+ * MTC parser, per quarter-frame
+ */
+
+#define QF_SEQ (8 * 1024)
+
+static void bench_parse_timecode(void) {
+	static unsigned char qf[QF_SEQ];
+	MTCParser p;
+	benchrun r;
+	int i;
+
+	if (!selected("parse_timecode")) return;
+
+	for (i = 0; i < QF_SEQ; ++i) {
+		const int f = i / 8 * 2;
+		const int fr = f % 25, s = (f / 25) % 60, m = (f / 1500) % 60;
+		switch (i % 8) {
+			case 0: qf[i] = 0x00 | (fr & 0xf); break;
+			case 1: qf[i] = 0x10 | (fr >> 4); break;
+			case 2: qf[i] = 0x20 | (s & 0xf); break;
+			case 3: qf[i] = 0x30 | (s >> 4); break;
+			case 4: qf[i] = 0x40 | (m & 0xf); break;
+			case 5: qf[i] = 0x50 | (m >> 4); break;
+			case 6: qf[i] = 0x60 | 1; break;
+			case 7: qf[i] = 0x70 | 0x2; break;
+		}
+	}
+	memset(&p, 0, sizeof(MTCParser));
+
+	BENCH_BEGIN(r)
+		int rv = 0;
+		for (i = 0; i < QF_SEQ; ++i) {
+			rv += parse_timecode(&p, qf[i]);
+		}
+		r.ops += QF_SEQ;
+		r.events += rv;
+	BENCH_END(r)
+	sink = p.tc.frame;
+	report("parse_timecode", "per-qf", &r);
+}
+
+/************************************************
+ * MTC generator queue, per video-frame
+ */
+
+#define FRAME_BATCH (1024)
+
+static void bench_queue(void) {
+	static MTCGen g;
+	TimecodeTime t;
+	benchrun r;
+	int i;
+
+	mtcgen_init(&g, 48000);
+	memset(&t, 0, sizeof(TimecodeTime));
+
+	if (selected("queue_mtc_quarterframes")) {
+		BENCH_BEGIN(r)
+			for (i = 0; i < FRAME_BATCH; ++i) {
+				t.frame = (2 * i) % 24;
+				queue_mtc_quarterframes(&g, &t, 0x20, 0, 1920, 1920LL * i);
+				r.events += (g.queued_events_start - g.queued_events_end + JACK_MIDI_QUEUE_SIZE) % JACK_MIDI_QUEUE_SIZE;
+				g.queued_events_end = g.queued_events_start;
+			}
+			r.ops += FRAME_BATCH;
+		BENCH_END(r)
+		report("queue_mtc_quarterframes", "25fps per-frame", &r);
+	}
+
+	if (selected("queue_mtc_sysex")) {
+		BENCH_BEGIN(r)
+			for (i = 0; i < FRAME_BATCH; ++i) {
+				t.frame = i % 25;
+				queue_mtc_sysex(&g, &t, 0x20, 1920LL * i);
+				g.queued_events_end = g.queued_events_start;
+			}
+			r.ops += FRAME_BATCH;
+			r.events += FRAME_BATCH;
+		BENCH_END(r)
+		report("queue_mtc_sysex", "25fps per-frame", &r);
+	}
+	sink = g.queued_events_start;
+}
+
+/************************************************
+ * MTC generator, per JACK cycle
+ */
+
+#define CYCLE_BATCH (256)
+
+static void bench_generate_one(void *out, uint32_t sr, jack_nframes_t period, const TimecodeRate *rate) {
+	static MTCGen g;
+	jack_position_t pos;
+	benchrun r;
+	char param[64];
+	int i;
+
+	mtcgen_init(&g, sr);
+	g.framerate = *rate;
+	mtcgen_set_rate(&g);
+	memset(&pos, 0, sizeof(jack_position_t));
+	pos.frame_rate = sr;
+
+	BENCH_BEGIN(r)
+		const unsigned long long ev0 = jio.out_events;
+		for (i = 0; i < CYCLE_BATCH; ++i) {
+			mtcgen_process(&g, JackTransportRolling, &pos, period, out);
+			pos.frame += period;
+			if (pos.frame > sr * 3600) {
+				pos.frame = 0;
+			}
+		}
+		r.ops += CYCLE_BATCH;
+		r.events += jio.out_events - ev0;
+	BENCH_END(r)
+
+	snprintf(param, sizeof(param), "%6uHz %5u %.2ffps",
+			sr, period, timecode_rate_to_double(rate));
+	report("generate_mtc", param, &r);
+}
+
+static void bench_generate(void) {
+	static const uint32_t rates[] = { 44100, 48000, 96000, 192000 };
+	static const jack_nframes_t periods[] = { 64, 256, 1024, 4096 };
+	static const TimecodeRate fps[] = {
+		{ 24, 1, 0, 80 },
+		{ 30000, 1001, 1, 80 },
+		{ 30, 1, 0, 80 },
+	};
+	const TimecodeRate fps25 = { 25, 1, 0, 80 };
+	unsigned int i, k;
+	jio_port *p;
+	void *out;
+
+	if (!selected("generate_mtc")) return;
+
+	if (!(p = jio_port_register("mtc_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput))) {
+		return;
+	}
+	out = jio_port_get_buffer(p, 0);
+
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+		for (k = 0; k < sizeof(periods) / sizeof(periods[0]); ++k) {
+			bench_generate_one(out, rates[i], periods[k], &fps25);
+		}
+	}
+	for (i = 0; i < sizeof(fps) / sizeof(fps[0]); ++i) {
+		bench_generate_one(out, 48000, 256, &fps[i]);
+	}
+}
+
+/************************************************
+ * LTC decoder, per JACK cycle
+ */
+
+#define LTC_SECONDS (10)
+
+/* LTC_SECONDS of 25fps LTC, @len samples */
+static jack_default_audio_sample_t *ltc_signal(uint32_t sr, size_t *len) {
+	const int fps = 25;
+	jack_default_audio_sample_t *sig;
+	ltcsnd_sample_t *enc;
+	SMPTETimecode st;
+	LTCEncoder *e;
+	int i, k;
+
+	*len = 0;
+	if (!(e = ltc_encoder_create(sr, fps, LTC_TV_625_50, LTC_USE_DATE))) {
+		return NULL;
+	}
+	enc = malloc(ltc_encoder_get_buffersize(e));
+	sig = malloc(sizeof(jack_default_audio_sample_t) * (sr + 1) * LTC_SECONDS);
+
+	memset(&st, 0, sizeof(SMPTETimecode));
+	strcpy(st.timezone, "+0000");
+	st.years = 12; st.months = 1; st.days = 1;
+	ltc_encoder_set_timecode(e, &st);
+
+	for (k = 0; k < LTC_SECONDS * fps; ++k) {
+		ltc_encoder_encode_frame(e);
+		const int n = ltc_encoder_get_buffer(e, enc);
+		for (i = 0; i < n; ++i) {
+			sig[(*len)++] = (enc[i] - 128) / 127.0;
+		}
+		ltc_encoder_inc_timecode(e);
+	}
+	ltc_encoder_free(e);
+	free(enc);
+	return sig;
+}
+
+static void bench_ltc(void) {
+	static const jack_nframes_t periods[] = { 64, 256, 1024, 4096 };
+	const uint32_t sr = 48000;
+	const int fps = 25;
+	jack_default_audio_sample_t *sig;
+	LTCFrameExt frame;
+	size_t len;
+	unsigned int i, k;
+
+	if (!selected("parse_ltc")) return;
+
+	if (!(sig = ltc_signal(sr, &len))) {
+		return;
+	}
+
+	for (k = 0; k < sizeof(periods) / sizeof(periods[0]); ++k) {
+		const jack_nframes_t period = periods[k];
+		const size_t blocks = len / period;
+		LTCDecoder *d = ltc_decoder_create(sr / fps, 32);
+		unsigned long long pos = 0;
+		benchrun r;
+		char param[64];
+
+		BENCH_BEGIN(r)
+			for (i = 0; i < blocks; ++i) {
+				parse_ltc(d, period, &sig[i * period], pos);
+				pos += period;
+				while (ltc_decoder_read(d, &frame)) {
+					++r.events;
+				}
+			}
+			r.ops += blocks;
+		BENCH_END(r)
+
+		ltc_decoder_free(d);
+		snprintf(param, sizeof(param), "%6uHz %5u %dfps", sr, period, fps);
+		report("parse_ltc", param, &r);
+	}
+	free(sig);
+}
+
+/************************************************
+ * LTC sub-sample frame timing (ltcedge.h), accuracy
+ *
+ * 25fps biphase-mark frames with known start times are rendered with
+ * raised-cosine edges of a given rise-time, a DC offset and gaussian
+ * noise, and passed to ltcedge period by period. The decoder's frame
+ * positions are simulated with a whole-sample error of up to +-2; the
+ * refined start is compared with the true frame boundary.
+ */
+
+#define EDGE_FRAMES (250)
+
+typedef struct {
+	const char *name;
+	double speed;
+	double noise;    // rms, peak-to-peak signal is 1
+	double rise;     // edge rise-time [samples]
+	jack_nframes_t period;
+} edgecase;
+
+static unsigned int edge_seed = 1;
+
+static unsigned int edge_rand(void) {
+	edge_seed ^= edge_seed << 13;
+	edge_seed ^= edge_seed >> 17;
+	edge_seed ^= edge_seed << 5;
+	return edge_seed;
+}
+
+static double edge_gauss(void) {
+	const double u = (edge_rand() + 1.0) / 4294967297.0;
+	const double v = edge_rand() / 4294967296.0;
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+/* EDGE_FRAMES frames, @fstart: true frame boundaries [EDGE_FRAMES + 1] */
+static jack_default_audio_sample_t *edge_signal(const edgecase *c, uint32_t sr, double *fstart, size_t *len) {
+	const double spb = sr / 25.0 / LTC_FRAME_BIT_COUNT / c->speed;
+	const size_t max_edges = 2 * LTC_FRAME_BIT_COUNT * EDGE_FRAMES;
+	double *edges = malloc(max_edges * sizeof(double));
+	jack_default_audio_sample_t *sig;
+	double t = 1234.37; // not sample aligned
+	size_t n, ne = 0, k0 = 0, k;
+	int f, b;
+
+	for (f = 0; f < EDGE_FRAMES; ++f) {
+		fstart[f] = t;
+		for (b = 0; b < LTC_FRAME_BIT_COUNT; ++b) {
+			/* sync word, bits 64..79: 0011111111111101 */
+			const int bit = b < 64 ? edge_rand() & 1 : (0x3ffd >> (79 - b)) & 1;
+			edges[ne++] = t;
+			if (bit) {
+				edges[ne++] = t + spb / 2;
+			}
+			t += spb;
+		}
+	}
+	fstart[EDGE_FRAMES] = t;
+
+	*len = t + 2 * sr / 25;
+	sig = malloc(*len * sizeof(jack_default_audio_sample_t));
+	for (n = 0; n < *len; ++n) {
+		/* level after the settled edges, +-0.5 alternating, plus the edges in transit */
+		while (k0 < ne && n - edges[k0] > c->rise / 2) {
+			++k0;
+		}
+		double v = (k0 & 1) ? -0.5 : 0.5;
+		for (k = k0; k < ne && n - edges[k] >= -c->rise / 2; ++k) {
+			const double u = (n - edges[k]) / c->rise;
+			v += ((k & 1) ? 1 : -1) * (0.5 + 0.5 * sin(M_PI * u));
+		}
+		sig[n] = 0.8 * (v + 0.1) + c->noise * edge_gauss();
+	}
+	free(edges);
+	return sig;
+}
+
+static void edge_accuracy(void) {
+	static const edgecase cases[] = {
+		{ "clean",          1.00, 0,    2, 256 },
+		{ "noise -40dB",    1.00, 0.01, 2, 256 },
+		{ "noise -26dB",    1.00, 0.05, 2, 256 },
+		{ "slow edges",     1.00, 0.01, 8, 256 },
+		{ "varispeed -3%",  0.97, 0.01, 4, 256 },
+		{ "varispeed +3%",  1.03, 0.01, 4, 256 },
+		{ "small period",   1.00, 0.01, 4, 64 },
+		{ "all of the above", 1.03, 0.05, 8, 64 },
+	};
+	const uint32_t sr = 48000;
+	const ltc_off_t off = -100000; // decoder positions are not the sample index
+	double fstart[EDGE_FRAMES + 1];
+	unsigned int i;
+
+	if (machine) {
+		printf("# case\tspeed\tnoise\trise\tperiod\trefined\tdecoder_rms\terr_rms\terr_max\n");
+	} else {
+		printf("%-18s %6s %6s %5s %6s %8s %12s %10s %10s\n", "ltcedge accuracy", "speed", "noise", "rise", "period",
+				"refined", "decoder rms", "err rms", "err max");
+	}
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		const edgecase *c = &cases[i];
+		double dsum2 = 0, sum2 = 0, maxerr = 0;
+		int f = 0, nchk = 0, nfit = 0;
+		size_t len, p;
+		LTCEdge e;
+
+		edge_seed = 1;
+		jack_default_audio_sample_t *sig = edge_signal(c, sr, fstart, &len);
+		if (!sig || ltcedge_init(&e, sr, 24)) {
+			fprintf(stderr, "cannot allocate the test signal.\n");
+			free(sig);
+			return;
+		}
+		for (p = 0; p + c->period <= len; p += c->period) {
+			ltcedge_period(&e, &sig[p], c->period, off + (ltc_off_t) p);
+			/* libltc reports a frame half a bit after its last edge */
+			while (f < EDGE_FRAMES && fstart[f + 1] + sr / 25.0 / LTC_FRAME_BIT_COUNT / 2 < p + c->period) {
+				LTCFrameExt fr;
+				memset(&fr, 0, sizeof(LTCFrameExt));
+				fr.off_start = off + (ltc_off_t) floor(fstart[f]) + (int)(edge_rand() % 5) - 2;
+				fr.off_end = off + (ltc_off_t) floor(fstart[f + 1]) - 1 + (int)(edge_rand() % 5) - 2;
+				const double err = ltcedge_refine(&e, &fr) - off - fstart[f];
+				if (e.fit_rms >= 0) {
+					++nfit;
+				}
+				/* the first frame is extrapolated from its own sync word */
+				if (f > 0) {
+					const double derr = fr.off_start - off - fstart[f];
+					dsum2 += derr * derr;
+					sum2 += err * err;
+					if (fabs(err) > maxerr) maxerr = fabs(err);
+					++nchk;
+				}
+				++f;
+			}
+			ltcedge_retain(&e);
+		}
+		if (machine) {
+			printf("%s\t%.2f\t%.3f\t%.0f\t%u\t%d/%d\t%.4f\t%.4f\t%.4f\n", c->name, c->speed, c->noise, c->rise, c->period,
+					nfit, f, sqrt(dsum2 / nchk), sqrt(sum2 / nchk), maxerr);
+		} else {
+			printf("%-18s %6.2f %6.3f %5.0f %6u %4d/%-3d %12.4f %10.4f %10.4f\n", c->name, c->speed, c->noise, c->rise, c->period,
+					nfit, f, sqrt(dsum2 / nchk), sqrt(sum2 / nchk), maxerr);
+		}
+		ltcedge_free(&e);
+		free(sig);
+	}
+}
+
+/************************************************
+ * multi-stream scaling, per JACK cycle
+ *
+ * Each stream is one MTC generator, an MTC decoder that parses the
+ * generator's output and an LTC decoder. A cycle processes all streams,
+ * either on one thread or split evenly across worker threads that wait
+ * for the cycle by spinning (as the workers of a parallel process
+ * graph would, without the wakeup latency). Cycles run back to back,
+ * not at the audio clock.
+ */
+
+typedef struct {
+	MTCGen gen;
+	jio_midi_buffer midi;
+	MTCParser mtc;
+	LTCDecoder *ltc;
+	jack_position_t pos;
+	size_t ltc_block;          // next block of the LTC signal
+	unsigned long long ltc_pos;
+	unsigned long long n_mtc;  // decoded timecodes
+	unsigned long long n_ltc;
+} scalestream;
+
+typedef struct {
+	pthread_t thread;
+	int first, last;           // streams [first, last)
+} scaleworker;
+
+static scalestream **sc_stream = NULL;
+static scaleworker *sc_worker = NULL;
+static jack_default_audio_sample_t *sc_sig = NULL;
+static size_t sc_blocks = 0;   // LTC signal, in periods
+
+static unsigned int sc_gen = 0;    // cycle count, workers start a cycle when it changes
+static int sc_pending = 0;         // workers still busy with the current cycle
+static int sc_run = 1;
+static int sc_cpu[CPU_SETSIZE];    // CPUs this process may run on
+static int sc_ncpu = 0;
+static int sc_unpinned = 0;        // threads of the last run that could not be pinned
+
+/* busy-wait, yield now and then in case there are more threads than CPUs */
+static inline void cpu_relax(unsigned int *spin) {
+	if (++*spin % 4096 == 0) {
+		sched_yield();
+		return;
+	}
+#ifdef HAVE_TSC
+	_mm_pause();
+#endif
+}
+
+/* mtcgen_process() writing to the stream's own buffer, the sim backend
+ * port-buffer would update shared counters */
+static void scale_stream_process(scalestream *s, jack_nframes_t period) {
+	const jack_midi_data_t *data;
+	LTCFrameExt frame;
+	long long int mt;
+	size_t size;
+	uint32_t i;
+
+	mtcgen_render(&s->gen, JackTransportRolling, &s->pos, period);
+	jio_midi_buffer_clear(&s->midi);
+	while (mtcgen_pop(&s->gen, period, &mt, &data, &size)) {
+		jio_midi_buffer_add(&s->midi, mt - s->gen.monotonic_fcnt, data, size);
+	}
+	s->gen.monotonic_fcnt += period;
+	s->pos.frame += period;
+	if (s->pos.frame > scale_rate * 3600) {
+		s->pos.frame = 0;
+	}
+
+	for (i = 0; i < s->midi.n_events; ++i) {
+		const jack_midi_data_t *d = &s->midi.data[s->midi.ev[i].offset];
+		if (s->midi.ev[i].size == 2 && d[0] == 0xf1) {
+			s->n_mtc += parse_timecode(&s->mtc, d[1]);
+		}
+	}
+
+	parse_ltc(s->ltc, period, &sc_sig[s->ltc_block * period], s->ltc_pos);
+	s->ltc_pos += period;
+	s->ltc_block = (s->ltc_block + 1) % sc_blocks;
+	while (ltc_decoder_read(s->ltc, &frame)) {
+		++s->n_ltc;
+	}
+}
+
+static void scale_range(const scaleworker *w) {
+	int i;
+	for (i = w->first; i < w->last; ++i) {
+		scale_stream_process(sc_stream[i], scale_period);
+	}
+}
+
+static void *scale_worker(void *arg) {
+	const scaleworker *w = (const scaleworker*) arg;
+	unsigned int seen = 0;
+	for (;;) {
+		unsigned int gen, spin = 0;
+		while ((gen = __atomic_load_n(&sc_gen, __ATOMIC_ACQUIRE)) == seen) {
+			cpu_relax(&spin);
+		}
+		seen = gen;
+		if (!__atomic_load_n(&sc_run, __ATOMIC_RELAXED)) {
+			break;
+		}
+		scale_range(w);
+		__atomic_fetch_sub(&sc_pending, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* the CPUs in the process' affinity mask, returns their count */
+static int scale_cpus(void) {
+	int cpu;
+	sc_ncpu = 0;
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == 0) {
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &set)) {
+				sc_cpu[sc_ncpu++] = cpu;
+			}
+		}
+		return sc_ncpu;
+	}
+#endif
+	cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpu > 0 ? cpu : 1;
+}
+
+/* pin worker @k to a CPU of its own, threads share CPUs round-robin
+ * if there are more of them; returns -1 if the thread is not pinned */
+static int scale_pin(pthread_t t, int k) {
+#ifdef __linux__
+	cpu_set_t set;
+	if (sc_ncpu == 0) {
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(sc_cpu[k % sc_ncpu], &set);
+	return pthread_setaffinity_np(t, sizeof(cpu_set_t), &set) ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+static int cmp_double(const void *a, const void *b) {
+	const double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* process @n streams on @threads threads for scale_cycles cycles,
+ * sort the cycle times into @ns */
+static int scale_run(int n, int threads, double *ns) {
+	int c, k;
+
+	sc_run = 1;
+	sc_gen = 0;
+	sc_unpinned = 0;
+	for (k = 0; k < threads; ++k) {
+		sc_worker[k].first = k * n / threads;
+		sc_worker[k].last = (k + 1) * n / threads;
+	}
+	/* worker 0 is the calling thread */
+	for (k = 1; k < threads; ++k) {
+		if (pthread_create(&sc_worker[k].thread, NULL, scale_worker, &sc_worker[k])) {
+			fprintf(stderr, "cannot start worker thread.\n");
+			__atomic_store_n(&sc_run, 0, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&sc_gen, 1, __ATOMIC_RELEASE);
+			while (--k > 0) {
+				pthread_join(sc_worker[k].thread, NULL);
+			}
+			return -1;
+		}
+		if (scale_pin(sc_worker[k].thread, k)) {
+			++sc_unpinned;
+		}
+	}
+	if (scale_pin(pthread_self(), 0)) {
+		++sc_unpinned;
+	}
+
+	for (c = -scale_cycles / 10; c < scale_cycles; ++c) {
+		const double t0 = now_ns();
+		unsigned int spin = 0;
+		__atomic_store_n(&sc_pending, threads - 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sc_gen, 1, __ATOMIC_RELEASE);
+		scale_range(&sc_worker[0]);
+		while (__atomic_load_n(&sc_pending, __ATOMIC_ACQUIRE) > 0) {
+			cpu_relax(&spin);
+		}
+		if (c >= 0) { // the first 10% warm up
+			ns[c] = now_ns() - t0;
+		}
+	}
+
+	__atomic_store_n(&sc_run, 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sc_gen, 1, __ATOMIC_RELEASE);
+	for (k = 1; k < threads; ++k) {
+		pthread_join(sc_worker[k].thread, NULL);
+	}
+	qsort(ns, scale_cycles, sizeof(double), cmp_double);
+	return 0;
+}
+
+static scalestream *scale_stream_new(int idx) {
+	scalestream *s;
+	if (posix_memalign((void**) &s, 64, sizeof(scalestream))) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(scalestream));
+	mtcgen_init(&s->gen, scale_rate);
+	if (!(s->ltc = ltc_decoder_create(scale_rate / 25, 32))) {
+		free(s);
+		return NULL;
+	}
+	/* spread the streams over the timeline */
+	s->pos.frame_rate = scale_rate;
+	s->pos.frame = (jack_nframes_t)(idx * 7919) * scale_period % (scale_rate * 3600);
+	s->ltc_block = (idx * 97) % sc_blocks;
+	return s;
+}
+
+static void scale_report_header(const double deadline) {
+	if (machine) {
+		printf("# streams\tthreads\tmean_ns\tp99_ns\tmax_ns\tdeadline_ns\tdsp_p99\n");
+	} else {
+		printf("multi-stream scaling: %uHz, %u frames/period, deadline %.1f us, %d cycles\n\n",
+				scale_rate, scale_period, deadline / 1e3, scale_cycles);
+		printf("%8s %8s %12s %12s %12s %8s\n", "streams", "threads", "mean [us]", "p99 [us]", "max [us]", "p99 DSP");
+	}
+}
+
+static void bench_scale(void) {
+	const double deadline = 1e9 * scale_period / scale_rate;
+	const int ncpu = scale_cpus();
+	int threads[2] = { 1, scale_threads > 0 ? scale_threads : ncpu };
+	double *ns;
+	size_t len;
+	int n, t, k;
+
+	if (threads[1] > ncpu) {
+		fprintf(stderr, "Warning: %d threads on %d CPUs, workers will wait for each other.\n", threads[1], ncpu);
+	}
+	if (!(sc_sig = ltc_signal(scale_rate, &len))) {
+		fprintf(stderr, "cannot create LTC signal.\n");
+		return;
+	}
+	sc_blocks = len / scale_period;
+	sc_stream = calloc(scale_streams, sizeof(scalestream*));
+	sc_worker = calloc(threads[1] > 1 ? threads[1] : 1, sizeof(scaleworker));
+	ns = malloc(scale_cycles * sizeof(double));
+	for (k = 0; k < scale_streams; ++k) {
+		if (!(sc_stream[k] = scale_stream_new(k))) {
+			fprintf(stderr, "cannot allocate stream %d.\n", k);
+			scale_streams = k;
+			break;
+		}
+	}
+
+	scale_report_header(deadline);
+
+	for (t = 0; t < 2; ++t) {
+		double be = 0;       // break-even: streams where p99 reaches the deadline
+		int be_exact = 0;
+		int prev_n = 0;
+		double prev_p99 = 0;
+		int warned = 0;
+
+		if (t == 1 && (threads[1] <= 1 || threads[1] > scale_streams)) {
+			break;
+		}
+		/* at least one stream per thread */
+		for (n = threads[t]; n <= scale_streams; n = 2 * n > scale_streams ? scale_streams : 2 * n) {
+			double mean = 0;
+			int c;
+			if (scale_run(n, threads[t], ns)) {
+				break;
+			}
+			if (sc_unpinned > 0 && !warned) {
+				fprintf(stderr, "Warning: %d of %d threads could not be pinned to a CPU, their timing may be skewed.\n", sc_unpinned, threads[t]);
+				warned = 1;
+			}
+			for (c = 0; c < scale_cycles; ++c) {
+				mean += ns[c];
+			}
+			mean /= scale_cycles;
+			const double p99 = ns[(int)(.99 * (scale_cycles - 1))];
+			const double max = ns[scale_cycles - 1];
+
+			if (machine) {
+				printf("%d\t%d\t%.0f\t%.0f\t%.0f\t%.0f\t%.3f\n", n, threads[t], mean, p99, max, deadline, p99 / deadline);
+			} else {
+				printf("%8d %8d %12.2f %12.2f %12.2f %7.1f%%%s\n", n, threads[t], mean / 1e3, p99 / 1e3, max / 1e3, 100 * p99 / deadline,
+						sc_unpinned > 0 ? " unpinned" : "");
+			}
+			fflush(stdout);
+
+			if (p99 >= deadline) {
+				/* interpolate between the last two runs */
+				be = prev_n + (n - prev_n) * (deadline - prev_p99) / (p99 - prev_p99);
+				be_exact = 1;
+				break;
+			}
+			prev_n = n;
+			prev_p99 = p99;
+			if (n == scale_streams) {
+				break;
+			}
+		}
+		if (!be_exact && prev_n > 0) {
+			/* extrapolate from the per-stream cost of the largest run */
+			be = prev_n * deadline / prev_p99;
+		}
+		if (!machine && be > 0) {
+			printf("break-even %s%.0f streams on %d thread%s: %.0f streams per core%s\n\n",
+					be_exact ? "" : "~", be, threads[t], threads[t] > 1 ? "s" : "",
+					be / threads[t], be_exact ? "" : " (extrapolated)");
+		} else if (be > 0) {
+			printf("# break_even\t%d\t%.0f\t%.1f\n", threads[t], be, be / threads[t]);
+		}
+	}
+
+	if (!machine) {
+		unsigned long long n_mtc = 0, n_ltc = 0;
+		for (k = 0; k < scale_streams; ++k) {
+			n_mtc += sc_stream[k]->n_mtc;
+			n_ltc += sc_stream[k]->n_ltc;
+		}
+		printf("decoded %llu MTC and %llu LTC timecodes\n", n_mtc, n_ltc);
+	}
+
+	for (k = 0; k < scale_streams; ++k) {
+		sink += sc_stream[k]->n_mtc + sc_stream[k]->n_ltc;
+		ltc_decoder_free(sc_stream[k]->ltc);
+		free(sc_stream[k]);
+	}
+	free(sc_stream);
+	free(sc_worker);
+	free(sc_sig);
+	free(ns);
+}
+
+/**************************
+ * main application code
+ */
+
+static struct option const long_options[] =
+{
+  {"accuracy", no_argument, 0, 'A'},
+  {"help", no_argument, 0, 'h'},
+  {"threads", required_argument, 0, 'j'},
+  {"machine", no_argument, 0, 'm'},
+  {"cycles", required_argument, 0, 'n'},
+  {"period", required_argument, 0, 'p'},
+  {"samplerate", required_argument, 0, 'r'},
+  {"scale", required_argument, 0, 'S'},
+  {"time", required_argument, 0, 't'},
+  {"version", no_argument, 0, 'V'},
+  {NULL, 0, NULL, 0}
+};
+
+static void usage (int status) {
+  printf ("jmtcbench - micro-benchmarks for the MTC/LTC hot paths.\n\n");
+  printf ("Usage: jmtcbench [ OPTIONS ] [benchmark-name]\n\n");
+  printf ("Options:\n\
+  -A, --accuracy             measure the LTC sub-sample frame timing\n\
+                             on synthetic signals instead\n\
+  -h, --help                 display this help and exit\n\
+  -j, --threads <num>        worker threads for -S (default: one per CPU)\n\
+  -m, --machine              print tab-separated values\n\
+  -n, --cycles <num>         process cycles per -S run (default 4000)\n\
+  -p, --period <frames>      period-size for -S (default 256)\n\
+  -r, --samplerate <rate>    sample-rate for -S (default 48000)\n\
+  -S, --scale <streams>      run the multi-stream benchmark with up to\n\
+                             <streams> streams instead\n\
+  -t, --time <sec>           minimum run-time per benchmark (default 0.5)\n\
+  -V, --version              print version information and exit\n\
+\n");
+  printf ("\n\
+Benchmarks: parse_timecode (per quarter-frame), queue_mtc_quarterframes\n\
+and queue_mtc_sysex (per video-frame), generate_mtc (per process cycle\n\
+for various sample-rates, period-sizes and frame-rates) and parse_ltc\n\
+(LTC audio decoding, per process cycle).\n\
+\n\
+Events are decoded timecodes (parse_timecode, parse_ltc), queued\n\
+messages (queue_*) or MIDI events written (generate_mtc).\n\
+If a benchmark-name is given, only benchmarks containing it are run.\n\
+cycles/op is only available on x86 (TSC).\n\
+\n\
+The multi-stream benchmark (-S) runs 1, 2, 4, .. streams, each one an\n\
+MTC generator, an MTC decoder for its output and an LTC decoder, for\n\
+synthetic process cycles: on one thread, then split across the worker\n\
+threads (on Linux pinned to the usable CPUs in turn; rows with threads\n\
+that could not be pinned are marked). It reports the time per\n\
+cycle (mean, 99th percentile, max) and the p99 DSP load, the fraction\n\
+of the period that is used. A run stops when the p99 reaches the\n\
+deadline; the break-even is interpolated from the last two runs, or\n\
+extrapolated from the largest one. Cycles run back to back with warm\n\
+caches and no scheduling jitter, leave headroom for those.\n\
+\n\
+The accuracy test (-A) renders LTC frames with known start times, with\n\
+noise, slow edges and varispeed, and compares jmltcdebug's refined frame\n\
+start with the true one. It reports the frames refined, the error of the\n\
+simulated decoder positions and of the refined start, in samples.\n\
+\n");
+  printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
+          "Website and manual: <https://github.com/x42/mtc-tools>\n"
+	  );
+  exit (status);
+}
+
+static int decode_switches (int argc, char **argv) {
+	int c;
+
+	while ((c = getopt_long (argc, argv,
+			   "A"	/* accuracy */
+			   "h"	/* help */
+			   "j:"	/* threads */
+			   "m"	/* machine */
+			   "n:"	/* cycles */
+			   "p:"	/* period */
+			   "r:"	/* samplerate */
+			   "S:"	/* scale */
+			   "t:"	/* time */
+			   "V",	/* version */
+			   long_options, (int *) 0)) != EOF) {
+		switch (c) {
+			case 'A':
+				accuracy = 1;
+				break;
+			case 'j':
+				scale_threads = atoi(optarg);
+				break;
+			case 'm':
+				machine = 1;
+				break;
+			case 'n':
+				scale_cycles = atoi(optarg);
+				break;
+			case 'p':
+				scale_period = atoi(optarg);
+				break;
+			case 'r':
+				scale_rate = atoi(optarg);
+				break;
+			case 'S':
+				scale_streams = atoi(optarg);
+				break;
+			case 't':
+				min_time = atof(optarg);
+				break;
+			case 'V':
+				printf ("jmtcbench version %s\n\n", VERSION);
+				printf ("License GPLv2+: GNU GPL version 2 or later.\n");
+				exit (0);
+
+			case 'h':
+				usage (0);
+
+			default:
+				usage (EXIT_FAILURE);
+		}
+	}
+	return optind;
+}
+
+int main (int argc, char ** argv) {
+	decode_switches (argc, argv);
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+
+	if (scale_cycles < 100 || scale_period < 16 || scale_period > JIO_MAX_PERIOD || scale_rate < 8000) {
+		fprintf(stderr, "invalid -S parameters.\n");
+		return 1;
+	}
+	if (scale_streams > 0) {
+		bench_scale();
+		return 0;
+	}
+	if (accuracy) {
+		edge_accuracy();
+		return 0;
+	}
+
+	/* MIDI port-buffers without JACK */
+	jio_sim_open(48000, 1024);
+
+	report_header();
+	bench_parse_timecode();
+	bench_queue();
+	bench_generate();
+	bench_ltc();
+
+	jio_cleanup();
+	return 0;
+}
@@ -18,6 +18,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sendmmsg
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #include <pthread.h>
@@ -30,7 +34,6 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
-#include <sys/mman.h>
 
 #ifndef WIN32
 #include <signal.h>
@@ -42,155 +45,616 @@
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
 
-#define RBSIZE 20
+#ifdef HAVE_LTC
+#include <ltc.h>
+#endif
 
-typedef struct {
-	int frame;
-	int sec;
-	int min;
-	int hour;
+#include "jackio.h"
+#include "mtcparse.h"
+#include "metrics.h"
+#include "mtccue.h"
+#include "mtcindex.h"
+#include "mtcudp.h"
 
-	int type;
-	int tick;
+#define RBSIZE (64) // > timecodes decoded in a JIO_MAX_PERIOD cycle
+
+typedef struct {
+	MTCTime tc;
 	unsigned long long int tme;
+	unsigned long long int start; // QF0 of the sequence
+	int64_t mono;                 // host time of @start [usec]
+	int64_t real;
+	int64_t tp;                   // transport position at @start, -1: not rolling
 } timecode;
 
 /* global Vars */
-static timecode tc;
-static int full_tc = 0;
-static int have_first_full = 0;
+static MTCParser mtc;
+
+/* statistics, relaxed atomics (read by the metrics thread) */
+static uint64_t m_qf = 0;
+static uint64_t m_frames = 0;
+static uint64_t m_dropped = 0;
+static uint64_t m_tc = 0;
 
 static jack_ringbuffer_t *rb = NULL;
 static pthread_mutex_t msg_thread_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
 
-const char MTCTYPE[4][10] = {
-	"24fps",
-	"25fps",
-	"29fps",
-	"30fps",
-};
-
-const double expected_tme[4] = {
-	24, 25, 30000.0/1001.0, 30
-};
-
 /* options */
 char newline = '\r'; // or '\n';
+static char *capture_file = NULL;
+static char *replay_file = NULL;
+static char *metrics_path = NULL;
+static char *cue_file = NULL;
+static char *index_file = NULL;
+static int ltc_output = 0;
+static char *udp_dest = NULL;
+static int udp_quarterframes = 0;
+static int print_hosttime = 0;
+static int sync_monitor = 0;
+static double sync_alert = 1.0; // threshold [frames]
+static MTCIndexWriter mtcindex;
+static double timing_interval = 0;
 
 
-/************************************************
- * parse MTC message data
- */
-
-#define SE(ARG) tc.tick=ARG; full_tc|=1<<(ARG);
-#define SL(ARG) ARG = ( ARG &(~0xf)) | (data&0xf);
-#define SH(ARG) ARG = ( ARG &(~0xf0)) | ((data&0xf)<<4);
-
-int parse_timecode( int data) {
-	int rv = 0;
-	switch (data>>4) {
-		case 0x0: // #0000 frame LSN
-			SE(1); SL(tc.frame); break;
-		case 0x1: // #0001 frame MSN
-			SE(2); SH(tc.frame); break;
-		case 0x2: // #0010 sec LSN
-			SE(3); SL(tc.sec); break;
-		case 0x3: // #0011 sec MSN
-			SE(4); SH(tc.sec); break;
-		case 0x4: // #0100 min LSN
-			SE(5); SL(tc.min); break;
-		case 0x5: // #0101 min MSN
-			SE(6); SH(tc.min); break;
-		case 0x6: // #0110 hour LSN
-			SE(7); SL(tc.hour); break;
-		case 0x7: // #0111 hour MSN and type
-			SE(0);tc.hour= (tc.hour&(~0xf0)) | ((data&1)<<4);
-			tc.type = (data>>1)&3;
-			if (full_tc!=0xff) break;
-#if 0
-			printf("->- %02i:%02i:%02i.%02i[%s]\n",tc.hour,tc.min,tc.sec,tc.frame,MTCTYPE[tc.type]);
-#endif
-			full_tc = 0; rv = 1; have_first_full = 1;
-		default:
-			;
-	}
-	return rv;
-}
-
 /************************************************
  * jack-midi
  */
 
 jack_client_t *j_client = NULL;
-jack_port_t   *mtc_input_port;
+jio_port      *mtc_input_port;
+jio_port      *cue_output_port = NULL;
 
 static uint32_t j_samplerate = 48000;
 static unsigned long long qf_tme = 0;
+static unsigned long long qf0_tme = 0;
 static unsigned long long ff_tme = 0;
 static volatile unsigned long long monotonic_cnt = 0;
 
+/* cues, chasing the decoded timecode */
+static MTCCue cues;
+static void *cue_buf = NULL;
+static uint32_t cue_key = 0; // frame that started at the last QF0/QF4
+static int cue_lock = 0;
+static int cue_qf = 0;       // last QF piece
+static int cue_seq = 0;      // consecutive QFs
+
+static const int cue_fps[4] = { 24, 25, 30, 30 };
+
+static void cue_quarterframe(const jack_midi_event_t *ev, unsigned long long mfcnt, int complete) {
+	const int piece = ev->buffer[1] >> 4;
+	const int fps = cue_fps[mtc.tc.type];
+	const int drop = mtc.tc.type == 2;
+
+	/* out of sequence or gap > 1/10 sec (stop, locate) */
+	if (piece != ((cue_qf + 1) & 7) || mfcnt + ev->time - qf_tme > j_samplerate / 10) {
+		cue_lock = 0;
+		cue_seq = 0;
+	}
+	cue_qf = piece;
+	++cue_seq;
+
+	/* only a timecode made of 8 consecutive QFs is trustworthy */
+	if (complete && cue_seq >= 8) {
+		/* the 8 QFs started 2 frames ago, the current frame started at QF4 */
+		const uint32_t key = mtccue_next(MTCCUE_KEY(mtc.tc.hour, mtc.tc.min, mtc.tc.sec, mtc.tc.frame), fps, drop);
+		if (!cue_lock || key != cue_key) {
+			cue_key = key;
+			cue_lock = 1;
+			mtccue_frame(&cues, cue_key, fps, drop, ev->time, cue_buf);
+		}
+	} else if (cue_lock && (piece == 0 || piece == 4)) {
+		cue_key = mtccue_next(cue_key, fps, drop);
+		mtccue_frame(&cues, cue_key, fps, drop, ev->time, cue_buf);
+	}
+}
+
+/************************************************
+ * transport sync monitor
+ *
+ * The JACK transport position at the arrival of QF0 (less the capture
+ * latency of mtc_in) is compared to the start of the frame that the
+ * sequence decodes to, at the MTC frame-rate. The reader thread keeps
+ * statistics of the last SYNC_WINDOW offsets and of the whole run. An
+ * alert is raised when an offset exceeds the threshold, and cleared
+ * once all offsets in the window are within it again.
+ */
+
+#define SYNC_WINDOW (64)
+
+/* process thread */
+static int sync_rolling = 0;
+static jack_nframes_t sync_frame = 0;    // transport at the start of the cycle
+static jack_nframes_t sync_latency = 0;  // mtc_in capture latency, jack_latency_cb()
+static int64_t sync_qf0 = -1;
+
+/* reader thread */
+static int64_t sync_win[SYNC_WINDOW];
+static int sync_n = 0;
+static int sync_i = 0;
+static int sync_alerted = 0;
+static unsigned long long sync_checked = 0;
+static double sync_mean = 0, sync_m2 = 0;
+static int64_t sync_min = 0, sync_max = 0;
+
+static uint64_t m_sync_offset = 0;
+static uint64_t m_sync_alerts = 0;
+static uint64_t m_sync_alert = 0;
+
+static void sync_cycle(void) {
+	jack_position_t pos;
+	sync_rolling = jio_transport_query(&pos) == JackTransportRolling;
+	sync_frame = pos.frame;
+}
+
+static void sync_quarterframe0(jack_nframes_t time) {
+	sync_qf0 = sync_rolling ? (int64_t) sync_frame + time - __atomic_load_n(&sync_latency, __ATOMIC_RELAXED) : -1;
+}
+
+static void sync_window_stats(double *mean, double *stddev, int64_t *min, int64_t *max) {
+	double sum = 0, sum2 = 0;
+	int k;
+	*min = *max = sync_win[0];
+	for (k = 0; k < sync_n; ++k) {
+		const int64_t o = sync_win[k];
+		sum += o;
+		sum2 += (double) o * o;
+		if (o < *min) *min = o;
+		if (o > *max) *max = o;
+	}
+	*mean = sum / sync_n;
+	*stddev = sync_n > 1 ? sqrt(fmax(0, (sum2 - sum * sum / sync_n) / (sync_n - 1))) : 0;
+}
+
+static void sync_report(FILE *f, const char *msg, const timecode *t, int64_t offset, double spf) {
+	double mean, stddev;
+	int64_t min, max;
+	sync_window_stats(&mean, &stddev, &min, &max);
+	fprintf(f, "transport %s at %02i:%02i:%02i.%02i: %+lld samples (%+.2f frames), last %d: mean %+.1f stddev %.1f min %+lld max %+lld\n",
+			msg, t->tc.hour, t->tc.min, t->tc.sec, t->tc.frame,
+			(long long) offset, offset / spf, sync_n, mean, stddev, (long long) min, (long long) max);
+}
+
+/* compare @t with the transport, describe the result in @buf */
+static void sync_check(const timecode *t, char *buf, size_t len) {
+	const double spf = j_samplerate / expected_tme[t->tc.type];
+	const int32_t fn = mtcindex_tc2fn(t->tc.type, t->tc.hour, t->tc.min, t->tc.sec, t->tc.frame);
+	int64_t offset;
+	double dev;
+	int h, m, s, f, k, clear;
+
+	if (t->tp < 0) {
+		snprintf(buf, len, " transport stopped");
+		return;
+	}
+	offset = llrint(t->tp - fn * spf);
+	mtcindex_fn2tc(t->tc.type, (int32_t) floor((t->tp + .5) / spf), &h, &m, &s, &f);
+	snprintf(buf, len, " transport %02i:%02i:%02i.%02i %+lld spl %+.2f fr", h, m, s, f, (long long) offset, offset / spf);
+
+	/* statistics */
+	sync_win[sync_i] = offset;
+	sync_i = (sync_i + 1) % SYNC_WINDOW;
+	if (sync_n < SYNC_WINDOW) ++sync_n;
+
+	if (sync_checked == 0 || offset < sync_min) sync_min = offset;
+	if (sync_checked == 0 || offset > sync_max) sync_max = offset;
+	++sync_checked;
+	dev = offset - sync_mean;
+	sync_mean += dev / sync_checked;
+	sync_m2 += dev * (offset - sync_mean);
+	METRIC_SET(m_sync_offset, (uint64_t) offset);
+
+	/* alert */
+	if (fabs(offset / spf) > sync_alert) {
+		if (!sync_alerted) {
+			sync_alerted = 1;
+			METRIC_INC(m_sync_alerts);
+			METRIC_SET(m_sync_alert, 1);
+			sync_report(stderr, "sync alert", t, offset, spf);
+		}
+		return;
+	}
+	if (!sync_alerted) {
+		return;
+	}
+	for (clear = 1, k = 0; k < sync_n; ++k) {
+		if (fabs(sync_win[k] / spf) > sync_alert) {
+			clear = 0;
+			break;
+		}
+	}
+	if (clear) {
+		sync_alerted = 0;
+		METRIC_SET(m_sync_alert, 0);
+		sync_report(stderr, "back in sync", t, offset, spf);
+	}
+}
+
+static void sync_summary(FILE *f) {
+	if (sync_checked == 0) {
+		return;
+	}
+	fprintf(f, "transport offset [spl]: %llu timecodes, mean %.1f stddev %.1f min %+lld max %+lld, %llu alerts\n",
+			sync_checked, sync_mean, sync_checked > 1 ? sqrt(sync_m2 / (sync_checked - 1)) : 0,
+			(long long) sync_min, (long long) sync_max, (unsigned long long) m_sync_alerts);
+}
+
+static void sync_set_latency(void) {
+	jack_latency_range_t r;
+	jio_port_get_latency_range(mtc_input_port, JackCaptureLatency, &r);
+	__atomic_store_n(&sync_latency, r.max, __ATOMIC_RELAXED);
+}
+
+/************************************************
+ * UDP distribution
+ *
+ * Once a complete timecode was decoded, every following in-sequence
+ * quarter-frame advances the position by 1/4 frame. A packet is sent
+ * for each of them, or only for those that start a frame.
+ */
+
+static int udp_valid = 0;
+static int32_t udp_fn0;      // frame at QF0 of the last complete timecode
+static int udp_q;            // quarter-frames since then
+static int udp_type;
+
+static void udp_send(int32_t fn, int quarter, int flags, jack_nframes_t time, unsigned long long mfcnt) {
+	mtcudp_pkt p;
+	int h, m, s, f;
+	mtcindex_fn2tc(udp_type, fn, &h, &m, &s, &f);
+	p.flags = flags;
+	p.type = udp_type;
+	p.quarter = quarter;
+	p.hour = h;
+	p.minute = m;
+	p.second = s;
+	p.frame = f;
+	p.sample = mfcnt + time;
+	p.usec = jio_sample_to_monotonic(p.sample);
+	mtcudp_post(&p);
+}
+
+static void udp_quarterframe(int piece, int complete, jack_nframes_t time, unsigned long long mfcnt) {
+	if (complete) {
+		udp_type = mtc.tc.type;
+		udp_fn0 = mtcindex_tc2fn(udp_type, mtc.tc.hour, mtc.tc.min, mtc.tc.sec, mtc.tc.frame);
+		udp_q = 7;
+		udp_valid = 1;
+	} else if (udp_valid && piece == ((udp_q + 1) & 7)) {
+		++udp_q;
+	} else {
+		udp_valid = 0;
+		return;
+	}
+	if (udp_quarterframes || (udp_q & 3) == 0) {
+		udp_send(udp_fn0 + udp_q / 4, udp_q & 3, 0, time, mfcnt);
+	}
+}
+
+static void udp_locate(const jack_midi_event_t *ev, unsigned long long mfcnt) {
+	udp_valid = 0;
+	udp_type = (ev->buffer[5] >> 5) & 3;
+	udp_send(mtcindex_tc2fn(udp_type, ev->buffer[5] & 0x1f, ev->buffer[6], ev->buffer[7], ev->buffer[8]),
+			0, MTCUDP_LOCATE, ev->time, mfcnt);
+}
+
+#ifdef HAVE_LTC
+/************************************************
+ * MTC to LTC
+ *
+ * Each complete timecode anchors the frame-number where its QF
+ * sequence started, averaged over all 8 quarter-frames. The anchor and
+ * the frame-duration are tracked by a second order loop, which filters
+ * the timing jitter of the incoming quarter-frames. LTC frames are
+ * rendered back to back, each one stretched so that it ends where the
+ * estimate puts the start of the next frame, bit edges follow the
+ * estimate within a sample.
+ */
+
+#define LTC_MAX_SPEED (1.1) // max. frame stretch, sizes the encoder buffer
+
+jio_port      *ltc_output_port = NULL;
+
+static LTCEncoder *ltc_enc = NULL;
+static float *ltc_frame = NULL;  // one encoded frame, preallocated
+static int ltc_len = 0;
+static int ltc_rd = 0;
+static int ltc_type = -1;        // MTC type the encoder is configured for
+static jack_nframes_t ltc_latency = 0; // mtc_in capture + ltc_out playback, jack_latency_cb()
+
+/* position estimate: frame @ltc_fn0 started at sample @ltc_t0 */
+static int ltc_valid = 0;
+static int32_t ltc_fn0;
+static double ltc_t0;
+static double ltc_spf;
+static double ltc_qsum = 0;      // sum of the quarter-frame times of the sequence
+static int ltc_qn = 0;
+
+/* output */
+static int ltc_running = 0;
+static int32_t ltc_fn;           // next frame to render
+
+static uint64_t m_ltc_frames = 0;
+static uint64_t m_ltc_resync = 0;
+
+static double ltc_nominal_spf(void) {
+	return j_samplerate / expected_tme[ltc_type];
+}
+
+/* sample-position on ltc_out where frame @fn starts */
+static double ltc_frame_start(int32_t fn) {
+	return ltc_t0 + (fn - ltc_fn0) * ltc_spf - __atomic_load_n(&ltc_latency, __ATOMIC_RELAXED);
+}
+
+static void ltc_quarterframe(int piece, unsigned long long t) {
+	if (piece == 0) {
+		ltc_qsum = 0;
+		ltc_qn = 0;
+	} else if (piece != ltc_qn) {
+		ltc_qn = -8; // out of sequence
+	}
+	ltc_qsum += t;
+	++ltc_qn;
+}
+
+static void ltc_anchor(const MTCTime *tc, unsigned long long qf0) {
+	double start = qf0;
+	const int32_t fn = mtcindex_tc2fn(tc->type, tc->hour, tc->min, tc->sec, tc->frame);
+
+	if (tc->type != ltc_type) {
+		static const enum LTC_TV_STANDARD tv[4] = { LTC_TV_FILM_24, LTC_TV_625_50, LTC_TV_525_60, LTC_TV_525_60 };
+		/* no allocation, the buffer was sized for the slowest rate */
+		ltc_encoder_reinit(ltc_enc, j_samplerate, expected_tme[tc->type], tv[tc->type], 0);
+		ltc_type = tc->type;
+		ltc_valid = 0;
+	}
+	if (ltc_qn == 8) {
+		/* mean of QF0..QF7 is 7/8 frame after QF0 */
+		start = ltc_qsum / 8.0 - 7.0 / 8.0 * (ltc_valid ? ltc_spf : ltc_nominal_spf());
+	}
+
+	if (fn > ltc_fn0 && fn - ltc_fn0 <= 8) {
+		const int32_t d = fn - ltc_fn0;
+		if (ltc_valid) {
+			const double predict = ltc_t0 + d * ltc_spf;
+			const double err = start - predict;
+			if (fabs(err) < ltc_nominal_spf() / 4) {
+				ltc_t0 = predict + .125 * err;
+				ltc_fn0 = fn;
+				ltc_spf += .008 * err / d;
+				return;
+			}
+		}
+		/* (re)start with the frame-duration of the last sequence */
+		ltc_spf = (start - ltc_t0) / d;
+		ltc_valid = ltc_spf < ltc_nominal_spf() * LTC_MAX_SPEED && ltc_spf * LTC_MAX_SPEED > ltc_nominal_spf();
+	} else if (!(fn > ltc_fn0 && ltc_valid)) {
+		/* locate: wait for the next sequence, reverse MTC is not converted */
+		ltc_valid = 0;
+	}
+	ltc_fn0 = fn;
+	ltc_t0 = start;
+}
+
+static void ltc_encode(int32_t fn, double speed) {
+	SMPTETimecode st;
+	ltcsnd_sample_t *buf;
+	int h, m, s, f, i, n;
+
+	mtcindex_fn2tc(ltc_type, fn, &h, &m, &s, &f);
+	memset(&st, 0, sizeof(SMPTETimecode));
+	st.hours = h;
+	st.mins  = m;
+	st.secs  = s;
+	st.frame = f;
+	ltc_encoder_set_timecode(ltc_enc, &st);
+
+	if (speed > LTC_MAX_SPEED) speed = LTC_MAX_SPEED;
+	if (speed < 1.0 / LTC_MAX_SPEED) speed = 1.0 / LTC_MAX_SPEED;
+	for (i = 0; i < 10; ++i) {
+		ltc_encoder_encode_byte(ltc_enc, i, speed);
+	}
+	buf = ltc_encoder_get_bufptr(ltc_enc, &n, 1);
+	for (i = 0; i < n; ++i) {
+		ltc_frame[i] = (buf[i] - 128) / 127.f;
+	}
+	ltc_len = n;
+	ltc_rd = 0;
+	METRIC_INC(m_ltc_frames);
+}
+
+static void ltc_render(float *out, jack_nframes_t nframes) {
+	const unsigned long long now = monotonic_cnt;
+	jack_nframes_t i = 0;
+
+	memset(out, 0, nframes * sizeof(float));
+
+	/* no quarter-frames for 1/10 sec: transport stopped */
+	if (ltc_valid && now + nframes - qf_tme > j_samplerate / 10) {
+		ltc_valid = 0;
+	}
+	if (!ltc_valid) {
+		ltc_running = 0;
+	}
+
+	while (i < nframes) {
+		if (ltc_rd < ltc_len) {
+			/* complete the current frame */
+			const int n = ltc_len - ltc_rd < (int)(nframes - i) ? ltc_len - ltc_rd : (int)(nframes - i);
+			memcpy(&out[i], &ltc_frame[ltc_rd], n * sizeof(float));
+			ltc_rd += n;
+			i += n;
+			continue;
+		}
+		if (!ltc_valid) {
+			break;
+		}
+		if (ltc_running && fabs(ltc_frame_start(ltc_fn) - (double)(now + i)) > ltc_spf / 4) {
+			ltc_running = 0;
+			METRIC_INC(m_ltc_resync);
+		}
+		if (!ltc_running) {
+			/* start with the next frame boundary */
+			ltc_fn = ltc_fn0 + (int32_t) ceil(((double)(now + i) - ltc_frame_start(ltc_fn0)) / ltc_spf);
+			const double start = ceil(ltc_frame_start(ltc_fn));
+			if (start >= now + nframes) {
+				break;
+			}
+			i = start - now;
+			ltc_running = 1;
+		}
+		ltc_encode(ltc_fn, (ltc_frame_start(ltc_fn + 1) - (double)(now + i)) / ltc_nominal_spf());
+		++ltc_fn;
+	}
+}
+
+static int ltc_init(void) {
+	ltc_enc = ltc_encoder_create(j_samplerate, 25, LTC_TV_625_50, 0);
+	if (!ltc_enc || ltc_encoder_set_bufsize(ltc_enc, j_samplerate, 24.0 / LTC_MAX_SPEED)) {
+		fprintf(stderr, "cannot create LTC encoder.\n");
+		return -1;
+	}
+	ltc_frame = rtmem_alloc(ltc_encoder_get_buffersize(ltc_enc) * sizeof(float));
+	return ltc_frame ? 0 : -1;
+}
+
+static void ltc_set_latency(void) {
+	jack_latency_range_t r;
+	jack_nframes_t l;
+	jio_port_get_latency_range(mtc_input_port, JackCaptureLatency, &r);
+	l = r.max;
+	jio_port_get_latency_range(ltc_output_port, JackPlaybackLatency, &r);
+	__atomic_store_n(&ltc_latency, l + r.max, __ATOMIC_RELAXED);
+}
+#endif
+
 static void process_jmidi_event(jack_midi_event_t *ev, unsigned long long mfcnt) {
+	if (ev->size == 10 && ev->buffer[0] == 0xf0 && ev->buffer[1] == 0x7f && ev->buffer[3] == 0x01 && ev->buffer[4] == 0x01) {
+		/* full-frame: locate */
+		cue_lock = 0;
+		cue_seq = 0;
+		mtccue_reset(&cues);
+#ifdef HAVE_LTC
+		ltc_valid = 0;
+#endif
+		if (udp_dest) {
+			udp_locate(ev, mfcnt);
+		}
+	}
 	if (ev->size==2 && ev->buffer[0] == 0xf1) {
+		int complete;
+		METRIC_INC(m_qf);
 #if 0 // DEBUG quarter-frames
 		printf("QF: %d [%02x %02x ] @%lld dt:%lld\n",
-				tc.tick, ev->buffer[0], ev->buffer[1],
+				mtc.tc.tick, ev->buffer[0], ev->buffer[1],
 				mfcnt + ev->time, mfcnt + ev->time - qf_tme);
 #endif
-		if (parse_timecode(ev->buffer[1])) {
+		if ((ev->buffer[1] & 0xf0) == 0) {
+			qf0_tme = mfcnt + ev->time;
+			if (sync_monitor) {
+				sync_quarterframe0(ev->time);
+			}
+		}
+		complete = parse_timecode(&mtc, ev->buffer[1]);
+#ifdef HAVE_LTC
+		if (ltc_output_port) {
+			ltc_quarterframe(ev->buffer[1] >> 4, mfcnt + ev->time);
+		}
+#endif
+		if (cue_buf) {
+			cue_quarterframe(ev, mfcnt, complete);
+		}
+		if (udp_dest) {
+			udp_quarterframe(ev->buffer[1] >> 4, complete, ev->time, mfcnt);
+		}
+		if (complete) {
 #if 0 // Warn large delta
 			long ffdiff = mfcnt + ev->time - ff_tme;
-			long expect = (long) rint(j_samplerate * 2.0 / expected_tme[tc.type]);
-			if (have_first_full) {
+			long expect = (long) rint(j_samplerate * 2.0 / expected_tme[mtc.tc.type]);
+			if (mtc.have_first_full) {
 				printf("->- 8qf delta-time: expected %ld - have %ld %s\n",
 						expect, ffdiff,
 						(abs(ffdiff - expect) > 20.0)?"!!!!!!!!!!!!!":""
 				);
 			}
 #endif
+			timecode tc;
 			ff_tme = mfcnt + ev->time;
+			tc.tc = mtc.tc;
 			tc.tme = ff_tme;
-#ifdef DEBUG_JACK_SYNC
-			fprintf(stdout, "->- %02i:%02i:%02i.%02i [%s] %lld\n",tc.hour,tc.min,tc.sec,tc.frame,MTCTYPE[tc.type], tc.tme);
-#else
+			tc.start = qf0_tme;
+			tc.mono = jio_sample_to_monotonic(qf0_tme);
+			tc.real = jio_monotonic_to_realtime(tc.mono);
+			tc.tp = sync_qf0;
+#ifdef HAVE_LTC
+			if (ltc_output_port) {
+				ltc_anchor(&tc.tc, qf0_tme);
+			}
+#endif
+			METRIC_INC(m_frames);
+			METRIC_SET(m_tc, METRIC_TC(tc.tc.hour, tc.tc.min, tc.tc.sec, tc.tc.frame, (int) ceil(expected_tme[tc.tc.type])));
 			if (jack_ringbuffer_write_space(rb) >= sizeof(timecode)) {
 				jack_ringbuffer_write(rb, (void *) &tc, sizeof(timecode));
+			} else {
+				METRIC_INC(m_dropped);
 			}
 
 			if (pthread_mutex_trylock (&msg_thread_lock) == 0) {
 				pthread_cond_signal (&data_ready);
 				pthread_mutex_unlock (&msg_thread_lock);
 			}
-#endif
 		}
 		qf_tme = mfcnt + ev->time;
 	}
 }
 
 static int process(jack_nframes_t nframes, void *arg) {
-	void *jack_buf = jack_port_get_buffer(mtc_input_port, nframes);
-	int nevents = jack_midi_get_event_count(jack_buf);
+	void *jack_buf = jio_port_get_buffer(mtc_input_port, nframes);
+	int nevents = jio_midi_get_event_count(jack_buf);
 	int n;
 
-#ifdef DEBUG_JACK_SYNC
-	jack_position_t pos;
-	jack_transport_query (j_client, &pos);
-	printf( "%u\n",  pos.frame);
-#endif
+	if (cue_output_port) {
+		cue_buf = jio_port_get_buffer(cue_output_port, nframes);
+		jio_midi_clear_buffer(cue_buf);
+	}
+
+	if (sync_monitor) {
+		sync_cycle();
+	}
 
 	for (n=0; n<nevents; n++) {
 		jack_midi_event_t ev;
-		jack_midi_event_get(&ev, jack_buf, n);
-#ifdef DEBUG_JACK_SYNC
-		process_jmidi_event(&ev, pos.frame);
-#else
+		jio_midi_event_get(&ev, jack_buf, n);
 		process_jmidi_event(&ev, monotonic_cnt);
+	}
+#ifdef HAVE_LTC
+	if (ltc_output_port) {
+		ltc_render(jio_port_get_buffer(ltc_output_port, nframes), nframes);
+	}
 #endif
+	if (udp_dest) {
+		mtcudp_flush();
 	}
 	monotonic_cnt += nframes;
 	return 0;
 }
 
+/* port latencies change with every (re)connection,
+ * the process thread picks up the new values */
+void jack_latency_cb(jack_latency_callback_mode_t mode, void *arg) {
+	if (!mtc_input_port) {
+		return;
+	}
+	if (sync_monitor) {
+		sync_set_latency();
+	}
+#ifdef HAVE_LTC
+	if (ltc_output_port) {
+		ltc_set_latency();
+	}
+#endif
+}
+
 void jack_shutdown(void *arg) {
 	j_client=NULL;
 	pthread_cond_signal (&data_ready);
@@ -202,9 +666,19 @@ void cleanup(void) {
 		jack_deactivate (j_client);
 		jack_client_close (j_client);
 	}
-	if (rb) {
-		jack_ringbuffer_free(rb);
+	metrics_stop();
+	mtcudp_close();
+	jio_cleanup();
+	mtccue_free(&cues);
+	mtcindex_close(&mtcindex);
+#ifdef HAVE_LTC
+	if (ltc_enc) {
+		ltc_encoder_free(ltc_enc);
 	}
+	rtmem_free(ltc_frame);
+#endif
+	rtmem_ringbuffer_free(rb);
+	rtmem_release();
 	j_client = NULL;
 }
 
@@ -229,7 +703,8 @@ static int init_jack(const char *client_name) {
 		client_name = jack_get_client_name(j_client);
 		fprintf (stderr, "jack-client name: `%s'\n", client_name);
 	}
-	jack_set_process_callback (j_client, process, 0);
+	jio_set_process_callback (j_client, process, 0);
+	jack_set_latency_callback (j_client, jack_latency_cb, NULL);
 
 #ifndef WIN32
 	jack_on_shutdown (j_client, jack_shutdown, NULL);
@@ -240,16 +715,28 @@ static int init_jack(const char *client_name) {
 }
 
 static int jack_portsetup(void) {
-	if ((mtc_input_port = jack_port_register(j_client, "mtc_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0)) == 0) {
+	if ((mtc_input_port = jio_port_register("mtc_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput)) == 0) {
 		fprintf (stderr, "cannot register mtc input port !\n");
 		return (-1);
 	}
+	if (cue_file
+			&& (cue_output_port = jio_port_register("cue_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput)) == 0) {
+		fprintf (stderr, "cannot register cue output port !\n");
+		return (-1);
+	}
+#ifdef HAVE_LTC
+	if (ltc_output
+			&& (ltc_output_port = jio_port_register("ltc_out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput)) == 0) {
+		fprintf (stderr, "cannot register ltc output port !\n");
+		return (-1);
+	}
+#endif
 	return (0);
 }
 
 static void port_connect(char *mtc_port) {
-	if (mtc_port && jack_connect(j_client, mtc_port, jack_port_name(mtc_input_port))) {
-		fprintf(stderr, "cannot connect port %s to %s\n", mtc_port, jack_port_name(mtc_input_port));
+	if (mtc_port && jack_connect(j_client, mtc_port, jack_port_name(mtc_input_port->jport))) {
+		fprintf(stderr, "cannot connect port %s to %s\n", mtc_port, jack_port_name(mtc_input_port->jport));
 	}
 }
 
@@ -260,8 +747,20 @@ static void port_connect(char *mtc_port) {
 
 static struct option const long_options[] =
 {
+  {"alert", required_argument, 0, 'A'},
+  {"capture", required_argument, 0, 'c'},
   {"help", no_argument, 0, 'h'},
+  {"host-time", no_argument, 0, 'H'},
+  {"index", required_argument, 0, 'I'},
+  {"transport", no_argument, 0, 'J'},
+  {"ltc", no_argument, 0, 'L'},
+  {"metrics", required_argument, 0, 'M'},
   {"newline", no_argument, 0, 'n'},
+  {"quarter-frames", no_argument, 0, 'q'},
+  {"cues", required_argument, 0, 'Q'},
+  {"replay", required_argument, 0, 'r'},
+  {"timing", required_argument, 0, 'T'},
+  {"udp", required_argument, 0, 'U'},
   {"version", no_argument, 0, 'V'},
   {NULL, 0, NULL, 0}
 };
@@ -270,13 +769,68 @@ static void usage (int status) {
   printf ("jmtcdump - JACK MIDI Timecode dump.\n\n");
   printf ("Usage: jmtcdump [ OPTIONS ] [JACK-port]\n\n");
   printf ("Options:\n\
+  -A, --alert <frames>       warn when the transport is more than <frames>\n\
+                             off the timecode (default 1.0), implies -J\n\
+  -c, --capture <file>       record all process-cycle input to <file>\n\
   -h, --help                 display this help and exit\n\
+  -H, --host-time            also print the time at which each frame\n\
+                             started: UTC and CLOCK_MONOTONIC seconds\n\
+  -I, --index <file>         write a timecode to sample-position index\n\
+                             to <file>, see mtcindex(1)\n\
+  -J, --transport            compare each frame with the JACK transport\n\
+                             position and report the offset\n\
+  -L, --ltc                  render the received timecode as LTC on audio\n\
+                             port ltc_out\n\
+  -M, --metrics <path>       serve counters in Prometheus text format on\n\
+                             unix-domain socket <path>\n\
   -n, --newline              print a newline after each Timecode\n\
+  -q, --quarter-frames       send a UDP packet for every quarter-frame,\n\
+                             not only at the start of each frame\n\
+  -Q, --cues <file>          send the MIDI messages of cue list <file> on\n\
+                             port cue_out, following the received timecode\n\
+  -r, --replay <file>        process a capture-file instead of using JACK\n\
+  -T, --timing <sec>         print process() timing statistics every <sec>\n\
+                             seconds (also on SIGUSR1)\n\
+  -U, --udp <host:port>      send the received timecode as binary UDP\n\
+                             packets to <host:port>, unicast or multicast,\n\
+                             append @<interface> to choose the interface\n\
+                             for multicast, e.g. 239.0.0.1:5000@eth1\n\
   -V, --version              print version information and exit\n\
 \n");
   printf ("\n\
 This tool subscribes to a JACK Midi Port and prints received Midi\n\
 time code to stdout.\n\
+\n\
+A cue list has one cue per line: a timecode and the MIDI message to send\n\
+when that frame is reached, as hex bytes, e.g.\n\
+  01:02:03:04  90 3c 7f\n\
+Lines starting with '#' are ignored. Each cue is one complete message\n\
+(status byte and all of its data bytes, no running status). Cues fire at\n\
+the quarter-frame that starts the frame, once the timecode has been\n\
+decoded.\n\
+\n\
+The LTC output follows the MTC at sample accuracy, compensating the\n\
+port latencies. It starts after two consecutive timecodes and stops\n\
+1/10 sec after the last quarter-frame, reverse MTC is not converted.\n\
+\n\
+Host times are derived from the JACK sample clock, filtered against the\n\
+start of each process cycle, and refer to the arrival of the first\n\
+quarter-frame at port mtc_in (without its capture latency).\n\
+\n\
+With -J each line also shows the JACK transport position at the start\n\
+of the frame, as timecode at the MTC frame-rate, and the offset of the\n\
+transport to the received timecode in samples and frames (positive:\n\
+the transport is ahead). The capture latency of mtc_in is compensated.\n\
+Frames received while the transport is stopped are not checked. An\n\
+alert is printed to stderr when the offset exceeds the threshold, and\n\
+once all of the last 64 decoded timecodes are within it again; a\n\
+summary follows at exit.\n\
+\n\
+Each UDP packet is 40 bytes in network byte-order: magic \"MTCU\",\n\
+version, flags (1: locate), MTC type, quarter-frame, sequence number,\n\
+hour, minute, second, frame, the sample-time and host CLOCK_MONOTONIC\n\
+[usec] of that position, and the sample-rate. See mtcudp.h for the\n\
+layout. Multicast is sent with a TTL of 1.\n\
 \n");
   printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
           "Website and manual: <https://github.com/x42/mtc-tools>\n"
@@ -288,14 +842,68 @@ static int decode_switches (int argc, char **argv) {
 	int c;
 
 	while ((c = getopt_long (argc, argv,
+			   "A:"	/* alert */
+			   "c:"	/* capture */
 			   "h"	/* help */
+			   "H"	/* host-time */
+			   "I:"	/* index */
+			   "J"	/* transport */
+			   "L"	/* ltc */
+			   "M:"	/* metrics */
 			   "n"	/* newline */
+			   "q"	/* quarter-frames */
+			   "Q:"	/* cues */
+			   "r:"	/* replay */
+			   "T:"	/* timing */
+			   "U:"	/* udp */
 			   "V",	/* version */
 			   long_options, (int *) 0)) != EOF) {
 		switch (c) {
+			case 'A':
+				sync_alert = atof(optarg);
+				sync_monitor = 1;
+				break;
+			case 'c':
+				capture_file = optarg;
+				break;
+			case 'H':
+				print_hosttime = 1;
+				break;
+			case 'I':
+				index_file = optarg;
+				break;
+			case 'J':
+				sync_monitor = 1;
+				break;
+			case 'L':
+#ifdef HAVE_LTC
+				ltc_output = 1;
+#else
+				fprintf(stderr, "jmtcdump was compiled without LTC support.\n");
+				exit (EXIT_FAILURE);
+#endif
+				break;
+			case 'M':
+				metrics_path = optarg;
+				break;
 			case 'n':
 				newline = '\n';
 				break;
+			case 'q':
+				udp_quarterframes = 1;
+				break;
+			case 'Q':
+				cue_file = optarg;
+				break;
+			case 'r':
+				replay_file = optarg;
+				break;
+			case 'T':
+				timing_interval = atof(optarg);
+				break;
+			case 'U':
+				udp_dest = optarg;
+				break;
 			case 'V':
 				printf ("jmtcdump version %s\n\n", VERSION);
 				printf ("Copyright (C) GPL 2012 Robin Gareus <robin@gareus.org>\n");
@@ -319,21 +927,108 @@ void wearedone(int sig) {
 	pthread_cond_signal (&data_ready);
 }
 
+void dumptiming(int sig) {
+	jio_timing_request();
+	pthread_cond_signal (&data_ready);
+}
+
+static void print_timecode(void) {
+	while (jack_ringbuffer_read_space (rb) >= sizeof(timecode)) {
+		timecode t;
+		char ht[96] = "";
+		char tp[96] = "";
+		jack_ringbuffer_read(rb, (char*) &t, sizeof(timecode));
+		if (print_hosttime) {
+			char rt[40];
+			jio_format_realtime(rt, sizeof(rt), t.real);
+			snprintf(ht, sizeof(ht), " %s %lld.%06lld", rt, (long long) t.mono / 1000000, (long long) t.mono % 1000000);
+		}
+		if (sync_monitor) {
+			sync_check(&t, tp, sizeof(tp));
+		}
+		fprintf(stdout, "->- %02i:%02i:%02i.%02i [%s] %lld%s%s%c",t.tc.hour,t.tc.min,t.tc.sec,t.tc.frame,MTCTYPE[t.tc.type], t.tme, ht, tp, newline);
+		fflush(stdout);
+		if (index_file) {
+			mtcindex_add(&mtcindex, t.tc.type,
+					mtcindex_tc2fn(t.tc.type, t.tc.hour, t.tc.min, t.tc.sec, t.tc.frame), t.start);
+		}
+	}
+}
+
 int main (int argc, char ** argv) {
 	decode_switches (argc, argv);
 
-	if (init_jack("jmtcdump"))
+	/* keys are framerate independent, accept any MTC rate */
+	if (cue_file && mtccue_load(&cues, cue_file, 30))
 		goto out;
+
+	if (replay_file) {
+		if (jio_replay_open(replay_file))
+			goto out;
+		jio_set_process_callback (NULL, process, 0);
+		j_samplerate = jio_samplerate();
+	} else if (init_jack("jmtcdump")) {
+		goto out;
+	}
 	if (jack_portsetup())
 		goto out;
+#ifdef HAVE_LTC
+	if (ltc_output && ltc_init())
+		goto out;
+#endif
+	if (replay_file)
+		jack_latency_cb(JackCaptureLatency, NULL); // captured port latencies
+
+	memset(&mtc, 0, sizeof(MTCParser));
+	rb = rtmem_ringbuffer(RBSIZE * sizeof(timecode));
 
-	memset(&tc, 0, sizeof(timecode));
-	rb = jack_ringbuffer_create(RBSIZE * sizeof(timecode));
+	if (index_file && mtcindex_create(&mtcindex, index_file, j_samplerate))
+		goto out;
+
+	if (udp_dest && mtcudp_open(udp_dest, j_samplerate))
+		goto out;
 
-	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
-		fprintf(stderr, "Warning: Can not lock memory.\n");
+	if (replay_file) {
+		jio_replay_run(print_timecode);
+		if (timing_interval > 0)
+			jio_timing_print(stderr);
+		goto out;
+	}
+	if (capture_file && jio_capture_start(capture_file))
+		goto out;
+
+	if (metrics_path) {
+		metrics_add("quarter_frames_total", "MTC quarter-frame messages received", METRIC_COUNTER, &m_qf);
+		metrics_add("frames_decoded_total", "Complete MTC timecodes decoded", METRIC_COUNTER, &m_frames);
+		metrics_add("ringbuffer_dropped_total", "Decoded timecodes dropped, message ringbuffer full", METRIC_COUNTER, &m_dropped);
+		metrics_add("timecode", "Last decoded MTC timecode", METRIC_TIMECODE, &m_tc);
+		if (sync_monitor) {
+			metrics_add("transport_offset_samples", "Offset of the JACK transport to the last decoded timecode", METRIC_SIGNED, &m_sync_offset);
+			metrics_add("transport_sync_alert", "1 while the transport offset exceeds the alert threshold", METRIC_GAUGE, &m_sync_alert);
+			metrics_add("transport_sync_alerts_total", "Transport offset alerts raised", METRIC_COUNTER, &m_sync_alerts);
+		}
+		if (cue_output_port) {
+			metrics_add("cues_fired_total", "Cue MIDI messages sent", METRIC_COUNTER, &cues.n_fired);
+			metrics_add("cue_seeks_total", "Cue list lookups after a locate", METRIC_COUNTER, &cues.n_seek);
+			metrics_add("cues_dropped_total", "Cue MIDI messages dropped, port-buffer full", METRIC_COUNTER, &cues.n_dropped);
+		}
+		if (udp_dest) {
+			metrics_add("udp_packets_sent_total", "UDP timecode packets sent", METRIC_COUNTER, &mtcudp.n_sent);
+			metrics_add("udp_packets_dropped_total", "UDP timecode packets dropped, sender too slow", METRIC_COUNTER, &mtcudp.n_dropped);
+			metrics_add("udp_send_errors_total", "UDP timecode packets rejected by the network stack", METRIC_COUNTER, &mtcudp.n_errors);
+		}
+#ifdef HAVE_LTC
+		if (ltc_output_port) {
+			metrics_add("ltc_frames_total", "LTC frames rendered", METRIC_COUNTER, &m_ltc_frames);
+			metrics_add("ltc_resyncs_total", "LTC output restarted, MTC jumped", METRIC_COUNTER, &m_ltc_resync);
+		}
+#endif
+		if (metrics_start(metrics_path, "jmtcdump"))
+			goto out;
 	}
 
+	rtmem_lock(stderr);
+
 	// -=-=-= RUN =-=-=-
 
 	if (jack_activate (j_client)) {
@@ -343,25 +1038,31 @@ int main (int argc, char ** argv) {
 
 	while (optind < argc)
 		port_connect(argv[optind++]);
+#ifdef HAVE_LTC
+	if (ltc_output_port)
+		ltc_set_latency();
+#endif
+	if (sync_monitor)
+		sync_set_latency();
 
 #ifndef _WIN32
 	signal(SIGINT, wearedone);
+	signal(SIGUSR1, dumptiming);
 #endif
+	if (timing_interval > 0)
+		jio_timing_interval(timing_interval);
 
 	pthread_mutex_lock (&msg_thread_lock);
 	while (run && j_client) {
-		int avail_tc = jack_ringbuffer_read_space (rb) / sizeof(timecode);
-		if (avail_tc > 0) {
-			timecode t;
-			jack_ringbuffer_read(rb, (char*) &t, sizeof(timecode));
-			fprintf(stdout, "->- %02i:%02i:%02i.%02i [%s] %lld%c",t.hour,t.min,t.sec,t.frame,MTCTYPE[t.type], t.tme, newline);
-			fflush(stdout);
-		}
-		pthread_cond_wait (&data_ready, &msg_thread_lock);
+		print_timecode();
+		jio_timing_poll(stderr);
+		jio_cond_wait (&data_ready, &msg_thread_lock);
 	}
 	pthread_mutex_unlock (&msg_thread_lock);
 
 out:
+	if (sync_monitor)
+		sync_summary(stderr);
 	cleanup();
 	return 0;
 }
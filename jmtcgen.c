@@ -16,8 +16,6 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define JACK_MIDI_QUEUE_SIZE (256)
-
 #ifdef WIN32
 #include <windows.h>
 #include <pthread.h>
@@ -36,29 +34,79 @@
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 #include <jack/midiport.h>
-#include <sys/mman.h>
 #include <timecode/timecode.h>
 
+#include "jackio.h"
+#include "mtcgen.h"
+#include "metrics.h"
+#include "mtcloop.h"
+#include "mtcpipe.h"
+#include "mtccue.h"
+
 #ifndef WIN32
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 #endif
 
-static jack_port_t *mtc_output_port = NULL;
+static jio_port *mtc_output_port = NULL;
+static jio_port *mtc_input_port = NULL; // loopback
+static jio_port *cue_output_port = NULL;
 static jack_client_t *j_client = NULL;
-static jack_nframes_t jmtc_latency = 0;
 static uint32_t j_samplerate = 48000;
-static volatile long long int monotonic_fcnt = 0;
-static int writeahead = 1;
+static MTCGen mtcgen;
+static MTCLoop mtcloop;
+static MTCPipe mtcpipe;
+static MTCCue cues;
+static MTCWire wire;
 
 static jack_ringbuffer_t *rb = NULL;
 static pthread_mutex_t msg_thread_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  data_ready = PTHREAD_COND_INITIALIZER;
+static uint64_t msg_dropped = 0;
+
+/* internal clock */
+enum {
+  CLK_START = 1,
+  CLK_STOP,
+  CLK_LOCATE,
+  CLK_SPEED
+};
+
+typedef struct {
+  int cmd;
+  int64_t fn;    // CLK_LOCATE: timecode frame-number
+  double speed;  // CLK_SPEED
+} clock_cmd;
+
+static struct {
+  jack_transport_state_t state;
+  int64_t frame;        // position in clock samples, 64bit: > 2^32 within 24h
+  uint32_t rate;        // clock sample-rate: samplerate / speed
+} iclock;
+
+static jack_ringbuffer_t *clock_rb = NULL;
+static pthread_t control_thread_id;
+static int control_thread_running = 0;
 
 /* options */
 static int debug = 0;
 static TimecodeRate framerate = { 25, 1, 0, 80 };
 static int use_jack_fps = 0;
+static char *capture_file = NULL;
+static char *replay_file = NULL;
+static char *metrics_path = NULL;
+static double timing_interval = 0;
+static double loopback_interval = -1; // < 0: off
+static int pipeline = 0;
+static char *clock_start = NULL; // internal clock
+static double clock_speed = 1.0;
+static int clock_roll = 0;
+static char *control_path = NULL;
+static char *cue_file = NULL;
+static double wire_baud = 0; // 0: off
 
 /* a simple state machine for this client */
 static volatile enum {
@@ -67,16 +115,6 @@ static volatile enum {
   Exit
 } client_state = Init;
 
-typedef struct my_midi_event {
-  long long int monotonic_align;
-  jack_nframes_t time;
-  size_t size;
-  jack_midi_data_t buffer[16];
-} my_midi_event_t;
-
-static my_midi_event_t event_queue[JACK_MIDI_QUEUE_SIZE];
-static int queued_events_start = 0;
-static int queued_events_end = 0;
 int jack_graph_cb(void *arg);
 
 
@@ -89,6 +127,8 @@ static void rbprintf(const char *fmt, ...) {
   va_end(ap);
   if (jack_ringbuffer_write_space(rb) >=n){
     jack_ringbuffer_write(rb, buf, n);
+  } else {
+    METRIC_INC(msg_dropped);
   }
   pthread_cond_signal (&data_ready);
 }
@@ -102,352 +142,171 @@ static void cleanup(int sig) {
     jack_client_close (j_client);
     j_client=NULL;
   }
-  if (rb) {
-    jack_ringbuffer_free(rb);
+  if (control_thread_running) {
+    pthread_join(control_thread_id, NULL);
   }
+  metrics_stop();
+  mtcpipe_free(&mtcpipe);
+  jio_cleanup();
+  mtcloop_free(&mtcloop);
+  mtccue_free(&cues);
+  rtmem_ringbuffer_free(rb);
+  rtmem_ringbuffer_free(clock_rb);
+  rtmem_release();
   fprintf(stderr, "bye.\n");
 }
 
-static int queue_mtc_quarterframe(const TimecodeTime * const t, const int mtc_tc, const long long int posinfo, const int qf) {
-  unsigned char mtc_msg=0;
-  switch(qf) {
-    case 0: mtc_msg =  0x00 |  (t->frame&0xf); break;
-    case 1: mtc_msg =  0x10 | ((t->frame&0xf0)>>4); break;
-    case 2: mtc_msg =  0x20 |  (t->second&0xf); break;
-    case 3: mtc_msg =  0x30 | ((t->second&0xf0)>>4); break;
-    case 4: mtc_msg =  0x40 |  (t->minute&0xf); break;
-    case 5: mtc_msg =  0x50 | ((t->minute&0xf0)>>4); break;
-    case 6: mtc_msg =  0x60 |  ((mtc_tc|t->hour)&0xf); break;
-    case 7: mtc_msg =  0x70 | (((mtc_tc|t->hour)&0xf0)>>4); break;
-  }
-
-  jack_midi_data_t *mmsg = event_queue[queued_events_start].buffer;
-  mmsg[0] = (char) 0xf1;
-  mmsg[1] = (char) mtc_msg;
-
-  event_queue[queued_events_start].monotonic_align = posinfo;
-  event_queue[queued_events_start].time = 0;
-  event_queue[queued_events_start].size = 2;
-  queued_events_start = (queued_events_start + 1)%JACK_MIDI_QUEUE_SIZE;
-
-  return 0;
+/**
+ * internal clock, advanced by the process callback.
+ * A speed other than 1.0 is applied by running the clock and the MTC
+ * generator at a scaled sample-rate, QF timing stays sample-accurate.
+ */
+static int64_t clock_frame(int64_t fn) {
+  const int64_t num = mtcgen.framerate.num;
+  return (fn * iclock.rate * mtcgen.framerate.den + num - 1) / num;
 }
 
-static void queue_mtc_quarterframes(const TimecodeTime * const t, const int mtc_tc, const int reverse, const int speed, const long long int posinfo) {
-  int i;
-  const float qfl = speed / 4.0;
-  static TimecodeTime stime;
-  static int next_quarter_frame_to_send = 0;
-
-  if (next_quarter_frame_to_send != 0 && next_quarter_frame_to_send != 4) {
-    /* this can actually never happen */
-    rbprintf("quarter-frame mis-aligment: %d (should be 0 or 4)\n", next_quarter_frame_to_send);
-    next_quarter_frame_to_send = 0;
-  }
-  if (mtc_tc != 0x20 && (t->frame%2) == 1 && next_quarter_frame_to_send == 0) {
-    /* the MTC spec does note that for 24, 30 drop and 30 non-drop, the frame number computed from quarter frames is always even
-     * but for 25 it might be odd or even "depending on whiuch frame number the 8 message sequence started"
-     */
-    rbprintf("re-align quarter-frame to even frame-number\n");
-    return;
+static void clock_set_speed(double speed) {
+  const uint32_t rate = rint(j_samplerate / speed);
+  if (iclock.rate > 0) {
+    iclock.frame = llrint((double) iclock.frame * rate / iclock.rate);
   }
+  iclock.rate = rate;
+  mtcgen.samplerate = rate;
+  mtcgen_set_rate(&mtcgen);
+}
 
-  if (next_quarter_frame_to_send == 0) {
-    /* MTC spans timecode over two frames.
-     * remember the current timecode since the min/hour (2nd part)
-     * may change.
-     */
-    memcpy(&stime, t, sizeof(TimecodeTime));
-  }
-
-  for (i=0;i<4;++i) {
-    if (reverse)
-      next_quarter_frame_to_send--;
-    if (next_quarter_frame_to_send < 0)
-      next_quarter_frame_to_send = 7;
-
-    queue_mtc_quarterframe(&stime, mtc_tc, posinfo + i*qfl, next_quarter_frame_to_send);
-
-    if (!reverse)
-      next_quarter_frame_to_send++;
-    if (next_quarter_frame_to_send > 7)
-      next_quarter_frame_to_send = 0;
+/* @pos only carries the rate, the position is iclock.frame */
+static jack_transport_state_t clock_query(jack_position_t *pos) {
+  clock_cmd c;
+  while (jack_ringbuffer_read_space(clock_rb) >= sizeof(clock_cmd)) {
+    jack_ringbuffer_read(clock_rb, (char*) &c, sizeof(clock_cmd));
+    switch (c.cmd) {
+      case CLK_START:
+	if (iclock.state == JackTransportStopped) {
+	  iclock.state = JackTransportStarting;
+	}
+	break;
+      case CLK_STOP:
+	iclock.state = JackTransportStopped;
+	break;
+      case CLK_LOCATE:
+	iclock.frame = clock_frame(c.fn);
+	if (iclock.state == JackTransportRolling) {
+	  iclock.state = JackTransportStarting;
+	}
+	break;
+      case CLK_SPEED:
+	clock_set_speed(c.speed);
+	if (iclock.state == JackTransportRolling) {
+	  iclock.state = JackTransportStarting;
+	}
+	break;
+    }
   }
+  memset(pos, 0, sizeof(jack_position_t));
+  pos->frame_rate = iclock.rate;
+  return iclock.state;
 }
 
-static void queue_mtc_sysex(const TimecodeTime * const t, const int mtc_tc, const long long int posinfo) {
-  jack_midi_data_t *sysex = event_queue[queued_events_start].buffer;
-#if 1
-  sysex[0]  = (unsigned char) 0xf0; // fixed
-  sysex[1]  = (unsigned char) 0x7f; // fixed
-  sysex[2]  = (unsigned char) 0x7f; // sysex channel
-  sysex[3]  = (unsigned char) 0x01; // fixed
-  sysex[4]  = (unsigned char) 0x01; // fixed
-  sysex[5]  = (unsigned char) 0x00; // hour
-  sysex[6]  = (unsigned char) 0x00; // minute
-  sysex[7]  = (unsigned char) 0x00; // seconds
-  sysex[8]  = (unsigned char) 0x00; // frame
-  sysex[9]  = (unsigned char) 0xf7; // fixed
-
-  sysex[5] |= (unsigned char) (mtc_tc&0x60);
-  sysex[5] |= (unsigned char) (t->hour&0x1f);
-  sysex[6] |= (unsigned char) (t->minute&0x7f);
-  sysex[7] |= (unsigned char) (t->second&0x7f);
-  sysex[8] |= (unsigned char) (t->frame&0x7f);
-
-  event_queue[queued_events_start].size = 10;
-
-#else
-
-  sysex[0]   = (char) 0xf0;
-  sysex[1]   = (char) 0x7f;
-  sysex[2]   = (char) 0x7f;
-  sysex[3]   = (char) 0x06;
-  sysex[4]   = (char) 0x44;
-  sysex[5]   = (char) 0x06;
-  sysex[6]   = (char) 0x01;
-  sysex[7]   = (char) 0x00;
-  sysex[8]   = (char) 0x00;
-  sysex[9]   = (char) 0x00;
-  sysex[10]  = (char) 0x00;
-  sysex[11]  = (char) 0x00;
-  sysex[12]  = (char) 0xf7;
-
-  sysex[7]  |= (char) 0x20; // 25fps
-  sysex[7]  |= (char) (stime->hours&0x1f);
-  sysex[8]  |= (char) (stime->mins&0x7f);
-  sysex[9]  |= (char) (stime->secs&0x7f);
-  sysex[10] |= (char) (stime->frame&0x7f);
-
-  int checksum = (sysex[7] + sysex[8] + sysex[9] + sysex[10] + 0x3f)&0x7f ;
-  sysex[11]  = (char) (127-checksum); //checksum
-  event_queue[queued_events_start].size = 13;
-#endif
-
-  event_queue[queued_events_start].monotonic_align = posinfo;
-  event_queue[queued_events_start].time = 0;
-  queued_events_start = (queued_events_start + 1)%JACK_MIDI_QUEUE_SIZE;
+static void clock_advance(jack_nframes_t nframes) {
+  if (iclock.state == JackTransportRolling) {
+    iclock.frame += nframes;
+  } else if (iclock.state == JackTransportStarting) {
+    iclock.state = JackTransportRolling;
+  }
 }
 
 /**
- *
+ * cues for the frames that start in this cycle
  */
-static void generate_mtc(TimecodeTime *t, unsigned long long int mfcnt, int mode, int num) {
-
-  static TimecodeTime stime;
-  static unsigned long long int pfcnt;
-  static int pmode = -1;
-
-  unsigned long long int cfcnt = mfcnt - t->subframe;
-  t->subframe = 0;
-  const double fptcf = timecode_frames_per_timecode_frame(&framerate, j_samplerate);
-  const int64_t nfn =  timecode_to_framenumber(t, &framerate);
-  int64_t ofn =  timecode_to_framenumber(&stime, &framerate);
-
-  if (pmode == mode && mode == 0 && ofn == nfn) {
-    /* we already sent this frame */
+static struct {
+  int valid;
+  int64_t fn;     // next frame
+  TimecodeTime t; // timecode of fn
+} cue_pos;
+
+static void cue_process(jack_transport_state_t state, int64_t sp, jack_nframes_t nframes) {
+  void *out = jio_port_get_buffer(cue_output_port, nframes);
+  jio_midi_clear_buffer(out);
+
+  if (state != JackTransportRolling) {
+    mtccue_reset(&cues);
+    cue_pos.valid = 0;
     return;
   }
 
-  if (   nfn - ofn > 3
-      || mfcnt - pfcnt > 3 * fptcf
-      || (nfn - ofn < 1 && mode != 2)
-      ) {
-#if 0 // DEBUG
-    char tcs[12];
-    timecode_time_to_string(tcs, t);
-    printf(" !! RESET %s | pf: %lld nf: %lld\n", tcs, ofn, nfn);
-#endif
-    mode = 0;
-    memcpy(&stime, t, sizeof(TimecodeTime));
-  }
-
-  pfcnt = mfcnt;
-  pmode = mode;
-
-  if (mode == 2 && nfn + num <= ofn) {
-    return;
-  }
-
-  if (mode == 2) {
-    cfcnt += fptcf * (ofn - nfn);
+  const int64_t num = mtcgen.framerate.num;
+  const int64_t fn = (sp * num + mtcgen.srden - 1) / mtcgen.srden;
+  if (!cue_pos.valid || cue_pos.fn != fn) {
+    timecode_framenumber_to_time(&cue_pos.t, &mtcgen.framerate, fn);
+    cue_pos.fn = fn;
+    cue_pos.valid = 1;
   }
 
-#if 0 // DEBUG
-  printf("DOIT %lld -> %lld  @ %lld\n", ofn, nfn, mfcnt);
-#endif
-
-  do {
-    /*set MTC fps */
-    static int fps_warn = 0;
-    int mtc_tc = 0x20;
-    switch ((int)floor(timecode_rate_to_double(&framerate))) {
-      case 24:
-	mtc_tc = 0x00;
-	fps_warn = 0;
-	break;
-      case 25:
-	mtc_tc = 0x20;
-	fps_warn = 0;
-	break;
-      case 29:
-	mtc_tc = 0x40;
-	fps_warn = 0;
-	break;
-      case 30:
-	mtc_tc = 0x60;
-	fps_warn = 0;
-	break;
-      default:
-	if (!fps_warn) {
-	  fps_warn = 1;
-	  rbprintf("WARNING: invalid framerate %.2f (using 25fps instead) - expect sync problems\n",
-	      timecode_rate_to_double(&framerate));
-	}
-	break;
-    }
-
-#if 0 // DEBUG
-  char tcs[12];
-  timecode_time_to_string(tcs, t);
-  printf("%d -> %s.%d %f %lld\n", mode, tcs, t->subframe, fptcf, cfcnt);
-#endif
-
-    if (mode != 2) {
-      if (debug) rbprintf("sending sysex locate.\n");
-      queued_events_end = queued_events_start; // flush queue
-      queue_mtc_sysex(&stime, mtc_tc, mfcnt);
-      memcpy(&stime, t, sizeof(TimecodeTime));
-    } else {
-      queue_mtc_quarterframes(&stime, mtc_tc, 0,
-	  rint(fptcf),
-	  cfcnt);
-
-      timecode_time_increment(&stime, &framerate);
-      cfcnt += fptcf;
-      ofn = timecode_to_framenumber(&stime, &framerate);
+  for (;;) {
+    const int64_t start = (cue_pos.fn * mtcgen.srden + num - 1) / num;
+    if (start >= sp + nframes) {
+      break;
     }
-  } while (mode == 2 && ofn < nfn + num);
+    mtccue_frame(&cues,
+	MTCCUE_KEY(cue_pos.t.hour, cue_pos.t.minute, cue_pos.t.second, cue_pos.t.frame),
+	mtcgen.fps, mtcgen.framerate.drop, start - sp, out);
+    mtcgen_time_increment(&mtcgen, &cue_pos.t);
+    ++cue_pos.fn;
+  }
 }
 
 /**
  * jack audio process callback
  */
 int process (jack_nframes_t nframes, void *arg) {
-  void *out;
   jack_transport_state_t state;
   jack_position_t pos;
-  TimecodeTime t;
-  jack_nframes_t sample_pos;
-
-  state = jack_transport_query (j_client, &pos);
-  sample_pos = pos.frame;
-
-  if (use_jack_fps && pos.valid & JackAudioVideoRatio) {
-    static float audio_frames_per_video_frame = 0;
-    if (pos.audio_frames_per_video_frame != audio_frames_per_video_frame) {
-      audio_frames_per_video_frame = pos.audio_frames_per_video_frame;
-      rbprintf("new APV: %.2f\n", pos.audio_frames_per_video_frame);
-      switch ((int)floor(j_samplerate/audio_frames_per_video_frame)) {
-	case 24:
-	  framerate.num=24; framerate.den=1; framerate.drop=0;
-	  break;
-	case 25:
-	  framerate.num=25; framerate.den=1; framerate.drop=0;
-	  break;
-	case 29:
-	  framerate.num=30000; framerate.den=1001; framerate.drop=1;
-	  break;
-	case 30:
-	  framerate.num=30; framerate.den=1; framerate.drop=0;
-	  break;
-	default:
-	  rbprintf("invalid framerate.\n");
-	  break;
-      }
-      // TODO use timecode_strftimecode()
-      rbprintf("FPS changed to %.2f%s\n", timecode_rate_to_double(&framerate), framerate.drop?"df":"");
-      framerate.subframes = timecode_frames_per_timecode_frame(&framerate, j_samplerate);
-      writeahead = 1 + ceil((double)jmtc_latency / timecode_frames_per_timecode_frame(&framerate, j_samplerate));
-    }
-  }
-
-  if (pos.valid & JackVideoFrameOffset) {
-    if (pos.video_offset >= sample_pos) {
-      sample_pos -= pos.video_offset;
-    } else {
-      sample_pos = 0;
+  int64_t sample_pos;
+  void *out;
+  const long long int mfcnt = mtcgen.monotonic_fcnt;
+
+  if (mtc_input_port) {
+    void *in = jio_port_get_buffer(mtc_input_port, nframes);
+    if (mtcloop_scan(&mtcloop, in, mfcnt, 0)
+	&& pthread_mutex_trylock (&msg_thread_lock) == 0) {
+      pthread_cond_signal (&data_ready);
+      pthread_mutex_unlock (&msg_thread_lock);
     }
   }
 
-  timecode_sample_to_time(&t, &framerate, pos.frame_rate, sample_pos);
-
-  const int ea = ceil(nframes / timecode_frames_per_timecode_frame(&framerate, j_samplerate));
-
-  switch (state) {
-    case JackTransportStopped:
-      //send sysex-MTC message - if changed
-      generate_mtc(&t, monotonic_fcnt, 0, writeahead + ea);
-      break;
-    case JackTransportStarting:
-#if 0 // jack2 only
-    case JackTransportNetStarting:
-#endif
-      //send sysex-MTC message
-      generate_mtc(&t, monotonic_fcnt, 1, writeahead + ea);
-      break;
-    case JackTransportRolling:
-      // enqueue quarter-frame MTC messages
-      generate_mtc(&t, monotonic_fcnt, 2, writeahead + ea);
-      break;
-    default: /* old JackTransportLooping */
-      break;
+  if (clock_rb) {
+    state = clock_query (&pos);
+    sample_pos = iclock.frame;
+  } else {
+    state = jio_transport_query (&pos);
+    sample_pos = mtcgen_sample_pos(&pos);
   }
-
-  out = jack_port_get_buffer(mtc_output_port, nframes);
+  out = jio_port_get_buffer(mtc_output_port, nframes);
 
 #if 0 // workaround jack2 latency cb order - fixed in jack2 e577581de (2012-10-30)
   jack_graph_cb(out);
 #endif
 
-  jack_midi_clear_buffer(out);
-  while (queued_events_end != queued_events_start) {
-    const long long int mt = event_queue[queued_events_end].monotonic_align - jmtc_latency;
-    if (mt >= monotonic_fcnt + nframes) {
-      // fprintf(stderr, "DEBUG: MTC timestamp is for next jack cycle.\n"); // XXX
-      break;
+  if (pipeline > 0 && !jio_freewheeling()) {
+    mtcpipe_process_at(&mtcpipe, state, &pos, sample_pos, nframes, out);
+  } else {
+    if (pipeline > 0) {
+      mtcpipe_stop(&mtcpipe);
     }
-    if (mt < monotonic_fcnt) {
-      if (debug) rbprintf("WARNING: MTC was for previous jack cycle (port latency too large?) %lld\n", mt - monotonic_fcnt);
-      //fprintf(stderr, "TME: %lld < %lld)\n", mt, monotonic_fcnt); // XXX
-    } else {
-
-#if 0 // DEBUG quarter frame timing
-      static long long int prev = 0;
-      if (mt-prev != rint((double)j_samplerate / timecode_rate_to_double(&framerate) / 4)) {
-	fprintf(stderr, " QT time %lld != %u\n", mt-prev, (int) rint((double)j_samplerate / timecode_rate_to_double(&framerate) / 4));
-      }
-      prev = mt;
-#endif
-
-      event_queue[queued_events_end].time = mt - monotonic_fcnt;
-#if 0 // DEBUG dump Events & Timing
-      printf("QF:%02x abs: %"PRId64" rel:%4u @%"PRId64" jt:%"PRId64"\n",
-	  event_queue[queued_events_end].buffer[1], mt,
-	  event_queue[queued_events_end].time, monotonic_fcnt,
-	  (int64_t) (sample_pos + event_queue[queued_events_end].time));
-#endif
-      jack_midi_event_write(out,
-	  event_queue[queued_events_end].time,
-	  event_queue[queued_events_end].buffer,
-	  event_queue[queued_events_end].size
-	  );
-    }
-    queued_events_end = (queued_events_end + 1)%JACK_MIDI_QUEUE_SIZE;
+    mtcgen_process_at(&mtcgen, state, &pos, sample_pos, nframes, out);
   }
 
-  monotonic_fcnt += nframes;
-
+  if (mtc_input_port) {
+    mtcloop_scan(&mtcloop, out, mfcnt, 1);
+  }
+  if (cue_output_port) {
+    cue_process(state, sample_pos, nframes);
+  }
+  if (clock_rb) {
+    clock_advance(nframes);
+  }
   return 0;
 }
 
@@ -475,24 +334,31 @@ static int max_latency(jack_port_t *port, jack_latency_callback_mode_t mode) {
 void jack_latency_cb(jack_latency_callback_mode_t mode, void *arg) {
   jack_latency_range_t range;
   if (mtc_output_port && mode == JackPlaybackLatency) {
-    jmtc_latency = max_latency(mtc_output_port, JackCaptureLatency);
+    mtcgen.latency = max_latency(mtc_output_port->jport, JackCaptureLatency);
     if (debug && !arg)
-      rbprintf("MTC port set latency: %d\n", jmtc_latency);
-    range.min = range.max = jmtc_latency;
-    jack_port_set_latency_range(mtc_output_port, JackPlaybackLatency, &range);
+      rbprintf("MTC port set latency: %d\n", mtcgen.latency);
+    range.min = range.max = mtcgen.latency;
+    jack_port_set_latency_range(mtc_output_port->jport, JackPlaybackLatency, &range);
   }
-  writeahead = 1 + ceil((double)jmtc_latency / timecode_frames_per_timecode_frame(&framerate, j_samplerate));
+  mtcgen_update_writeahead(&mtcgen);
 }
 #endif
 
 int jack_graph_cb(void *arg) {
   jack_latency_range_t jlty;
   if (mtc_output_port) {
-    jack_port_get_latency_range(mtc_output_port, JackPlaybackLatency, &jlty);
+    jio_port_get_latency_range(mtc_output_port, JackPlaybackLatency, &jlty);
     if (debug && !arg)
-      rbprintf("MTC port latency: %d\n", jmtc_latency);
+      rbprintf("MTC port latency: %d\n", mtcgen.latency);
+  }
+  mtcgen_update_writeahead(&mtcgen);
+  return 0;
+}
+
+int jack_bufsize_cb(jack_nframes_t nframes, void *arg) {
+  if (mtcgen_queue_need(&mtcgen, nframes) > JACK_MIDI_QUEUE_SIZE) {
+    fprintf(stderr, "Warning: MTC queue too small for %u frames/period - expect dropped frames.\n", nframes);
   }
-  writeahead = 1 + ceil((double)jmtc_latency / timecode_frames_per_timecode_frame(&framerate, j_samplerate));
   return 0;
 }
 
@@ -522,7 +388,7 @@ static int init_jack(const char *client_name) {
     client_name = jack_get_client_name(j_client);
     fprintf (stderr, "jack-client name: `%s'\n", client_name);
   }
-  jack_set_process_callback (j_client, process, 0);
+  jio_set_process_callback (j_client, process, 0);
 
   //jack_set_latency_callback (j_client, jack_latency_cb, NULL);
   jack_set_graph_order_callback (j_client, jack_graph_cb, NULL);
@@ -536,16 +402,26 @@ static int init_jack(const char *client_name) {
 }
 
 static int jack_portsetup(void) {
-  if ((mtc_output_port = jack_port_register(j_client, "mtc_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == 0) {
+  if ((mtc_output_port = jio_port_register("mtc_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput)) == 0) {
     fprintf (stderr, "cannot register mtc ouput port !\n");
     return (-1);
   }
+  if (loopback_interval >= 0
+      && (mtc_input_port = jio_port_register("mtc_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput)) == 0) {
+    fprintf (stderr, "cannot register mtc input port !\n");
+    return (-1);
+  }
+  if (cue_file
+      && (cue_output_port = jio_port_register("cue_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput)) == 0) {
+    fprintf (stderr, "cannot register cue ouput port !\n");
+    return (-1);
+  }
   return (0);
 }
 
 static void port_connect(char *mtc_port) {
-  if (mtc_port && jack_connect(j_client, jack_port_name(mtc_output_port), mtc_port)) {
-    fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(mtc_output_port), mtc_port);
+  if (mtc_port && jack_connect(j_client, jack_port_name(mtc_output_port->jport), mtc_port)) {
+    fprintf(stderr, "cannot connect port %s to %s\n", jack_port_name(mtc_output_port->jport), mtc_port);
   }
 }
 
@@ -558,16 +434,162 @@ void catchsig (int sig) {
   pthread_cond_signal (&data_ready);
 }
 
+void dumptiming (int sig) {
+  jio_timing_request();
+  pthread_cond_signal (&data_ready);
+}
+
+/**************************
+ * internal clock control
+ */
+
+static int parse_tc(const char *str, int64_t *fn) {
+  TimecodeTime t;
+  int h, m, s, f;
+  if (sscanf(str, "%d%*[:;.]%d%*[:;.]%d%*[:;.]%d", &h, &m, &s, &f) != 4
+      || h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59
+      || f < 0 || f >= ceil(timecode_rate_to_double(&mtcgen.framerate))) {
+    return -1;
+  }
+  t.hour = h;
+  t.minute = m;
+  t.second = s;
+  t.frame = f;
+  t.subframe = 0;
+  *fn = timecode_to_framenumber(&t, &mtcgen.framerate);
+  return 0;
+}
+
+static void clock_send(const clock_cmd *c) {
+  if (jack_ringbuffer_write_space(clock_rb) >= sizeof(clock_cmd)) {
+    jack_ringbuffer_write(clock_rb, (const char*) c, sizeof(clock_cmd));
+  } else {
+    fprintf(stderr, "clock: command queue full.\n");
+  }
+}
+
+static void control_line(char *line) {
+  char *cmd = strtok(line, " \t\r\n");
+  char *arg = strtok(NULL, " \t\r\n");
+  clock_cmd c;
+
+  if (!cmd) return;
+  memset(&c, 0, sizeof(clock_cmd));
+
+  if (!strcmp(cmd, "start") || !strcmp(cmd, "play")) {
+    c.cmd = CLK_START;
+  } else if (!strcmp(cmd, "stop")) {
+    c.cmd = CLK_STOP;
+  } else if (!strcmp(cmd, "locate")) {
+    if (!arg || parse_tc(arg, &c.fn)) {
+      fprintf(stderr, "clock: invalid timecode, expected HH:MM:SS:FF.\n");
+      return;
+    }
+    c.cmd = CLK_LOCATE;
+  } else if (!strcmp(cmd, "speed")) {
+    if (!arg || (c.speed = atof(arg)) < .01 || c.speed > 100) {
+      fprintf(stderr, "clock: invalid speed.\n");
+      return;
+    }
+    c.cmd = CLK_SPEED;
+  } else if (!strcmp(cmd, "status")) {
+    const uint64_t tc = __atomic_load_n(&mtcgen.cur_tc, __ATOMIC_RELAXED);
+    printf("%02d:%02d:%02d:%02d\n",
+	(int)(tc >> 24) & 0xff, (int)(tc >> 16) & 0xff, (int)(tc >> 8) & 0xff, (int) tc & 0xff);
+    fflush(stdout);
+    return;
+  } else if (!strcmp(cmd, "quit")) {
+    client_state = Exit;
+    pthread_cond_signal (&data_ready);
+    return;
+  } else {
+    fprintf(stderr, "clock: unknown command '%s'.\n", cmd);
+    return;
+  }
+  clock_send(&c);
+}
+
+#ifndef WIN32
+static void *control_thread(void *arg) {
+  const int fd = *(int*) arg;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  char buf[256];
+  size_t len = 0;
+
+  while (client_state != Exit) {
+    if (poll(&pfd, 1, 250) <= 0) continue;
+    const ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0) break; // EOF on stdin
+    len += n;
+    buf[len] = '\0';
+    char *eol;
+    while ((eol = strchr(buf, '\n'))) {
+      *eol = '\0';
+      control_line(buf);
+      len -= eol + 1 - buf;
+      memmove(buf, eol + 1, len + 1);
+    }
+    if (len == sizeof(buf) - 1) {
+      len = 0; // line too long
+    }
+  }
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  return NULL;
+}
+
+static int control_start(void) {
+  static int fd;
+  if (control_path) {
+    struct stat st;
+    if (stat(control_path, &st) && mkfifo(control_path, 0600)) {
+      fprintf(stderr, "cannot create control FIFO '%s'.\n", control_path);
+      return -1;
+    }
+    /* read-write: the FIFO does not signal EOF when a writer closes it */
+    if ((fd = open(control_path, O_RDWR)) < 0) {
+      fprintf(stderr, "cannot open control FIFO '%s'.\n", control_path);
+      return -1;
+    }
+  } else {
+    fd = STDIN_FILENO;
+  }
+  if (pthread_create(&control_thread_id, NULL, control_thread, &fd)) {
+    return -1;
+  }
+  control_thread_running = 1;
+  return 0;
+}
+#else
+static int control_start(void) {
+  fprintf(stderr, "internal clock control is not supported on this platform.\n");
+  return -1;
+}
+#endif
+
 /**************************
  * main application code
  */
 
 static struct option const long_options[] =
 {
+  {"autostart", no_argument, 0, 'A'},
+  {"capture", required_argument, 0, 'c'},
+  {"control", required_argument, 0, 'C'},
   {"help", no_argument, 0, 'h'},
+  {"internal", required_argument, 0, 'i'},
+  {"loopback", required_argument, 0, 'l'},
+  {"metrics", required_argument, 0, 'M'},
   {"jackvideo", no_argument, 0, 'F'},
   {"fps", required_argument, 0, 'f'},
+  {"pipeline", required_argument, 0, 'P'},
+  {"cues", required_argument, 0, 'Q'},
+  {"replay", required_argument, 0, 'r'},
+  {"speed", required_argument, 0, 's'},
+  {"timing", required_argument, 0, 'T'},
   {"version", no_argument, 0, 'V'},
+  {"wire", required_argument, 0, 'W'},
   {NULL, 0, NULL, 0}
 };
 
@@ -575,15 +597,62 @@ static void usage (int status) {
   printf ("jmtcgen - JACK app to generate MTC from JACK transport.\n\n");
   printf ("Usage: jmtcgen [ OPTIONS ] [JACK-port]*\n\n");
   printf ("Options:\n\
+  -A, --autostart            start the internal clock rolling\n\
+  -c, --capture <file>       record all process-cycle input to <file>\n\
+  -C, --control <fifo>       read internal clock commands from <fifo>\n\
+                             instead of stdin\n\
   -f, --fps <num>[/den]      set MTC framerate (default 25/1)\n\
   -F, --jackvideo            use jack-transport's FPS setting if available\n\
   -h, --help                 display this help and exit\n\
+  -i, --internal <timecode>  use a free-running clock located at <timecode>\n\
+                             (HH:MM:SS:FF) instead of JACK transport\n\
+  -l, --loopback <sec>       measure round-trip latency of MTC received on\n\
+                             port mtc_in, report every <sec> seconds\n\
+  -M, --metrics <path>       serve counters in Prometheus text format on\n\
+                             unix-domain socket <path>\n\
+  -P, --pipeline <periods>   pre-render MTC <periods> cycles ahead in a\n\
+                             helper thread while the transport rolls\n\
+  -Q, --cues <file>          send the MIDI messages of cue list <file> on\n\
+                             port cue_out\n\
+  -r, --replay <file>        process a capture-file instead of using JACK\n\
+  -s, --speed <factor>       internal clock speed (default 1.0)\n\
+  -T, --timing <sec>         print process() timing statistics every <sec>\n\
+                             seconds (also on SIGUSR1)\n\
   -V, --version              print version information and exit\n\
+  -W, --wire <baud>          schedule MTC for a serial MIDI link of <baud>\n\
+                             (31250 for DIN MIDI)\n\
 \n");
   printf ("\n\
 This tool generates Midi Time Code from JACK transport and sends it\n\
 on a JACK-midi port.\n\
 \n\
+In loopback mode, connect mtc_out through the MIDI chain under test back\n\
+to mtc_in and start the transport. Every received quarter-frame is\n\
+matched by value against those sent; the latency includes JACK's own\n\
+buffering (at least one period).\n\
+\n\
+In pipeline mode the process callback only copies pre-rendered events\n\
+while the transport rolls steadily. Any transport change falls back to\n\
+generating MTC in the process callback. It is not used with --replay.\n\
+\n\
+The internal clock is driven by the JACK sample clock. It starts stopped\n\
+(unless --autostart is given) and is controlled by line-based commands:\n\
+  start, stop, locate HH:MM:SS:FF, speed <factor>, status, quit\n\
+\n\
+A cue list has one cue per line: a timecode and the MIDI message to send\n\
+when the transport rolls into that frame, as hex bytes, e.g.\n\
+  01:02:03:04  90 3c 7f\n\
+Lines starting with '#' are ignored. Each cue is one complete message\n\
+(status byte and all of its data bytes, no running status).\n\
+\n\
+A serial MIDI link sends about 3125 bytes/s at 31250 baud, an interface\n\
+queues what does not fit. With --wire, events are stamped no earlier\n\
+than the modelled wire can send them, quarter-frames that would be more\n\
+than 10ms late are dropped. A full-frame message goes out before the\n\
+quarter-frames that follow it, and a newer one replaces one that is\n\
+still pending. A warning is printed while more than the\n\
+link's capacity is requested.\n\
+\n\
 Note that MTC only supports 4 framerates: 24, 25, 30df and 30 fps.\n\
 30df == 30000/1001 fps\n\
 \n");
@@ -597,16 +666,40 @@ static int decode_switches (int argc, char **argv) {
   int c;
 
   while ((c = getopt_long (argc, argv,
+			   "A"	/* autostart */
+			   "c:"	/* capture */
+			   "C:"	/* control */
 			   "d"	/* debug */
 			   "F"	/* jack_video */
 			   "f:"	/* fps */
 			   "h"	/* help */
-			   "V",	/* version */
+			   "i:"	/* internal */
+			   "l:"	/* loopback */
+			   "M:"	/* metrics */
+			   "P:"	/* pipeline */
+			   "Q:"	/* cues */
+			   "r:"	/* replay */
+			   "s:"	/* speed */
+			   "T:"	/* timing */
+			   "V"	/* version */
+			   "W:",	/* wire */
 			   long_options, (int *) 0)) != EOF)
     {
       switch (c)
 	{
 
+	case 'A':
+	  clock_roll = 1;
+	  break;
+
+	case 'c':
+	  capture_file = optarg;
+	  break;
+
+	case 'C':
+	  control_path = optarg;
+	  break;
+
 	case 'd':
 	  debug = 1;
 	  break;
@@ -623,6 +716,43 @@ static int decode_switches (int argc, char **argv) {
 	}
 	break;
 
+	case 'i':
+	  clock_start = optarg;
+	  break;
+
+	case 'l':
+	  loopback_interval = atof(optarg);
+	  if (loopback_interval < 0) loopback_interval = 0;
+	  break;
+
+	case 'M':
+	  metrics_path = optarg;
+	  break;
+
+	case 'P':
+	  pipeline = atoi(optarg);
+	  break;
+
+	case 'Q':
+	  cue_file = optarg;
+	  break;
+
+	case 'r':
+	  replay_file = optarg;
+	  break;
+
+	case 's':
+	  clock_speed = atof(optarg);
+	  break;
+
+	case 'T':
+	  timing_interval = atof(optarg);
+	  break;
+
+	case 'W':
+	  wire_baud = atof(optarg);
+	  break;
+
 	case 'V':
 	  printf ("jmtcgen version %s\n\n", VERSION);
 	  printf ("Copyright (C) GPL 2012 Robin Gareus <robin@gareus.org>\n");
@@ -639,24 +769,157 @@ static int decode_switches (int argc, char **argv) {
   return optind;
 }
 
+static void print_messages(void) {
+  while(jack_ringbuffer_read_space (rb) > 0) {
+    char x;
+    jack_ringbuffer_read(rb, (char*) &x, sizeof(char));
+    fputc(x, stdout);
+  }
+  fflush(stdout);
+}
+
+static void loopback_poll(void) {
+  static time_t next = 0;
+  time_t now;
+  if (!mtc_input_port) return;
+  mtcloop_collect(&mtcloop);
+  if (loopback_interval <= 0) return;
+  now = time(NULL);
+  if (next == 0) next = now + loopback_interval;
+  if (now < next) return;
+  next = now + loopback_interval;
+  mtcloop_print(&mtcloop, stdout);
+}
+
+static void wire_print(FILE *f) {
+  if (!mtcgen.wire) return;
+  fprintf(f, "MIDI link: %llu events delayed, %llu QF dropped, %llu full-frame coalesced, overloaded for %llu sec\n",
+      (unsigned long long) wire.n_delayed, (unsigned long long) wire.n_dropped,
+      (unsigned long long) wire.n_coalesced, (unsigned long long) wire.n_overload);
+}
+
+static void replay_idle(void) {
+  print_messages();
+  loopback_poll();
+}
+
 int main (int argc, char **argv) {
 
   decode_switches (argc, argv);
 
   // -=-=-= INITIALIZE =-=-=-
 
-  if (init_jack("jmtcgen"))
+  if (replay_file) {
+    if (jio_replay_open(replay_file))
+      goto out;
+    jio_set_process_callback (NULL, process, 0);
+    j_samplerate = jio_samplerate();
+  } else if (init_jack("jmtcgen")) {
     goto out;
+  }
   if (jack_portsetup())
     goto out;
 
-  rb = jack_ringbuffer_create(4096 * sizeof(char));
+  rb = rtmem_ringbuffer(4096 * sizeof(char));
+  if (mtc_input_port && mtcloop_init(&mtcloop, j_samplerate)) {
+    fprintf(stderr, "cannot allocate loopback statistics.\n");
+    goto out;
+  }
+
+  mtcgen_init(&mtcgen, j_samplerate);
+  mtcgen.framerate = framerate;
+  mtcgen_set_rate(&mtcgen);
+  mtcgen.use_jack_fps = use_jack_fps;
+  mtcgen.debug = debug;
+  mtcgen.msg = rbprintf;
+
+  if (wire_baud != 0) {
+    if (wire_baud < 1000 || wire_baud > 10000000) {
+      fprintf(stderr, "invalid MIDI link baud rate.\n");
+      goto out;
+    }
+    mtcwire_init(&wire, j_samplerate, wire_baud);
+    wire.msg = rbprintf;
+    mtcgen.wire = &wire;
+  }
+
+  jio_set_buffer_size_callback(jack_bufsize_cb, NULL);
+  jack_bufsize_cb(jio_period(), NULL);
+
+  /* keys are framerate independent, with --jackvideo any MTC rate may apply */
+  if (cue_file && mtccue_load(&cues, cue_file, use_jack_fps ? 30 : mtcgen.fps)) {
+    goto out;
+  }
+
+  if (replay_file) {
+    pipeline = 0; // not deterministic
+    clock_start = NULL;
+  }
+  if (clock_start) {
+    int64_t fn;
+    if (parse_tc(clock_start, &fn)) {
+      fprintf(stderr, "invalid start timecode, expected HH:MM:SS:FF.\n");
+      goto out;
+    }
+    if (clock_speed < .01 || clock_speed > 100) {
+      fprintf(stderr, "invalid clock speed.\n");
+      goto out;
+    }
+    clock_set_speed(clock_speed);
+    iclock.frame = clock_frame(fn);
+    iclock.state = clock_roll ? JackTransportStarting : JackTransportStopped;
+    clock_rb = rtmem_ringbuffer(64 * sizeof(clock_cmd));
+  }
+  if (pipeline > 0 && mtcpipe_init(&mtcpipe, &mtcgen, pipeline)) {
+    fprintf(stderr, "cannot start pipeline thread.\n");
+    goto out;
+  }
+
+  if (replay_file) {
+    jio_replay_run(replay_idle);
+    if (mtc_input_port)
+      mtcloop_print(&mtcloop, stdout);
+    print_messages();
+    wire_print(stdout);
+    if (timing_interval > 0)
+      jio_timing_print(stderr);
+    goto out;
+  }
+  if (capture_file && jio_capture_start(capture_file))
+    goto out;
 
-  if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
-    fprintf(stderr, "Warning: Can not lock memory.\n");
+  if (metrics_path) {
+    metrics_add("quarter_frames_sent_total", "MTC quarter-frame messages sent", METRIC_COUNTER, &mtcgen.n_qf);
+    metrics_add("sysex_sent_total", "MTC full-frame messages sent", METRIC_COUNTER, &mtcgen.n_sysex);
+    metrics_add("relocates_total", "Transport relocates and starts", METRIC_COUNTER, &mtcgen.n_relocate);
+    metrics_add("late_events_total", "MTC events dropped, they were for a previous cycle", METRIC_COUNTER, &mtcgen.n_late);
+    metrics_add("queue_overflows_total", "MTC frames deferred, event queue full", METRIC_COUNTER, &mtcgen.n_overflow);
+    metrics_add("ringbuffer_dropped_total", "Messages dropped, message ringbuffer full", METRIC_COUNTER, &msg_dropped);
+    metrics_add("timecode", "Current transport timecode", METRIC_TIMECODE, &mtcgen.cur_tc);
+    if (cue_output_port) {
+      metrics_add("cues_fired_total", "Cue MIDI messages sent", METRIC_COUNTER, &cues.n_fired);
+      metrics_add("cue_seeks_total", "Cue list lookups after a locate", METRIC_COUNTER, &cues.n_seek);
+      metrics_add("cues_dropped_total", "Cue MIDI messages dropped, port-buffer full", METRIC_COUNTER, &cues.n_dropped);
+    }
+    if (mtcgen.wire) {
+      metrics_add("wire_load_percent", "Requested share of the MIDI link capacity, last second", METRIC_GAUGE, &wire.load);
+      metrics_add("wire_delay_max_microseconds", "Longest wire delay of an MTC event, last second", METRIC_GAUGE, &wire.max_delay_us);
+      metrics_add("wire_overloads_total", "Seconds in which more than the MIDI link capacity was requested", METRIC_COUNTER, &wire.n_overload);
+      metrics_add("wire_delayed_total", "MTC events delayed, the MIDI link was busy", METRIC_COUNTER, &wire.n_delayed);
+      metrics_add("wire_dropped_total", "Quarter-frames dropped, too late for the MIDI link", METRIC_COUNTER, &wire.n_dropped);
+      metrics_add("wire_coalesced_total", "Full-frame messages replaced before the MIDI link could send them", METRIC_COUNTER, &wire.n_coalesced);
+    }
+    if (pipeline > 0) {
+      metrics_add("pipeline_cycles_total", "Process cycles served from pre-rendered events", METRIC_COUNTER, &mtcpipe.n_cycles);
+      metrics_add("pipeline_fallbacks_total", "Pre-rendering cancelled by a transport change", METRIC_COUNTER, &mtcpipe.n_fallback);
+      metrics_add("pipeline_underruns_total", "Pre-rendering cancelled, helper thread was behind", METRIC_COUNTER, &mtcpipe.n_underrun);
+    }
+    if (metrics_start(metrics_path, "jmtcgen"))
+      goto out;
   }
 
-  framerate.subframes = timecode_frames_per_timecode_frame(&framerate, j_samplerate);
+  rtmem_lock(stderr);
+
   // -=-=-= RUN =-=-=-
 
   if (jack_activate (j_client)) {
@@ -667,25 +930,32 @@ int main (int argc, char **argv) {
   while (optind < argc)
     port_connect(argv[optind++]);
 
+  if (clock_rb && control_start())
+    goto out;
+
 #ifndef _WIN32
   signal (SIGHUP, catchsig);
   signal (SIGINT, catchsig);
+  signal (SIGUSR1, dumptiming);
 #endif
+  if (timing_interval > 0)
+    jio_timing_interval(timing_interval);
 
   // -=-=-= JACK DOES ALL THE WORK =-=-=-
 
   pthread_mutex_lock (&msg_thread_lock);
   while (client_state != Exit) {
-    while(jack_ringbuffer_read_space (rb) > 0) {
-      char x;
-      jack_ringbuffer_read(rb, (char*) &x, sizeof(char));
-      fputc(x, stdout);
-    }
-    fflush(stdout);
-    pthread_cond_wait (&data_ready, &msg_thread_lock);
+    print_messages();
+    loopback_poll();
+    jio_timing_poll(stderr);
+    jio_cond_wait (&data_ready, &msg_thread_lock);
   }
   pthread_mutex_unlock (&msg_thread_lock);
 
+  if (mtc_input_port)
+    mtcloop_print(&mtcloop, stdout);
+  wire_print(stdout);
+
   // -=-=-= CLEANUP =-=-=-
 
 out:
@@ -0,0 +1,585 @@
+/* JACK-free MTC generator/decoder soak test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sendmmsg
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+
+#include <jack/jack.h>
+#include <jack/transport.h>
+#include <jack/midiport.h>
+#include <timecode/timecode.h>
+
+#include "jackio.h"
+#include "mtcgen.h"
+#include "mtcparse.h"
+#include "mtcloop.h"
+#include "mtcpipe.h"
+#include "mtcudp.h"
+
+/* global Vars */
+static MTCGen mtcgen;
+static MTCParser mtc;
+static MTCLoop mtcloop;
+static MTCPipe mtcpipe;
+static jio_port *mtc_output_port;
+static jio_port *mtc_input_port;
+
+/* options */
+static uint32_t samplerate = 48000;
+static jack_nframes_t period = 1024;
+static TimecodeRate framerate = { 25, 1, 0, 80 };
+static double duration = 86400;
+static double locate_interval = 0;
+static double stop_interval = 0;
+static unsigned int seed = 1;
+static int tolerance = 1;
+static int verbose = 0;
+static int latency = 0;
+static int pipeline = 0;
+static int udp = 0;
+
+/************************************************
+ * process callback: decode, then generate
+ */
+
+/* transport at the start of the previous cycle;
+ * events received now were sent during that cycle */
+static int prev_rolling = 0;
+static jack_nframes_t prev_frame = 0;
+static jack_nframes_t prev_nframes = 0;
+static unsigned long long monotonic_cnt = 0;
+
+static unsigned long long qf0_tme = 0;
+static long long qf0_pos = -1;
+
+/* checks */
+static int settle = 0;
+static int have_last = 0;
+static int64_t last_fn = 0;
+static unsigned long long last_tme = 0;
+
+static unsigned long long n_frames = 0;
+static unsigned long long n_errors = 0;
+static unsigned long long n_checked = 0;
+static double off_mean = 0, off_m2 = 0;
+static long long off_min = 0, off_max = 0;
+static long long ival_maxerr = 0;
+
+static void soak_error(const char *fmt, ...) {
+	va_list ap;
+	++n_errors;
+	if (!verbose) return;
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+}
+
+static int expected_mtc_type(void) {
+	switch ((int)floor(timecode_rate_to_double(&framerate))) {
+		case 24: return 0;
+		case 29: return 2;
+		case 30: return 3;
+		default: return 1;
+	}
+}
+
+/* sequences to skip after a discontinuity: 2, plus those still in
+ * flight in the one period loopback */
+static int settle_sequences(void) {
+	const double fpf = timecode_frames_per_timecode_frame(&framerate, samplerate);
+	return 2 + ceil(period / (2 * fpf));
+}
+
+/************************************************
+ * UDP loopback: every decoded timecode is sent like jmtcdump does,
+ * received on 127.0.0.1 and compared with the packet that was posted
+ */
+
+#define UDP_HISTORY (4 * MTCUDP_RBSIZE) // posted packets kept, by seq
+
+static int udp_fd = -1;
+static mtcudp_pkt udp_posted[UDP_HISTORY];
+static uint32_t udp_next_seq = 0;
+static unsigned long long udp_received = 0;
+static unsigned long long udp_lost = 0;
+static unsigned long long udp_mismatch = 0;
+
+static int udp_open(void) {
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	const int rcvbuf = 1 << 20;
+	char dest[32];
+
+	if ((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(udp_fd, (struct sockaddr*) &sa, sizeof(sa))
+			|| getsockname(udp_fd, (struct sockaddr*) &sa, &len)) {
+		close(udp_fd);
+		udp_fd = -1;
+		return -1;
+	}
+	setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	snprintf(dest, sizeof(dest), "127.0.0.1:%d", ntohs(sa.sin_port));
+	return mtcudp_open(dest, samplerate);
+}
+
+static void udp_post(const TimecodeTime *t) {
+	mtcudp_pkt p;
+	memset(&p, 0, sizeof(mtcudp_pkt));
+	p.type = mtc.tc.type;
+	p.hour = t->hour;
+	p.minute = t->minute;
+	p.second = t->second;
+	p.frame = t->frame;
+	p.sample = qf0_tme;
+	p.usec = jio_sample_to_monotonic(qf0_tme);
+	mtcudp_post(&p);
+	udp_posted[p.seq % UDP_HISTORY] = p;
+}
+
+/* check the packets that arrived, waiting up to @wait [ms] for each;
+ * returns the number of packets read */
+static int udp_receive(int wait) {
+	struct pollfd pfd = { udp_fd, POLLIN, 0 };
+	mtcudp_pkt p;
+	int n = 0;
+	while (poll(&pfd, 1, wait) > 0) {
+		if (recv(udp_fd, &p, sizeof(mtcudp_pkt), 0) != sizeof(mtcudp_pkt)) {
+			++udp_mismatch;
+			soak_error("udp: short packet\n");
+			continue;
+		}
+		++n;
+		++udp_received;
+		mtcudp_ntoh(&p);
+		if (p.magic != MTCUDP_MAGIC || p.version != MTCUDP_VERSION) {
+			++udp_mismatch;
+			soak_error("udp: invalid packet header\n");
+			continue;
+		}
+		/* gaps: sender queue full (mtcudp.n_dropped) or lost by the kernel */
+		udp_lost += p.seq - udp_next_seq;
+		udp_next_seq = p.seq + 1;
+		if (memcmp(&p, &udp_posted[p.seq % UDP_HISTORY], sizeof(mtcudp_pkt))) {
+			++udp_mismatch;
+			soak_error("udp: packet %u %02d:%02d:%02d:%02d @%lld differs from the one sent\n",
+					p.seq, p.hour, p.minute, p.second, p.frame, (long long) p.sample);
+		}
+	}
+	return n;
+}
+
+/************************************************
+ * decoder checks
+ */
+
+static void check_frame(void) {
+	const double fpf = timecode_frames_per_timecode_frame(&framerate, samplerate);
+	TimecodeTime t;
+	t.hour = mtc.tc.hour;
+	t.minute = mtc.tc.min;
+	t.second = mtc.tc.sec;
+	t.frame = mtc.tc.frame;
+	t.subframe = 0;
+
+	const int64_t fn = timecode_to_framenumber(&t, &framerate);
+
+	++n_frames;
+	if (udp) {
+		udp_post(&t);
+	}
+	if (settle > 0) {
+		--settle;
+		have_last = 0;
+		return;
+	}
+
+	if (mtc.tc.type != expected_mtc_type()) {
+		soak_error("@%llu: MTC type %s, expected %s\n",
+				qf0_tme, MTCTYPE[mtc.tc.type], MTCTYPE[expected_mtc_type()]);
+	}
+
+	if (have_last) {
+		const long long ival = qf0_tme - last_tme;
+		const long long ierr = llabs(ival - (long long) rint(2 * fpf));
+		if (fn - last_fn != 2) {
+			soak_error("@%llu: discontinuity %02d:%02d:%02d:%02d (%+lld frames)\n",
+					qf0_tme, t.hour, t.minute, t.second, t.frame, (long long)(fn - last_fn));
+		} else if (ierr > tolerance) {
+			soak_error("@%llu: sequence interval %lld, expected %.1f\n",
+					qf0_tme, ival, 2 * fpf);
+		}
+		if (ierr > ival_maxerr) ival_maxerr = ierr;
+	}
+
+	if (qf0_pos >= 0) {
+		const long long offset = qf0_pos - timecode_to_sample(&t, &framerate, samplerate);
+		if (n_checked == 0 || offset < off_min) off_min = offset;
+		if (n_checked == 0 || offset > off_max) off_max = offset;
+		++n_checked;
+		const double delta = offset - off_mean;
+		off_mean += delta / n_checked;
+		off_m2 += delta * (offset - off_mean);
+		if (llabs(offset) > tolerance) {
+			soak_error("@%llu: %02d:%02d:%02d:%02d is %+lld samples off transport\n",
+					qf0_tme, t.hour, t.minute, t.second, t.frame, offset);
+		}
+	}
+
+	have_last = 1;
+	last_fn = fn;
+	last_tme = qf0_tme;
+}
+
+static int process(jack_nframes_t nframes, void *arg) {
+	jack_transport_state_t state;
+	jack_position_t pos;
+	void *in, *out;
+	int n, nevents;
+
+	in = jio_port_get_buffer(mtc_input_port, nframes);
+	if (latency) {
+		mtcloop_scan(&mtcloop, in, monotonic_cnt, 0);
+	}
+	nevents = jio_midi_get_event_count(in);
+	for (n = 0; n < nevents; n++) {
+		jack_midi_event_t ev;
+		jio_midi_event_get(&ev, in, n);
+		if (ev.size != 2 || ev.buffer[0] != 0xf1) continue;
+		if ((ev.buffer[1] >> 4) == 0) {
+			qf0_tme = monotonic_cnt - prev_nframes + ev.time;
+			qf0_pos = prev_rolling ? (long long) prev_frame + ev.time : -1;
+		}
+		if (parse_timecode(&mtc, ev.buffer[1])) {
+			check_frame();
+		}
+	}
+
+	state = jio_transport_query(&pos);
+	out = jio_port_get_buffer(mtc_output_port, nframes);
+	if (pipeline > 0) {
+		mtcpipe_process(&mtcpipe, state, &pos, nframes, out);
+	} else {
+		mtcgen_process(&mtcgen, state, &pos, nframes, out);
+	}
+	if (latency) {
+		mtcloop_scan(&mtcloop, out, monotonic_cnt, 1);
+	}
+
+	prev_rolling = state == JackTransportRolling;
+	prev_frame = pos.frame;
+	prev_nframes = nframes;
+	monotonic_cnt += nframes;
+	return 0;
+}
+
+static void msg_print(const char *fmt, ...) {
+	va_list ap;
+	if (!verbose) return;
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+}
+
+/* deterministic locate targets */
+static unsigned int xorshift(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/**************************
+ * main application code
+ */
+
+static struct option const long_options[] =
+{
+  {"duration", required_argument, 0, 'd'},
+  {"fps", required_argument, 0, 'f'},
+  {"help", no_argument, 0, 'h'},
+  {"latency", no_argument, 0, 'L'},
+  {"locate", required_argument, 0, 'l'},
+  {"period", required_argument, 0, 'p'},
+  {"pipeline", required_argument, 0, 'P'},
+  {"samplerate", required_argument, 0, 's'},
+  {"seed", required_argument, 0, 'x'},
+  {"stop", required_argument, 0, 'S'},
+  {"tolerance", required_argument, 0, 't'},
+  {"udp", no_argument, 0, 'U'},
+  {"verbose", no_argument, 0, 'v'},
+  {"version", no_argument, 0, 'V'},
+  {NULL, 0, NULL, 0}
+};
+
+static void usage (int status) {
+  printf ("jmtcsim - JACK-free MTC generator/decoder soak test.\n\n");
+  printf ("Usage: jmtcsim [ OPTIONS ]\n\n");
+  printf ("Options:\n\
+  -d, --duration <sec>       simulated time to run (default 86400)\n\
+  -f, --fps <num>[/den]      set MTC framerate (default 25/1)\n\
+  -h, --help                 display this help and exit\n\
+  -l, --locate <sec>         relocate the transport every <sec> seconds\n\
+  -L, --latency              report quarter-frame round-trip latency\n\
+  -p, --period <frames>      process-cycle size (default 1024)\n\
+  -P, --pipeline <periods>   pre-render MTC in a helper thread (as jmtcgen)\n\
+  -s, --samplerate <rate>    sample-rate (default 48000)\n\
+  -S, --stop <sec>           toggle transport stop/roll every <sec> seconds\n\
+  -t, --tolerance <spl>      allowed timing error in samples (default 1)\n\
+  -U, --udp                  send decoded timecode as UDP to 127.0.0.1\n\
+                             and verify the received packets\n\
+  -v, --verbose              print every error and generator message\n\
+  -x, --seed <num>           seed for locate positions (default 1)\n\
+  -V, --version              print version information and exit\n\
+\n");
+  printf ("\n\
+This tool runs the jmtcgen MTC generator and the jmtcdump MTC parser\n\
+back to back without a JACK server. The generator's output port is\n\
+looped back to the decoder's input (one period latency) and driven by a\n\
+simulated transport that advances freely as fast as possible.\n\
+\n\
+Every decoded quarter-frame sequence is checked for continuity (+2\n\
+frames, 2 frame-durations apart) and its position against the transport.\n\
+After a locate, start or stop, the first sequences are not checked.\n\
+With --udp each decoded timecode is also sent as a jmtcdump UDP packet\n\
+to a local socket; every packet received must match the one sent.\n\
+The exit code is 1 if any error occurred.\n\
+\n");
+  printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
+          "Website and manual: <https://github.com/x42/mtc-tools>\n"
+	  );
+  exit (status);
+}
+
+static int decode_switches (int argc, char **argv) {
+	int c;
+
+	while ((c = getopt_long (argc, argv,
+			   "d:"	/* duration */
+			   "f:"	/* fps */
+			   "h"	/* help */
+			   "l:"	/* locate */
+			   "L"	/* latency */
+			   "p:"	/* period */
+			   "P:"	/* pipeline */
+			   "s:"	/* samplerate */
+			   "S:"	/* stop */
+			   "t:"	/* tolerance */
+			   "U"	/* udp */
+			   "v"	/* verbose */
+			   "x:"	/* seed */
+			   "V",	/* version */
+			   long_options, (int *) 0)) != EOF) {
+		switch (c) {
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 'f':
+				{
+					framerate.num = atoi(optarg);
+					char *tmp = strchr(optarg, '/');
+					if (tmp) framerate.den=atoi(++tmp);
+				}
+				break;
+			case 'l':
+				locate_interval = atof(optarg);
+				break;
+			case 'L':
+				latency = 1;
+				break;
+			case 'p':
+				period = atoi(optarg);
+				break;
+			case 'P':
+				pipeline = atoi(optarg);
+				break;
+			case 's':
+				samplerate = atoi(optarg);
+				break;
+			case 'S':
+				stop_interval = atof(optarg);
+				break;
+			case 't':
+				tolerance = atoi(optarg);
+				break;
+			case 'U':
+				udp = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'x':
+				seed = atoi(optarg);
+				if (seed == 0) seed = 1;
+				break;
+			case 'V':
+				printf ("jmtcsim version %s\n\n", VERSION);
+				printf ("License GPLv2+: GNU GPL version 2 or later.\n");
+				exit (0);
+
+			case 'h':
+				usage (0);
+
+			default:
+				usage (EXIT_FAILURE);
+		}
+	}
+	return optind;
+}
+
+int main (int argc, char ** argv) {
+	struct timespec t0, t1;
+	jack_position_t pos;
+	int rolling = 1;
+
+	decode_switches (argc, argv);
+
+	if (samplerate < 8000 || period < 16 || period > JIO_MAX_PERIOD || duration <= 0) {
+		fprintf(stderr, "invalid samplerate, period or duration.\n");
+		return 1;
+	}
+	if (framerate.den == 1001) framerate.drop = 1;
+	framerate.subframes = timecode_frames_per_timecode_frame(&framerate, samplerate);
+
+	jio_sim_open(samplerate, period);
+	jio_set_process_callback (NULL, process, 0);
+	if (!(mtc_output_port = jio_port_register("mtc_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput))
+			|| !(mtc_input_port = jio_port_register("mtc_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput))) {
+		fprintf(stderr, "cannot register ports.\n");
+		return 1;
+	}
+	jio_sim_connect(mtc_output_port, mtc_input_port);
+
+	mtcgen_init(&mtcgen, samplerate);
+	mtcgen.msg = msg_print;
+	mtcgen.framerate = framerate;
+	mtcgen_set_rate(&mtcgen);
+	memset(&mtc, 0, sizeof(MTCParser));
+	if (pipeline > 0 && mtcpipe_init(&mtcpipe, &mtcgen, pipeline)) {
+		fprintf(stderr, "cannot start pipeline thread.\n");
+		return 1;
+	}
+	if (latency && mtcloop_init(&mtcloop, samplerate)) {
+		fprintf(stderr, "cannot allocate latency statistics.\n");
+		return 1;
+	}
+	if (udp && udp_open()) {
+		fprintf(stderr, "cannot open UDP loopback.\n");
+		return 1;
+	}
+
+	/* avoid 24h wrap-around and 32bit transport-frame overflow */
+	const uint64_t wrap = (uint64_t) samplerate * 3600 * 23 > UINT32_MAX - 2 * period
+		? UINT32_MAX - 2 * period : (uint64_t) samplerate * 3600 * 23;
+	const uint64_t end = duration * samplerate;
+	uint64_t next_locate = locate_interval > 0 ? locate_interval * samplerate : end;
+	uint64_t next_stop = stop_interval > 0 ? stop_interval * samplerate : end;
+
+	jio_sim_transport(JackTransportStarting, 0);
+	settle = settle_sequences();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	while (jio_sim_time() < end) {
+		const uint64_t now = jio_sim_time();
+		if (now >= next_stop) {
+			rolling = !rolling;
+			jio_transport_query(&pos);
+			jio_sim_transport(rolling ? JackTransportStarting : JackTransportStopped, pos.frame);
+			next_stop += stop_interval * samplerate;
+			settle = settle_sequences();
+		}
+		if (now >= next_locate) {
+			const jack_nframes_t target = xorshift() % (samplerate * 3600);
+			jio_transport_query(&pos);
+			jio_sim_transport(rolling ? JackTransportStarting : JackTransportStopped, target);
+			next_locate += locate_interval * samplerate;
+			settle = settle_sequences();
+		}
+		if (rolling && jio_transport_query(&pos) == JackTransportRolling && pos.frame >= wrap) {
+			jio_sim_transport(JackTransportStarting, 0);
+			settle = settle_sequences();
+		}
+		if (pipeline > 0) {
+			mtcpipe_sync(&mtcpipe);
+		}
+		jio_sim_cycle();
+		if (latency) {
+			mtcloop_collect(&mtcloop);
+		}
+		if (udp) {
+			mtcudp_flush();
+			/* do not outrun the receiver, posted packets are kept for UDP_HISTORY */
+			while (udp_receive(0) > 0
+					|| (mtcudp.seq - udp_next_seq > UDP_HISTORY / 2 && udp_receive(10) > 0)) ;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	const double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	const double simulated = (double) jio_sim_time() / samplerate;
+
+	printf("simulated %.1f sec (%u Hz, %u frames/period, %.2f fps) in %.2f sec, %.0fx realtime\n",
+			simulated, samplerate, period, timecode_rate_to_double(&framerate),
+			elapsed, elapsed > 0 ? simulated / elapsed : 0);
+	printf("events out: %llu, decoded frames: %llu, errors: %llu\n",
+			jio.out_events, n_frames, n_errors);
+	if (n_checked > 0) {
+		printf("offset [spl]: mean %.2f stddev %.2f min %lld max %lld, max interval error %lld\n",
+				off_mean, n_checked > 1 ? sqrt(off_m2 / (n_checked - 1)) : 0,
+				off_min, off_max, ival_maxerr);
+	}
+
+	if (latency) {
+		mtcloop_print(&mtcloop, stdout);
+		mtcloop_free(&mtcloop);
+	}
+	if (udp) {
+		mtcudp_close();
+		while (udp_receive(100) > 0) ;
+		udp_lost += mtcudp.seq - udp_next_seq;
+		printf("udp: %u packets posted, %llu received, %llu lost (%llu sender queue full), %llu mismatched\n",
+				mtcudp.seq, udp_received, udp_lost, (unsigned long long) mtcudp.n_dropped, udp_mismatch);
+		if (udp_received == 0) {
+			soak_error("udp: no packets received\n");
+		}
+		close(udp_fd);
+	}
+	if (pipeline > 0) {
+		printf("pipeline: %llu cycles pre-rendered, %llu fallbacks, %llu underruns\n",
+				(unsigned long long) mtcpipe.n_cycles, (unsigned long long) mtcpipe.n_fallback,
+				(unsigned long long) mtcpipe.n_underrun);
+		mtcpipe_free(&mtcpipe);
+	}
+
+	jio_cleanup();
+	return (n_errors > 0 || n_frames == 0) ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+/* Sub-sample LTC frame timing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* libltc reports frame positions in whole samples, where its biphase
+ * threshold detector triggered. For each decoded frame, the transitions
+ * of the sync word (bits 64..79: 0011111111111101, 30 edges in biphase
+ * mark) are located as crossings of the mid-level between the signal's
+ * minimum and maximum, linearly interpolated between samples, and a
+ * line is fitted through them (edge time against half-bit index). The
+ * line's value at the end of bit 79 is the frame boundary: the end of
+ * this frame and the start of the next one.
+ *
+ * The start of a frame is the boundary measured at the end of the
+ * previous frame, i.e. the same physical edge. The first frame after a
+ * gap has no predecessor, its start is extrapolated by one frame from
+ * its own sync word.
+ *
+ * The audio is read in place from the current period, only the last
+ * LTCEDGE_BITS bit-periods of each period are retained for a sync word
+ * that started in a previous one.
+ */
+
+#ifndef LTCEDGE_H
+#define LTCEDGE_H
+
+#include <math.h>
+#include <string.h>
+#include <jack/jack.h>
+#include <ltc.h>
+
+#include "rtmem.h"
+
+#define LTCEDGE_BITS (24)      // retained history, > sync word + search margin
+#define LTCEDGE_MIN_EDGES (20)
+#define LTCEDGE_MAX_RMS (0.1)  // max. fit residual [bit-periods]
+
+typedef struct {
+	float *hist;              // ring, power of two
+	uint32_t mask;
+	uint32_t hist_len;        // valid samples before @in_pos
+	ltc_off_t hist_end;       // position following the last retained sample
+
+	/* current period */
+	const jack_default_audio_sample_t *in;
+	ltc_off_t in_pos;
+	jack_nframes_t in_len;
+
+	double boundary;          // end of the last frame's sync word
+	int have_boundary;
+	float fit_rms;            // of the last refined frame [samples]
+} LTCEdge;
+
+/* non-realtime, @fps: slowest expected frame-rate */
+static inline int ltcedge_init(LTCEdge *e, uint32_t samplerate, double fps) {
+	const double spb = samplerate / (fps * LTC_FRAME_BIT_COUNT) * 1.25; // allow for varispeed
+	uint32_t size = 64;
+	memset(e, 0, sizeof(LTCEdge));
+	while (size < LTCEDGE_BITS * spb) {
+		size *= 2;
+	}
+	if (!(e->hist = (float*) rtmem_alloc(size * sizeof(float)))) {
+		return -1;
+	}
+	e->mask = size - 1;
+	return 0;
+}
+
+static inline void ltcedge_free(LTCEdge *e) {
+	rtmem_free(e->hist);
+	e->hist = NULL;
+}
+
+/* call before passing the period to the decoder */
+static inline void ltcedge_period(LTCEdge *e, const jack_default_audio_sample_t *in, jack_nframes_t nframes, ltc_off_t posinfo) {
+	if (posinfo != e->hist_end) {
+		/* discontinuity, e.g. the port latency changed */
+		e->hist_len = 0;
+		e->have_boundary = 0;
+	}
+	e->in = in;
+	e->in_pos = posinfo;
+	e->in_len = nframes;
+}
+
+/* call after the period was decoded */
+static inline void ltcedge_retain(LTCEdge *e) {
+	const uint32_t size = e->mask + 1;
+	const jack_nframes_t n = e->in_len < size ? e->in_len : size;
+	jack_nframes_t i;
+	for (i = e->in_len - n; i < e->in_len; ++i) {
+		e->hist[(uint64_t)(e->in_pos + i) & e->mask] = e->in[i];
+	}
+	e->hist_len = e->hist_len + e->in_len < size ? e->hist_len + e->in_len : size;
+	e->hist_end = e->in_pos + e->in_len;
+}
+
+static inline float ltcedge_sample(const LTCEdge *e, ltc_off_t pos) {
+	if (pos >= e->in_pos) {
+		return e->in[pos - e->in_pos];
+	}
+	return e->hist[(uint64_t) pos & e->mask];
+}
+
+/* the crossing of @mid closest to @expect within +-@win,
+ * returns 0 if there is none */
+static inline int ltcedge_crossing(const LTCEdge *e, double expect, double win, float mid, ltc_off_t lo, ltc_off_t hi, double *x) {
+	ltc_off_t i = (ltc_off_t) floor(expect - win);
+	const ltc_off_t end = (ltc_off_t) ceil(expect + win);
+	int found = 0;
+	float y0;
+	if (i < lo) i = lo;
+	if (i >= hi) return 0;
+	y0 = ltcedge_sample(e, i) - mid;
+	for (; i < end && i + 1 < hi; ++i) {
+		const float y1 = ltcedge_sample(e, i + 1) - mid;
+		if ((y0 < 0) != (y1 < 0)) {
+			const double c = i + y0 / (y0 - y1);
+			if (!found || fabs(c - expect) < fabs(*x - expect)) {
+				*x = c;
+				found = 1;
+			}
+		}
+		y0 = y1;
+	}
+	return found;
+}
+
+/* fractional start of @f, in the decoder's sample positions. Frames that
+ * can not be refined (reverse, low level, too few edges) keep off_start
+ * and set fit_rms to -1. */
+static inline double ltcedge_refine(LTCEdge *e, const LTCFrameExt *f) {
+	/* half-bit indices of the sync word's edges, from the start of bit 64 */
+	static const int8_t edges[] = {
+		0, 2, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+		18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 30, 31, 32
+	};
+	const double spb = (f->off_end - f->off_start + 1) / (double) LTC_FRAME_BIT_COUNT;
+	const double s64 = f->off_end + 1 - 16 * spb;
+	const ltc_off_t lo = e->in_pos - e->hist_len;
+	const ltc_off_t hi = e->in_pos + e->in_len;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, a, b, rss = 0, start;
+	float mn = 1e9f, mx = -1e9f, mid;
+	double x[sizeof(edges)];
+	int8_t ok[sizeof(edges)];
+	ltc_off_t i;
+	unsigned int k;
+	int n = 0;
+
+	e->fit_rms = -1;
+	if (f->reverse || spb < 2 || s64 - spb < lo) {
+		e->have_boundary = 0;
+		return f->off_start;
+	}
+
+	for (i = (ltc_off_t) floor(s64 - spb / 2); i < hi && i <= f->off_end + spb / 2; ++i) {
+		const float v = ltcedge_sample(e, i);
+		if (v < mn) mn = v;
+		if (v > mx) mx = v;
+	}
+	mid = (mn + mx) / 2;
+	if (mx - mn < 1e-3f) {
+		e->have_boundary = 0;
+		return f->off_start;
+	}
+
+	for (k = 0; k < sizeof(edges); ++k) {
+		ok[k] = ltcedge_crossing(e, s64 + edges[k] * spb / 2, spb / 4, mid, lo, hi, &x[k]);
+		if (!ok[k]) continue;
+		sx += edges[k];
+		sy += x[k];
+		sxx += edges[k] * edges[k];
+		sxy += edges[k] * x[k];
+		++n;
+	}
+	if (n < LTCEDGE_MIN_EDGES) {
+		e->have_boundary = 0;
+		return f->off_start;
+	}
+	b = (n * sxy - sx * sy) / (n * sxx - sx * sx); // samples per half-bit
+	a = (sy - b * sx) / n;
+	for (k = 0; k < sizeof(edges); ++k) {
+		if (!ok[k]) continue;
+		rss += (x[k] - a - b * edges[k]) * (x[k] - a - b * edges[k]);
+	}
+	if (sqrt(rss / n) > LTCEDGE_MAX_RMS * spb) {
+		e->have_boundary = 0;
+		return f->off_start;
+	}
+
+	if (e->have_boundary && fabs(e->boundary - f->off_start) < spb) {
+		start = e->boundary;
+	} else {
+		start = a - 2 * 64 * b;
+	}
+	e->boundary = a + 32 * b;
+	e->have_boundary = 1;
+	e->fit_rms = sqrt(rss / n);
+	return start;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* LTC audio to libltc decoder glue
+ *
+ * (C) 2006, 2012  Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef LTCPARSE_H
+#define LTCPARSE_H
+
+#include <math.h>
+#include <ltc.h>
+
+#define LTCPARSE_CHUNK (1024)
+
+/* convert float audio to 8bit unsigned and pass it to the LTC decoder,
+ * in chunks: there is no limit on the period-size */
+static inline int parse_ltc(LTCDecoder *d, jack_nframes_t nframes, jack_default_audio_sample_t *in, ltc_off_t posinfo) {
+	unsigned char sound[LTCPARSE_CHUNK];
+	jack_nframes_t off = 0;
+
+	while (off < nframes) {
+		const jack_nframes_t n = nframes - off < LTCPARSE_CHUNK ? nframes - off : LTCPARSE_CHUNK;
+		jack_nframes_t i;
+		for (i = 0; i < n; i++) {
+			const int snd=(int)rint((127.0*in[off + i])+128.0);
+			sound[i] = (unsigned char) (snd&0xff);
+		}
+		ltc_decoder_write(d, sound, n, posinfo + off);
+		off += n;
+	}
+	return 0;
+}
+
+#endif
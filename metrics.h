@@ -0,0 +1,276 @@
+/* Prometheus text-format metrics on a unix-domain socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Counters live wherever the realtime code keeps its state. Each has a
+ * single writer and is updated with a relaxed load and store (METRIC_INC,
+ * METRIC_SET), without a locked read-modify-write. The tools register a
+ * pointer to each of them; a non-realtime thread serves a snapshot to
+ * every client that connects to the socket, e.g.
+ *   curl --unix-socket /tmp/jmtcdump.sock http://localhost/metrics
+ *   socat - UNIX-CONNECT:/tmp/jmtcdump.sock
+ * HTTP requests get an HTTP/1.0 response, anything else plain text.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef MSG_NOSIGNAL
+#define METRICS_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define METRICS_SEND_FLAGS 0 // SO_NOSIGPIPE, see metrics_thread()
+#endif
+#endif
+
+#include "jackio.h"
+
+#define METRICS_MAX (32)
+
+/* every metric has a single writer, see JIO_RELAXED_ADD */
+#define METRIC_INC(VAR) JIO_RELAXED_ADD(VAR, 1)
+#define METRIC_SET(VAR, VAL) __atomic_store_n(&(VAR), (VAL), __ATOMIC_RELAXED)
+#define METRIC_TC(H, M, S, F, FPS) \
+	(((uint64_t)(FPS) << 40) | ((uint64_t)1 << 32) | ((uint64_t)(H) << 24) | ((M) << 16) | ((S) << 8) | (F))
+
+enum {
+	METRIC_COUNTER = 0,
+	METRIC_GAUGE,
+	METRIC_TIMECODE, // METRIC_TC() packed, 0: none; <name>_seconds and <name>_fps
+	METRIC_SIGNED    // gauge, int64_t stored in the uint64_t
+};
+
+typedef struct {
+	char name[48];
+	const char *help;
+	int type;
+	const uint64_t *value;
+} metric;
+
+static struct {
+	metric m[METRICS_MAX];
+	int n;
+	char prefix[16];
+	char path[108];
+	int fd;
+	volatile int run;
+	pthread_t thread;
+#ifndef WIN32
+	dev_t dev;       // the socket this process bound at path
+	ino_t ino;
+#endif
+} metrics = {
+	.fd = -1,
+};
+
+static inline void metrics_add(const char *name, const char *help, int type, const uint64_t *value) {
+	if (metrics.n >= METRICS_MAX) return;
+	metric *m = &metrics.m[metrics.n++];
+	strncpy(m->name, name, sizeof(m->name) - 1);
+	m->help = help;
+	m->type = type;
+	m->value = value;
+}
+
+/* a timecode is exported as numbers, a label would be a new series
+ * every frame: the timecode in seconds (H * 3600 + M * 60 + S + F / fps,
+ * NaN: none) and its nominal frame-rate */
+static inline void metrics_print_timecode(FILE *f, const metric *m, uint64_t v) {
+	const int fps = (v >> 40) & 0xff;
+	fprintf(f, "# HELP %s_%s_seconds %s\n", metrics.prefix, m->name, m->help);
+	fprintf(f, "# TYPE %s_%s_seconds gauge\n", metrics.prefix, m->name);
+	if (v == 0 || fps == 0) {
+		fprintf(f, "%s_%s_seconds NaN\n", metrics.prefix, m->name);
+	} else {
+		fprintf(f, "%s_%s_seconds %.4f\n", metrics.prefix, m->name,
+				((v >> 24) & 0xff) * 3600 + ((v >> 16) & 0xff) * 60 + ((v >> 8) & 0xff) + (double)(v & 0xff) / fps);
+	}
+	fprintf(f, "# HELP %s_%s_fps Nominal frame-rate of %s_%s_seconds\n", metrics.prefix, m->name, metrics.prefix, m->name);
+	fprintf(f, "# TYPE %s_%s_fps gauge\n", metrics.prefix, m->name);
+	fprintf(f, "%s_%s_fps %d\n", metrics.prefix, m->name, v ? fps : 0);
+}
+
+static inline void metrics_print(FILE *f) {
+	int k;
+	for (k = 0; k < metrics.n; ++k) {
+		const metric *m = &metrics.m[k];
+		const uint64_t v = __atomic_load_n(m->value, __ATOMIC_RELAXED);
+		if (m->type == METRIC_TIMECODE) {
+			metrics_print_timecode(f, m, v);
+			continue;
+		}
+		fprintf(f, "# HELP %s_%s %s\n", metrics.prefix, m->name, m->help);
+		fprintf(f, "# TYPE %s_%s %s\n", metrics.prefix, m->name,
+				m->type == METRIC_COUNTER ? "counter" : "gauge");
+		if (m->type == METRIC_SIGNED) {
+			fprintf(f, "%s_%s %lld\n", metrics.prefix, m->name, (long long)(int64_t) v);
+		} else {
+			fprintf(f, "%s_%s %llu\n", metrics.prefix, m->name, (unsigned long long) v);
+		}
+	}
+}
+
+#ifndef WIN32
+/* the response is rendered first and sent without SIGPIPE,
+ * a client that disconnects early must not terminate the tool */
+static inline void metrics_serve(int c) {
+	struct pollfd pfd = { c, POLLIN, 0 };
+	char req[1024];
+	ssize_t len = 0;
+	char *buf = NULL;
+	size_t size = 0, off = 0;
+	FILE *f;
+
+	/* an HTTP client sends a request first, a plain reader does not */
+	if (poll(&pfd, 1, 100) > 0) {
+		len = read(c, req, sizeof(req) - 1);
+	}
+	if (!(f = open_memstream(&buf, &size))) {
+		close(c);
+		return;
+	}
+	if (len > 3 && !strncmp(req, "GET", 3)) {
+		fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	}
+	metrics_print(f);
+	fclose(f);
+
+	while (off < size) {
+		const ssize_t n = send(c, buf + off, size - off, METRICS_SEND_FLAGS);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break; // EPIPE: the client went away
+		off += n;
+	}
+	free(buf);
+	close(c);
+}
+
+static inline void *metrics_thread(void *arg) {
+	struct pollfd pfd = { metrics.fd, POLLIN, 0 };
+	while (metrics.run) {
+		if (poll(&pfd, 1, 250) <= 0) continue;
+		const int c = accept(metrics.fd, NULL, NULL);
+		if (c < 0) continue;
+#if !defined MSG_NOSIGNAL && defined SO_NOSIGPIPE
+		const int one = 1;
+		setsockopt(c, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		metrics_serve(c);
+	}
+	return NULL;
+}
+#endif
+
+#ifndef WIN32
+/* remove the socket this process bound, if it is still there */
+static inline void metrics_unlink(void) {
+	struct stat st;
+	if (!lstat(metrics.path, &st) && S_ISSOCK(st.st_mode)
+			&& st.st_dev == metrics.dev && st.st_ino == metrics.ino) {
+		unlink(metrics.path);
+	}
+}
+#endif
+
+/* serve all registered metrics, named <prefix>_<name>, on socket @path */
+static inline int metrics_start(const char *path, const char *prefix) {
+#ifdef WIN32
+	fprintf(stderr, "metrics: unix-domain sockets are not supported on this platform.\n");
+	return -1;
+#else
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "metrics: socket path too long.\n");
+		return -1;
+	}
+	strncpy(metrics.prefix, prefix, sizeof(metrics.prefix) - 1);
+	strcpy(metrics.path, path);
+
+	metrics_add("process_cycles_total", "Number of process() cycles", METRIC_COUNTER, &jio.tm_cycles);
+	metrics_add("process_wcet_nanoseconds", "Longest process() execution time", METRIC_GAUGE, &jio.tm_max_ns);
+	metrics_add("process_overruns_total", "process() cycles that took longer than the period", METRIC_COUNTER, &jio.tm_overruns);
+	metrics_add("locked_memory_bytes", "Memory locked for the process thread", METRIC_GAUGE, &rtmem.locked);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* replace a stale socket, never anything else */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "metrics: '%s' exists and is not a socket.\n", path);
+			return -1;
+		}
+		unlink(path);
+	} else if (errno != ENOENT) {
+		fprintf(stderr, "metrics: cannot access '%s': %s.\n", path, strerror(errno));
+		return -1;
+	}
+
+	if ((metrics.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "metrics: cannot create socket.\n");
+		return -1;
+	}
+	if (bind(metrics.fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		fprintf(stderr, "metrics: cannot bind '%s'.\n", path);
+		close(metrics.fd);
+		metrics.fd = -1;
+		return -1;
+	}
+	if (lstat(path, &st)) {
+		memset(&st, 0, sizeof(st));
+	}
+	metrics.dev = st.st_dev;
+	metrics.ino = st.st_ino;
+	metrics.run = 1;
+	if (listen(metrics.fd, 4) || pthread_create(&metrics.thread, NULL, metrics_thread, NULL)) {
+		fprintf(stderr, "metrics: cannot listen on '%s'.\n", path);
+		metrics.run = 0;
+		metrics_unlink();
+		close(metrics.fd);
+		metrics.fd = -1;
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+static inline void metrics_stop(void) {
+	if (metrics.fd < 0) return;
+#ifndef WIN32
+	metrics.run = 0;
+	pthread_join(metrics.thread, NULL);
+	metrics_unlink();
+	close(metrics.fd);
+#endif
+	metrics.fd = -1;
+}
+
+#endif
@@ -0,0 +1,287 @@
+/* Timecode cue scheduler
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A cue list is a text file, one cue per line:
+ *   HH:MM:SS:FF  <MIDI message as hex bytes>
+ * e.g. "01:02:03:04 90 3c 7f". Empty lines and lines starting with '#'
+ * are ignored, cues at the same timecode fire in file order.
+ *
+ * Cues are indexed by a packed, framerate independent key
+ * (hour, minute, second, frame) that sorts like the timecode. Keys are
+ * kept in a contiguous sorted array, message data in a separate pool.
+ * The tools call mtccue_frame() for every frame that starts in a cycle;
+ * while frames are consecutive a cursor advances over the index,
+ * otherwise (locate) it is re-positioned with a binary search. The
+ * per-cycle cost only depends on the number of cues that fire.
+ */
+
+#ifndef MTCCUE_H
+#define MTCCUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jackio.h"
+
+#define MTCCUE_KEY(H, M, S, F) \
+	(((uint32_t)(H) << 24) | ((uint32_t)(M) << 16) | ((uint32_t)(S) << 8) | (uint32_t)(F))
+
+#define MTCCUE_CATCHUP (4) // late frames that still fire, instead of a seek
+
+typedef struct {
+	/* index */
+	uint32_t *key;      // sorted
+	uint32_t *off;      // message offset in data
+	uint16_t *len;
+	uint8_t *data;
+	size_t n;
+
+	/* process thread */
+	size_t cursor;      // next cue to fire
+	uint32_t last;      // key of the last frame
+	int valid;
+
+	/* statistics, relaxed atomics */
+	uint64_t n_fired;
+	uint64_t n_seek;
+	uint64_t n_dropped; // port-buffer full
+} MTCCue;
+
+/* next frame, MTC framerate rules */
+static inline uint32_t mtccue_next(uint32_t key, int fps, int drop) {
+	int h = key >> 24, m = (key >> 16) & 0xff, s = (key >> 8) & 0xff, f = key & 0xff;
+	if (++f >= fps) {
+		f = 0;
+		if (++s == 60) {
+			s = 0;
+			if (++m == 60) {
+				m = 0;
+				if (++h == 24) {
+					h = 0;
+				}
+			}
+			if (drop && (m % 10)) {
+				f = 2;
+			}
+		}
+	}
+	return MTCCUE_KEY(h, m, s, f);
+}
+
+/* index of the first cue at or after @key */
+static inline size_t mtccue_lower_bound(const MTCCue *c, uint32_t key) {
+	size_t lo = 0, hi = c->n;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (c->key[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static inline void mtccue_reset(MTCCue *c) {
+	c->valid = 0;
+}
+
+/**
+ * frame @key starts at sample-offset @time of this cycle:
+ * write due cues to the MIDI port-buffer @out.
+ */
+static inline void mtccue_frame(MTCCue *c, uint32_t key, int fps, int drop, jack_nframes_t time, void *out) {
+	int cont = 0;
+	if (c->valid && key == c->last) {
+		return;
+	}
+	if (c->valid && key > c->last) {
+		uint32_t k = c->last;
+		int i;
+		for (i = 0; i < MTCCUE_CATCHUP && !cont; ++i) {
+			k = mtccue_next(k, fps, drop);
+			cont = k == key;
+		}
+	}
+	if (!cont) {
+		c->cursor = mtccue_lower_bound(c, key);
+		JIO_RELAXED_ADD(c->n_seek, 1);
+	}
+	while (c->cursor < c->n && c->key[c->cursor] <= key) {
+		const size_t i = c->cursor++;
+		if (jio_midi_event_write(out, time, c->data + c->off[i], c->len[i])) {
+			JIO_RELAXED_ADD(c->n_dropped, 1);
+		} else {
+			JIO_RELAXED_ADD(c->n_fired, 1);
+		}
+	}
+	c->last = key;
+	c->valid = 1;
+}
+
+/************************************************
+ * cue list
+ */
+
+typedef struct {
+	uint32_t key;
+	uint32_t off;
+	uint16_t len;
+	size_t line;
+} mtccue_entry;
+
+static inline int mtccue_cmp(const void *a, const void *b) {
+	const mtccue_entry *x = (const mtccue_entry*) a;
+	const mtccue_entry *y = (const mtccue_entry*) b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return x->line < y->line ? -1 : (x->line > y->line);
+}
+
+static inline void mtccue_free(MTCCue *c) {
+	rtmem_free(c->key);
+	rtmem_free(c->off);
+	rtmem_free(c->len);
+	rtmem_free(c->data);
+	memset(c, 0, sizeof(MTCCue));
+}
+
+/* length of the MIDI message with status byte @status, 0: variable (sysex),
+ * -1: not a status byte or undefined */
+static inline int mtccue_msg_size(uint8_t status) {
+	if (status < 0x80) return -1;
+	if (status < 0xc0) return 3; // note off/on, poly pressure, control change
+	if (status < 0xe0) return 2; // program change, channel pressure
+	if (status < 0xf0) return 3; // pitch bend
+	switch (status) {
+		case 0xf0: return 0;
+		case 0xf1: case 0xf3: return 2;
+		case 0xf2: return 3;
+		case 0xf6: case 0xf8: case 0xfa: case 0xfb: case 0xfc: case 0xfe: case 0xff: return 1;
+		default: return -1;
+	}
+}
+
+/* a complete MIDI message: its length matches the status byte, and
+ * only data bytes follow it (sysex: up to the terminating 0xf7) */
+static inline int mtccue_msg_valid(const uint8_t *d, size_t len) {
+	const int size = len > 0 ? mtccue_msg_size(d[0]) : -1;
+	size_t i;
+	if (size < 0 || (size > 0 && len != (size_t) size)) {
+		return 0;
+	}
+	if (size == 0 && (len < 2 || d[len - 1] != 0xf7)) {
+		return 0;
+	}
+	for (i = 1; i < len - (size == 0); ++i) {
+		if (d[i] & 0x80) return 0;
+	}
+	return 1;
+}
+
+/* load cue list @path, @fps: max. frame-number + 1 */
+static inline int mtccue_load(MTCCue *c, const char *path, int fps) {
+	mtccue_entry *e = NULL;
+	size_t n = 0, cap = 0, dlen = 0, dcap = 0, line = 0, i;
+	char buf[1024];
+	FILE *f;
+
+	memset(c, 0, sizeof(MTCCue));
+	if (!(f = fopen(path, "r"))) {
+		fprintf(stderr, "cannot open cue list '%s'.\n", path);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), f)) {
+		int h, m, s, fr, pos;
+		char *p;
+		++line;
+		p = buf + strspn(buf, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+		if (sscanf(p, "%d%*[:;.]%d%*[:;.]%d%*[:;.]%d%n", &h, &m, &s, &fr, &pos) != 4
+				|| h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59 || fr < 0 || fr >= fps) {
+			fprintf(stderr, "%s:%zu: invalid timecode.\n", path, line);
+			goto fail;
+		}
+		if (n == cap) {
+			cap = cap ? 2 * cap : 1024;
+			mtccue_entry *tmp = (mtccue_entry*) realloc(e, cap * sizeof(mtccue_entry));
+			if (!tmp) goto fail;
+			e = tmp;
+		}
+		e[n].key = MTCCUE_KEY(h, m, s, fr);
+		e[n].off = dlen;
+		e[n].len = 0;
+		e[n].line = line;
+		p += pos;
+		for (;;) {
+			char *end;
+			const unsigned long v = strtoul(p, &end, 16);
+			if (end == p) break;
+			if (v > 0xff) {
+				fprintf(stderr, "%s:%zu: invalid MIDI byte.\n", path, line);
+				goto fail;
+			}
+			if (dlen == dcap) {
+				dcap = dcap ? 2 * dcap : 4096;
+				uint8_t *tmp = (uint8_t*) realloc(c->data, dcap);
+				if (!tmp) goto fail;
+				c->data = tmp;
+			}
+			c->data[dlen++] = v;
+			++e[n].len;
+			p = end;
+		}
+		if (!mtccue_msg_valid(c->data + e[n].off, e[n].len)) {
+			fprintf(stderr, "%s:%zu: expected a complete MIDI message.\n", path, line);
+			goto fail;
+		}
+		++n;
+	}
+	fclose(f);
+	f = NULL;
+
+	qsort(e, n, sizeof(mtccue_entry), mtccue_cmp);
+
+	/* the tables are read by the process thread */
+	c->key = (uint32_t*) rtmem_alloc((n + 1) * sizeof(uint32_t));
+	c->off = (uint32_t*) rtmem_alloc((n + 1) * sizeof(uint32_t));
+	c->len = (uint16_t*) rtmem_alloc((n + 1) * sizeof(uint16_t));
+	if (!c->key || !c->off || !c->len) goto fail;
+	if (dlen > 0) {
+		uint8_t *data = (uint8_t*) rtmem_alloc(dlen);
+		if (!data) goto fail;
+		memcpy(data, c->data, dlen);
+		free(c->data);
+		c->data = data;
+	}
+	for (i = 0; i < n; ++i) {
+		c->key[i] = e[i].key;
+		c->off[i] = e[i].off;
+		c->len[i] = e[i].len;
+	}
+	c->n = n;
+	free(e);
+	return 0;
+
+fail:
+	if (f) fclose(f);
+	free(e);
+	mtccue_free(c);
+	return -1;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/* MTC generator
+ *
+ * Copyright (C) 2006, 2012 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Output of the generator core (mtcgencore.h) to a MIDI port-buffer.
+ *
+ * With a link model (g->wire, see mtcwire.h) due events are passed
+ * through it, and are written when the modelled MIDI wire can send them.
+ */
+
+#ifndef MTCGEN_H
+#define MTCGEN_H
+
+#include "mtcgencore.h"
+#include "jackio.h"
+#include "mtcwire.h"
+
+/* write an event for monotonic sample-time @mt of the current cycle */
+static inline void mtcgen_write(MTCGen *g, void *out, long long int mt, const jack_midi_data_t *data, size_t size) {
+  jio_midi_event_write(out, mt - g->monotonic_fcnt, data, size);
+  if (size == 2) {
+    MTCGEN_STAT_INC(g->n_qf);
+  } else {
+    MTCGEN_STAT_INC(g->n_sysex);
+  }
+}
+
+/* write the events that the link model can send in this cycle */
+static inline void mtcgen_wire_output(MTCGen *g, jack_nframes_t nframes, void *out) {
+  const jack_midi_data_t *data;
+  long long int mt;
+  size_t size;
+  while (mtcwire_next(g->wire, g->monotonic_fcnt, nframes, &mt, &data, &size)) {
+    mtcgen_write(g, out, mt, data, size);
+  }
+}
+
+/**
+ * generate MTC for one process cycle:
+ * queue events for the given transport state and write all events
+ * that are due in this cycle to the MIDI port-buffer @out.
+ */
+static inline void mtcgen_process_at(MTCGen *g, jack_transport_state_t state, const jack_position_t *pos, int64_t sample_pos, jack_nframes_t nframes, void *out) {
+  const jack_midi_data_t *data;
+  long long int mt;
+  size_t size;
+
+  mtcgen_render_at(g, state, pos, sample_pos, nframes);
+
+  jio_midi_clear_buffer(out);
+  while (mtcgen_pop(g, nframes, &mt, &data, &size)) {
+#if 0 // DEBUG dump Events & Timing
+    printf("QF:%02x abs: %"PRId64" rel:%4u @%"PRId64" jt:%"PRId64"\n",
+	data[1], mt,
+	(jack_nframes_t) (mt - g->monotonic_fcnt), g->monotonic_fcnt,
+	sample_pos + mt - g->monotonic_fcnt);
+#endif
+    if (g->wire) {
+      mtcwire_push(g->wire, mt, data, size);
+    } else {
+      mtcgen_write(g, out, mt, data, size);
+    }
+  }
+  if (g->wire) {
+    mtcgen_wire_output(g, nframes, out);
+  }
+
+  g->monotonic_fcnt += nframes;
+}
+
+/* mtcgen_process_at() for the JACK transport position @pos */
+static inline void mtcgen_process(MTCGen *g, jack_transport_state_t state, const jack_position_t *pos, jack_nframes_t nframes, void *out) {
+  mtcgen_process_at(g, state, pos, mtcgen_sample_pos(pos), nframes, out);
+}
+
+#endif
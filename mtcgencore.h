@@ -0,0 +1,528 @@
+/* MTC generator core
+ *
+ * Copyright (C) 2006, 2012 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* All generator state lives in an MTCGen instance, so that several
+ * generators (or a generator and a decoder) can share a process.
+ *
+ * Rate dependent constants are cached by mtcgen_set_rate(). The
+ * transport timecode is kept incrementally: the frame-number and its
+ * phase (a rational remainder, exact for 1001 denominators) advance by
+ * the sample delta of each cycle, and a full sample to timecode
+ * conversion is only done after a locate.
+ *
+ * Queued events are kept as a struct of arrays: the 2-byte messages and
+ * their timestamps are contiguous. A quarter-frame sequence (8 messages,
+ * two frames) is encoded at once by mtcgen_encode_qf(). Full-frame
+ * messages flush the queue, so at most one is pending; its slot holds
+ * 0xf0 and the message itself is in g->sysex.
+ *
+ * This part only uses the JACK types, it neither calls libjack nor
+ * depends on jackio.h; the caller fetches due events with mtcgen_pop().
+ * mtcgen.h adds the output to a JACK (or jio) MIDI port.
+ */
+
+#ifndef MTCGENCORE_H
+#define MTCGENCORE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <jack/types.h>
+#include <jack/transport.h>
+#include <jack/midiport.h>
+#include <timecode/timecode.h>
+
+#ifndef JACK_MIDI_QUEUE_SIZE
+#define JACK_MIDI_QUEUE_SIZE (1024) // events, covers JIO_MAX_PERIOD with write-ahead
+#endif
+
+typedef struct {
+  /* configuration */
+  TimecodeRate framerate;
+  uint32_t samplerate;
+  jack_nframes_t latency;
+  int use_jack_fps;
+  int debug;
+  void (*msg)(const char *fmt, ...); // RT-safe message callback, may be NULL
+  struct MTCWire *wire;              // MIDI link model (mtcgen.h), may be NULL
+
+  /* state */
+  int writeahead;
+  long long int monotonic_fcnt;
+  long long int ev_time[JACK_MIDI_QUEUE_SIZE];      // monotonic sample-time
+  jack_midi_data_t ev_data[JACK_MIDI_QUEUE_SIZE][2]; // 0xf1 QF, 0xf0: sysex[]
+  jack_midi_data_t sysex[16];
+  size_t sysex_size;
+  int queued_events_start;
+  int queued_events_end;
+
+  /* rate constants, mtcgen_set_rate() */
+  double fptcf;                 // audio-frames per timecode-frame
+  int64_t srden;                // samplerate * den, frame-length = srden / num
+  int qf_speed;                 // audio-frames per 4 quarter-frames
+  int mtc_tc;                   // MTC rate bits of the hour byte
+  int fps;                      // nominal frames per second
+  int drop_frames;              // frames dropped per minute (drop-frame)
+
+  /* transport timecode, mtcgen_locate() */
+  int tc_valid;
+  int64_t tc_pos;               // transport sample-position
+  int64_t tc_fn;                // frame-number at tc_pos
+  int64_t tc_acc;               // tc_pos * num - tc_fn * srden, [0, srden)
+  TimecodeTime tc_time;         // timecode of tc_fn
+
+  uint8_t qf_seq[8];            // queue_mtc_quarterframes()
+  int next_quarter_frame_to_send;
+  int qf_skip;                  // quarter-frames not to queue, already sent (mtcpipe.h)
+  TimecodeTime stime;           // generate_mtc()
+  int64_t sfn;                  // frame-number of stime
+  unsigned long long int pfcnt;
+  jack_nframes_t period;        // of the previous cycle
+  int pmode;
+  float audio_frames_per_video_frame;
+
+  /* statistics, relaxed atomics (read by the metrics thread) */
+  uint64_t n_qf;        // quarter-frames sent
+  uint64_t n_sysex;     // full-frame messages sent
+  uint64_t n_relocate;
+  uint64_t n_late;      // events for a previous cycle (dropped)
+  uint64_t n_overflow;  // frames not queued, queue full
+  uint64_t cur_tc;      // METRIC_TC() packed, current transport timecode
+} MTCGen;
+
+/* single writer (the thread that runs the generator): relaxed load + store */
+#define MTCGEN_STAT_INC(VAR) \
+  __atomic_store_n(&(VAR), __atomic_load_n(&(VAR), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED)
+
+#define MTCGEN_MSG(g, ...) do { if ((g)->msg) (g)->msg(__VA_ARGS__); } while (0)
+
+static inline int mtcgen_queue_space(const MTCGen *g) {
+  return JACK_MIDI_QUEUE_SIZE - 1
+    - (g->queued_events_start - g->queued_events_end + JACK_MIDI_QUEUE_SIZE) % JACK_MIDI_QUEUE_SIZE;
+}
+
+/* queue entries needed for periods of @nframes, at up to 30 fps */
+static inline int mtcgen_queue_need(const MTCGen *g, jack_nframes_t nframes) {
+  const double f30 = g->samplerate / 30.0;
+  return 4 * (2 + ceil(g->latency / f30) + ceil(nframes / f30) + 1) + 1;
+}
+
+static inline void mtcgen_update_writeahead(MTCGen *g) {
+  g->writeahead = 1 + ceil((double)g->latency / g->fptcf);
+}
+
+/**
+ * (re)calculate constants after g->framerate or g->samplerate changed.
+ * This also invalidates the transport position.
+ */
+static inline void mtcgen_set_rate(MTCGen *g) {
+  TimecodeRate * const framerate = &g->framerate;
+
+  g->fptcf = timecode_frames_per_timecode_frame(framerate, g->samplerate);
+  g->srden = (int64_t) g->samplerate * framerate->den;
+  g->qf_speed = rint(g->fptcf);
+  g->fps = ceil(timecode_rate_to_double(framerate));
+  g->drop_frames = framerate->drop ? 2 * ((g->fps + 15) / 30) : 0;
+  framerate->subframes = g->fptcf;
+
+  /* set MTC fps */
+  switch ((int)floor(timecode_rate_to_double(framerate))) {
+    case 24: g->mtc_tc = 0x00; break;
+    case 25: g->mtc_tc = 0x20; break;
+    case 29: g->mtc_tc = 0x40; break;
+    case 30: g->mtc_tc = 0x60; break;
+    default:
+      g->mtc_tc = 0x20;
+      MTCGEN_MSG(g, "WARNING: invalid framerate %.2f (using 25fps instead) - expect sync problems\n",
+	  timecode_rate_to_double(framerate));
+      break;
+  }
+
+  g->tc_valid = 0;
+  mtcgen_update_writeahead(g);
+}
+
+static inline void mtcgen_init(MTCGen *g, uint32_t samplerate) {
+  memset(g, 0, sizeof(MTCGen));
+  g->framerate.num = 25;
+  g->framerate.den = 1;
+  g->framerate.drop = 0;
+  g->samplerate = samplerate;
+  g->pmode = -1;
+  mtcgen_set_rate(g);
+}
+
+/* advance timecode @t by one frame, SMPTE drop-frame rules */
+static inline void mtcgen_time_increment(const MTCGen *g, TimecodeTime *t) {
+  if (++t->frame < g->fps) {
+    return;
+  }
+  t->frame = 0;
+  if (++t->second < 60) {
+    return;
+  }
+  t->second = 0;
+  if (++t->minute == 60) {
+    t->minute = 0;
+    if (++t->hour == 24) {
+      t->hour = 0;
+    }
+  }
+  if (t->minute % 10) {
+    t->frame = g->drop_frames;
+  }
+}
+
+/* update the transport timecode for sample-position @sample */
+static inline void mtcgen_locate(MTCGen *g, int64_t sample) {
+  const int64_t num = g->framerate.num;
+
+  if (g->tc_valid && sample >= g->tc_pos
+      && (sample - g->tc_pos) * num < 4 * g->srden) {
+    g->tc_acc += (sample - g->tc_pos) * num;
+    while (g->tc_acc >= g->srden) {
+      g->tc_acc -= g->srden;
+      ++g->tc_fn;
+      mtcgen_time_increment(g, &g->tc_time);
+    }
+  } else {
+    const int64_t x = sample * num;
+    g->tc_fn = x / g->srden;
+    g->tc_acc = x - g->tc_fn * g->srden;
+    timecode_framenumber_to_time(&g->tc_time, &g->framerate, g->tc_fn);
+    g->tc_time.subframe = 0;
+    g->tc_valid = 1;
+  }
+  g->tc_pos = sample;
+}
+
+/* spread the 4 bytes of @v to the even bytes of a 64bit word */
+static inline uint64_t mtcgen_spread(uint32_t v) {
+  uint64_t x = v;
+  x = (x | x << 16) & 0x0000ffff0000ffffULL;
+  x = (x | x << 8)  & 0x00ff00ff00ff00ffULL;
+  return x;
+}
+
+/* all 8 quarter-frame data bytes for timecode @t */
+static inline void mtcgen_encode_qf(uint8_t qf[8], const TimecodeTime * const t, const int mtc_tc) {
+  const uint32_t v = (t->frame & 0xff) | (t->second & 0xff) << 8 | (t->minute & 0xff) << 16 | ((mtc_tc | t->hour) & 0xff) << 24;
+  const uint64_t seq = 0x7060504030201000ULL
+    | mtcgen_spread(v & 0x0f0f0f0f)
+    | mtcgen_spread((v >> 4) & 0x0f0f0f0f) << 8;
+  int i;
+  for (i = 0; i < 8; ++i) {
+    qf[i] = seq >> (8 * i);
+  }
+}
+
+static inline void queue_mtc_quarterframes(MTCGen *g, const TimecodeTime * const t, const int mtc_tc, const int reverse, const int speed, const long long int posinfo) {
+  int i;
+
+  if (g->next_quarter_frame_to_send != 0 && g->next_quarter_frame_to_send != 4) {
+    /* this can actually never happen */
+    MTCGEN_MSG(g, "quarter-frame mis-aligment: %d (should be 0 or 4)\n", g->next_quarter_frame_to_send);
+    g->next_quarter_frame_to_send = 0;
+  }
+  if (mtc_tc != 0x20 && (t->frame%2) == 1 && g->next_quarter_frame_to_send == 0) {
+    /* the MTC spec does note that for 24, 30 drop and 30 non-drop, the frame number computed from quarter frames is always even
+     * but for 25 it might be odd or even "depending on whiuch frame number the 8 message sequence started"
+     */
+    MTCGEN_MSG(g, "re-align quarter-frame to even frame-number\n");
+    return;
+  }
+
+  if (g->next_quarter_frame_to_send == 0) {
+    /* MTC spans timecode over two frames.
+     * encode the current timecode since the min/hour (2nd part)
+     * may change.
+     */
+    mtcgen_encode_qf(g->qf_seq, t, mtc_tc);
+  }
+
+  int qf = g->next_quarter_frame_to_send;
+  int k = g->queued_events_start;
+  for (i=0;i<4;++i) {
+    if (reverse)
+      qf = (qf + 7) & 7;
+
+    if (g->qf_skip > 0) {
+      --g->qf_skip;
+    } else {
+      g->ev_time[k] = posinfo + (i * speed) / 4;
+      g->ev_data[k][0] = 0xf1;
+      g->ev_data[k][1] = g->qf_seq[qf];
+      k = (k + 1) % JACK_MIDI_QUEUE_SIZE;
+    }
+
+    if (!reverse)
+      qf = (qf + 1) & 7;
+  }
+  g->queued_events_start = k;
+  g->next_quarter_frame_to_send = qf;
+}
+
+static inline void queue_mtc_sysex(MTCGen *g, const TimecodeTime * const t, const int mtc_tc, const long long int posinfo) {
+  jack_midi_data_t *sysex = g->sysex;
+  g->queued_events_end = g->queued_events_start; // flush queue
+  g->qf_skip = 0;
+#if 1
+  sysex[0]  = (unsigned char) 0xf0; // fixed
+  sysex[1]  = (unsigned char) 0x7f; // fixed
+  sysex[2]  = (unsigned char) 0x7f; // sysex channel
+  sysex[3]  = (unsigned char) 0x01; // fixed
+  sysex[4]  = (unsigned char) 0x01; // fixed
+  sysex[5]  = (unsigned char) 0x00; // hour
+  sysex[6]  = (unsigned char) 0x00; // minute
+  sysex[7]  = (unsigned char) 0x00; // seconds
+  sysex[8]  = (unsigned char) 0x00; // frame
+  sysex[9]  = (unsigned char) 0xf7; // fixed
+
+  sysex[5] |= (unsigned char) (mtc_tc&0x60);
+  sysex[5] |= (unsigned char) (t->hour&0x1f);
+  sysex[6] |= (unsigned char) (t->minute&0x7f);
+  sysex[7] |= (unsigned char) (t->second&0x7f);
+  sysex[8] |= (unsigned char) (t->frame&0x7f);
+
+  g->sysex_size = 10;
+
+#else
+
+  sysex[0]   = (char) 0xf0;
+  sysex[1]   = (char) 0x7f;
+  sysex[2]   = (char) 0x7f;
+  sysex[3]   = (char) 0x06;
+  sysex[4]   = (char) 0x44;
+  sysex[5]   = (char) 0x06;
+  sysex[6]   = (char) 0x01;
+  sysex[7]   = (char) 0x00;
+  sysex[8]   = (char) 0x00;
+  sysex[9]   = (char) 0x00;
+  sysex[10]  = (char) 0x00;
+  sysex[11]  = (char) 0x00;
+  sysex[12]  = (char) 0xf7;
+
+  sysex[7]  |= (char) 0x20; // 25fps
+  sysex[7]  |= (char) (stime->hours&0x1f);
+  sysex[8]  |= (char) (stime->mins&0x7f);
+  sysex[9]  |= (char) (stime->secs&0x7f);
+  sysex[10] |= (char) (stime->frame&0x7f);
+
+  int checksum = (sysex[7] + sysex[8] + sysex[9] + sysex[10] + 0x3f)&0x7f ;
+  sysex[11]  = (char) (127-checksum); //checksum
+  g->sysex_size = 13;
+#endif
+
+  g->ev_time[g->queued_events_start] = posinfo;
+  g->ev_data[g->queued_events_start][0] = 0xf0;
+  g->queued_events_start = (g->queued_events_start + 1)%JACK_MIDI_QUEUE_SIZE;
+}
+
+/**
+ * queue MTC for the transport timecode (mtcgen_locate()) at monotonic
+ * sample-time @mfcnt
+ * mode 0: stopped, 1: starting, 2: rolling;  num: frames to queue ahead
+ */
+static inline void generate_mtc(MTCGen *g, long long int mfcnt, int mode, int num) {
+  const int64_t nfn = g->tc_fn;
+  int64_t ofn = g->sfn;
+
+  if (g->pmode == mode && mode == 0 && ofn == nfn) {
+    /* we already sent this frame */
+    return;
+  }
+
+  /* more than one cycle (or 3 frames if that is longer) since the last call */
+  if (   nfn - ofn > 3
+      || mfcnt - g->pfcnt > (g->period > 3 * g->fptcf ? g->period : 3 * g->fptcf)
+      || (nfn - ofn < 1 && mode != 2)
+      ) {
+#if 0 // DEBUG
+    char tcs[12];
+    timecode_time_to_string(tcs, &g->tc_time);
+    printf(" !! RESET %s | pf: %lld nf: %lld\n", tcs, ofn, nfn);
+#endif
+    mode = 0;
+    memcpy(&g->stime, &g->tc_time, sizeof(TimecodeTime));
+    MTCGEN_STAT_INC(g->n_relocate);
+  }
+
+  g->pfcnt = mfcnt;
+  g->pmode = mode;
+
+  if (mode != 2) {
+    if (g->debug) MTCGEN_MSG(g, "sending sysex locate.\n");
+    queue_mtc_sysex(g, &g->stime, g->mtc_tc, mfcnt);
+    memcpy(&g->stime, &g->tc_time, sizeof(TimecodeTime));
+    g->sfn = nfn;
+    return;
+  }
+
+  if (nfn + num <= ofn) {
+    return;
+  }
+
+#if 0 // DEBUG
+  printf("DOIT %lld -> %lld  @ %lld\n", ofn, nfn, mfcnt);
+#endif
+
+  /* frame nfn started tc_acc / num audio-frames before mfcnt,
+   * frame-starts are rounded to the nearest audio-frame */
+  const int64_t rnum = g->framerate.num;
+  const int64_t base = mfcnt * rnum - g->tc_acc + rnum / 2;
+
+  do {
+    if (mtcgen_queue_space(g) < 4) {
+      /* continue with this frame next cycle */
+      MTCGEN_STAT_INC(g->n_overflow);
+      break;
+    }
+    const int64_t x = base + (ofn - nfn) * g->srden;
+    const long long int cfcnt = x >= 0 ? x / rnum : -((rnum - 1 - x) / rnum);
+
+    queue_mtc_quarterframes(g, &g->stime, g->mtc_tc, 0, g->qf_speed, cfcnt);
+
+    mtcgen_time_increment(g, &g->stime);
+    ofn = ++g->sfn;
+  } while (ofn < nfn + num);
+}
+
+/* JACK transport sample-position, video-offset applied */
+static inline int64_t mtcgen_sample_pos(const jack_position_t *pos) {
+  int64_t sample_pos = pos->frame;
+  if (pos->valid & JackVideoFrameOffset) {
+    if (pos->video_offset >= sample_pos) {
+      sample_pos -= pos->video_offset;
+    } else {
+      sample_pos = 0;
+    }
+  }
+  return sample_pos;
+}
+
+/**
+ * queue MTC events for one process cycle and the given transport state,
+ * at 64bit sample-position @sample_pos (jack_position_t.frame wraps
+ * within 24h at high sample-rates), @pos provides the video frame-rate
+ */
+static inline void mtcgen_render_at(MTCGen *g, jack_transport_state_t state, const jack_position_t *pos, int64_t sample_pos, jack_nframes_t nframes) {
+  TimecodeRate * const framerate = &g->framerate;
+
+  if (g->use_jack_fps && pos->valid & JackAudioVideoRatio) {
+    if (pos->audio_frames_per_video_frame != g->audio_frames_per_video_frame) {
+      g->audio_frames_per_video_frame = pos->audio_frames_per_video_frame;
+      MTCGEN_MSG(g, "new APV: %.2f\n", pos->audio_frames_per_video_frame);
+      switch ((int)floor(g->samplerate/g->audio_frames_per_video_frame)) {
+	case 24:
+	  framerate->num=24; framerate->den=1; framerate->drop=0;
+	  break;
+	case 25:
+	  framerate->num=25; framerate->den=1; framerate->drop=0;
+	  break;
+	case 29:
+	  framerate->num=30000; framerate->den=1001; framerate->drop=1;
+	  break;
+	case 30:
+	  framerate->num=30; framerate->den=1; framerate->drop=0;
+	  break;
+	default:
+	  MTCGEN_MSG(g, "invalid framerate.\n");
+	  break;
+      }
+      // TODO use timecode_strftimecode()
+      MTCGEN_MSG(g, "FPS changed to %.2f%s\n", timecode_rate_to_double(framerate), framerate->drop?"df":"");
+      mtcgen_set_rate(g);
+    }
+  }
+
+  mtcgen_locate(g, sample_pos);
+  const TimecodeTime * const t = &g->tc_time;
+  __atomic_store_n(&g->cur_tc,
+      ((uint64_t)g->fps << 40) | ((uint64_t)1 << 32) | ((uint64_t)t->hour << 24) | (t->minute << 16) | (t->second << 8) | t->frame,
+      __ATOMIC_RELAXED);
+
+  const int ea = ((int64_t) nframes * framerate->num + g->srden - 1) / g->srden;
+
+  switch (state) {
+    case JackTransportStopped:
+      //send sysex-MTC message - if changed
+      generate_mtc(g, g->monotonic_fcnt, 0, g->writeahead + ea);
+      break;
+    case JackTransportStarting:
+#if 0 // jack2 only
+    case JackTransportNetStarting:
+#endif
+      //send sysex-MTC message
+      generate_mtc(g, g->monotonic_fcnt, 1, g->writeahead + ea);
+      break;
+    case JackTransportRolling:
+      // enqueue quarter-frame MTC messages
+      generate_mtc(g, g->monotonic_fcnt, 2, g->writeahead + ea);
+      break;
+    default: /* old JackTransportLooping */
+      break;
+  }
+  g->period = nframes;
+}
+
+/* mtcgen_render_at() for the JACK transport position @pos */
+static inline void mtcgen_render(MTCGen *g, jack_transport_state_t state, const jack_position_t *pos, jack_nframes_t nframes) {
+  mtcgen_render_at(g, state, pos, mtcgen_sample_pos(pos), nframes);
+}
+
+/**
+ * fetch the next queued event that is due in the current cycle,
+ * returns 0 if there is none. Events for a previous cycle are skipped.
+ */
+static inline int mtcgen_pop(MTCGen *g, jack_nframes_t nframes, long long int *mt, const jack_midi_data_t **data, size_t *size) {
+  while (g->queued_events_end != g->queued_events_start) {
+    const int k = g->queued_events_end;
+    *mt = g->ev_time[k] - g->latency;
+    if (*mt >= g->monotonic_fcnt + nframes) {
+      // fprintf(stderr, "DEBUG: MTC timestamp is for next jack cycle.\n"); // XXX
+      return 0;
+    }
+    g->queued_events_end = (g->queued_events_end + 1)%JACK_MIDI_QUEUE_SIZE;
+    if (*mt < g->monotonic_fcnt) {
+      if (g->debug) MTCGEN_MSG(g, "WARNING: MTC was for previous jack cycle (port latency too large?) %lld\n", *mt - g->monotonic_fcnt);
+      MTCGEN_STAT_INC(g->n_late);
+      //fprintf(stderr, "TME: %lld < %lld)\n", *mt, g->monotonic_fcnt); // XXX
+      continue;
+    }
+
+#if 0 // DEBUG quarter frame timing
+    static long long int prev = 0;
+    if (*mt-prev != rint((double)g->samplerate / timecode_rate_to_double(&g->framerate) / 4)) {
+      fprintf(stderr, " QT time %lld != %u\n", *mt-prev, (int) rint((double)g->samplerate / timecode_rate_to_double(&g->framerate) / 4));
+    }
+    prev = *mt;
+#endif
+
+    if (g->ev_data[k][0] == 0xf1) {
+      *data = g->ev_data[k];
+      *size = 2;
+    } else {
+      *data = g->sysex;
+      *size = g->sysex_size;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,215 @@
+/* MTC index lookup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mtcparse.h"
+#include "mtcindex.h"
+
+static int dump = 0;
+
+static int index_map(MTCIndex *x, const char *path) {
+	struct stat st;
+	void *p;
+	const int fd = open(path, O_RDONLY);
+	memset(x, 0, sizeof(MTCIndex));
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "cannot open index file '%s'.\n", path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t) sizeof(mtcindex_header)) {
+		fprintf(stderr, "'%s' is not an MTC index file.\n", path);
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "cannot map index file '%s'.\n", path);
+		return -1;
+	}
+	x->hdr = (const mtcindex_header*) p;
+	x->size = st.st_size;
+	if (memcmp(x->hdr->magic, "MTCINDEX", 8)) {
+		fprintf(stderr, "'%s' is not an MTC index file.\n", path);
+		goto fail;
+	}
+	if (x->hdr->version != MTCINDEX_VERSION || x->hdr->record_size != sizeof(mtcindex_rec)) {
+		fprintf(stderr, "'%s': unsupported version or byte-order.\n", path);
+		goto fail;
+	}
+	x->rec = (const mtcindex_rec*) (x->hdr + 1);
+	/* a partial record may be in the process of being appended */
+	x->n = (st.st_size - sizeof(mtcindex_header)) / sizeof(mtcindex_rec);
+	if (mtcindex_sort(x)) {
+		fprintf(stderr, "cannot allocate the timecode index.\n");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	munmap(p, x->size);
+	memset(x, 0, sizeof(MTCIndex));
+	return -1;
+}
+
+static void print_record(const MTCIndex *x, size_t i) {
+	const mtcindex_rec *r = &x->rec[i];
+	int h, m, s, f;
+	mtcindex_fn2tc(r->type, r->frame, &h, &m, &s, &f);
+	printf("%8zu: %02d:%02d:%02d:%02d [%s] @%lld, %u frames, %.4f spf\n",
+			i, h, m, s, f, MTCTYPE[r->type & 3],
+			(long long) r->sample, r->count, r->spf);
+}
+
+static int query(const MTCIndex *x, const char *q) {
+	int h, m, s, f;
+	char c;
+	if (sscanf(q, "%d%*[:;.]%d%*[:;.]%d%*[:;.]%d%c", &h, &m, &s, &f, &c) == 4) {
+		const long i = mtcindex_find_tc(x, h, m, s, f);
+		if (i < 0) {
+			printf("%02d:%02d:%02d:%02d not found\n", h, m, s, f);
+			return 1;
+		}
+		const mtcindex_rec *r = &x->rec[i];
+		const int32_t fn = mtcindex_tc2fn(r->type, h, m, s, f);
+		printf("%02d:%02d:%02d:%02d [%s] @%lld\n", h, m, s, f, MTCTYPE[r->type & 3],
+				(long long) llrint(r->sample + (fn - r->frame) * r->spf));
+		return 0;
+	}
+
+	char *end;
+	const long long sample = strtoll(q, &end, 10);
+	if (end == q || *end) {
+		fprintf(stderr, "invalid query '%s', expected a timecode or a sample-position.\n", q);
+		return 1;
+	}
+	const long i = mtcindex_find_sample(x, sample);
+	if (i < 0) {
+		printf("@%lld not found\n", sample);
+		return 1;
+	}
+	const mtcindex_rec *r = &x->rec[i];
+	const double pos = (sample - r->sample) / r->spf;
+	const int32_t fn = r->frame + (int32_t) floor(pos);
+	mtcindex_fn2tc(r->type, fn, &h, &m, &s, &f);
+	printf("@%lld %02d:%02d:%02d:%02d [%s] +%.3f\n", sample, h, m, s, f,
+			MTCTYPE[r->type & 3], pos - floor(pos));
+	return 0;
+}
+
+static struct option const long_options[] =
+{
+  {"dump", no_argument, 0, 'd'},
+  {"help", no_argument, 0, 'h'},
+  {"version", no_argument, 0, 'V'},
+  {NULL, 0, NULL, 0}
+};
+
+static void usage (int status) {
+  printf ("mtcindex - MTC index lookup.\n\n");
+  printf ("Usage: mtcindex [ OPTIONS ] <index-file> [ query ... ]\n\n");
+  printf ("Options:\n\
+  -d, --dump                 list all records of the index\n\
+  -h, --help                 display this help and exit\n\
+  -V, --version              print version information and exit\n\
+\n");
+  printf ("\n\
+Look up timecodes in an index file written by 'jmtcdump --index'.\n\
+A query is either a timecode HH:MM:SS:FF, which prints the sample-position\n\
+where that frame started (first occurrence), or a sample-position, which\n\
+prints the timecode at that position and the fraction of the frame.\n\
+Without queries a summary of the index is printed.\n\
+\n");
+  printf ("Report bugs to Robin Gareus <robin@gareus.org>\n"
+          "Website and manual: <https://github.com/x42/mtc-tools>\n"
+	  );
+  exit (status);
+}
+
+static int decode_switches (int argc, char **argv) {
+	int c;
+
+	while ((c = getopt_long (argc, argv,
+			   "d"	/* dump */
+			   "h"	/* help */
+			   "V",	/* version */
+			   long_options, (int *) 0)) != EOF) {
+		switch (c) {
+			case 'd':
+				dump = 1;
+				break;
+			case 'V':
+				printf ("mtcindex version %s\n\n", VERSION);
+				printf ("Copyright (C) GPL 2012 Robin Gareus <robin@gareus.org>\n");
+				exit (0);
+
+			case 'h':
+				usage (0);
+
+			default:
+			  usage (EXIT_FAILURE);
+		}
+	}
+	return optind;
+}
+
+int main (int argc, char ** argv) {
+	MTCIndex x;
+	int i, rv = 0;
+
+	i = decode_switches (argc, argv);
+	if (i >= argc) {
+		usage (EXIT_FAILURE);
+	}
+	if (index_map(&x, argv[i++])) {
+		return 1;
+	}
+
+	if (dump) {
+		size_t k;
+		for (k = 0; k < x.n; ++k) {
+			print_record(&x, k);
+		}
+	} else if (i >= argc) {
+		const time_t created = x.hdr->created;
+		printf("created: %s", ctime(&created));
+		printf("samplerate: %u, %zu records, %zu bytes\n", x.hdr->samplerate, x.n, x.size);
+		if (x.n > 0) {
+			print_record(&x, 0);
+			if (x.n > 1) {
+				print_record(&x, x.n - 1);
+			}
+		}
+	}
+
+	for (; i < argc; ++i) {
+		rv |= query(&x, argv[i]);
+	}
+
+	mtcindex_sort_free(&x);
+	munmap((void*) x.hdr, x.size);
+	return rv;
+}
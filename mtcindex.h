@@ -0,0 +1,304 @@
+/* Timecode to sample-position index
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The index file is a 32 byte header followed by fixed-size records,
+ * host byte-order (the version field doubles as byte-order mark).
+ *
+ * Each record is an anchor: frame-number and the sample-position where
+ * that frame started, the measured samples per frame and the number of
+ * contiguous frames that follow at that rate. Decoded timecodes that
+ * continue the current run within 1/4 frame are merged, a run is
+ * closed on any discontinuity (locate, stop, rate change) and after
+ * MTCINDEX_MAXRUN frames, so the rate tracks slow drift. A continuous
+ * roll takes one record per minute.
+ *
+ * Records are only ever appended, in order of sample-position. Each
+ * also carries the maximum timecode seen so far, which is non-decreasing.
+ * Lookups by sample-position are a binary search on the mmap()ed file;
+ * for lookups by timecode the reader sorts the records' timecode ranges
+ * into a side index (mtcindex_sort()), since the timecode need not be
+ * monotonic (locates, loops).
+ */
+
+#ifndef MTCINDEX_H
+#define MTCINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define MTCINDEX_VERSION (1)
+#define MTCINDEX_MAXRUN (1800) // frames
+
+/* packed timecode, sorts like the timecode independent of framerate */
+#define MTCINDEX_KEY(H, M, S, F) \
+	(((uint32_t)(H) << 24) | ((uint32_t)(M) << 16) | ((uint32_t)(S) << 8) | (uint32_t)(F))
+
+typedef struct {
+	char magic[8];         // "MTCINDEX"
+	uint32_t version;
+	uint32_t samplerate;
+	int64_t created;       // unix time
+	uint32_t record_size;
+	uint32_t reserved;
+} mtcindex_header;
+
+typedef struct {
+	int64_t sample;        // start of @frame
+	double spf;            // samples per frame
+	int32_t frame;         // frame-number since 00:00:00:00
+	uint32_t count;        // contiguous frames
+	uint32_t kmax;         // max. timecode key of this and all previous records
+	uint8_t type;          // MTC type 0..3: 24, 25, 30df, 30 fps
+	uint8_t reserved[3];
+} mtcindex_rec;
+
+static const int mtcindex_fps[4] = { 24, 25, 30, 30 };
+
+/************************************************
+ * timecode <> frame-number
+ */
+
+static inline int32_t mtcindex_tc2fn(int type, int h, int m, int s, int f) {
+	const int fps = mtcindex_fps[type & 3];
+	const int32_t mins = h * 60 + m;
+	int32_t fn = ((int32_t)mins * 60 + s) * fps + f;
+	if (type == 2) {
+		fn -= 2 * (mins - mins / 10);
+	}
+	return fn;
+}
+
+static inline void mtcindex_fn2tc(int type, int32_t fn, int *h, int *m, int *s, int *f) {
+	const int fps = mtcindex_fps[type & 3];
+	if (type == 2) {
+		const int32_t d = fn / 17982, r = fn % 17982;
+		fn += 18 * d + (r > 1 ? 2 * ((r - 2) / 1798) : 0);
+	}
+	*f = fn % fps;
+	fn /= fps;
+	*s = fn % 60;
+	fn /= 60;
+	*m = fn % 60;
+	*h = (fn / 60) % 24;
+}
+
+static inline uint32_t mtcindex_key(int type, int32_t fn) {
+	int h, m, s, f;
+	mtcindex_fn2tc(type, fn, &h, &m, &s, &f);
+	return MTCINDEX_KEY(h, m, s, f);
+}
+
+/************************************************
+ * writer, non-realtime thread
+ */
+
+typedef struct {
+	FILE *f;
+	uint32_t samplerate;
+	int open;
+	mtcindex_rec run;
+	int32_t last_fn;
+	uint32_t kmax;
+	uint64_t n_records;
+} MTCIndexWriter;
+
+static inline int mtcindex_create(MTCIndexWriter *w, const char *path, uint32_t samplerate) {
+	mtcindex_header hdr;
+	memset(w, 0, sizeof(MTCIndexWriter));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "MTCINDEX", 8);
+	hdr.version = MTCINDEX_VERSION;
+	hdr.samplerate = samplerate;
+	hdr.created = time(NULL);
+	hdr.record_size = sizeof(mtcindex_rec);
+	if (!(w->f = fopen(path, "wb"))) {
+		fprintf(stderr, "cannot create index file '%s'.\n", path);
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1 || fflush(w->f)) {
+		fprintf(stderr, "cannot write index file '%s'.\n", path);
+		fclose(w->f);
+		w->f = NULL;
+		return -1;
+	}
+	w->samplerate = samplerate;
+	return 0;
+}
+
+static inline void mtcindex_flush(MTCIndexWriter *w) {
+	if (!w->open) {
+		return;
+	}
+	w->open = 0;
+	/* the last QF sequence also covered the following frame */
+	w->run.count = w->last_fn - w->run.frame + 2;
+	const uint32_t k = mtcindex_key(w->run.type, w->run.frame + w->run.count - 1);
+	if (k > w->kmax) w->kmax = k;
+	w->run.kmax = w->kmax;
+	if (fwrite(&w->run, sizeof(mtcindex_rec), 1, w->f) == 1) {
+		++w->n_records;
+	}
+	fflush(w->f);
+}
+
+/* timecode @fn decoded, its frame started at sample @sample */
+static inline void mtcindex_add(MTCIndexWriter *w, int type, int32_t fn, int64_t sample) {
+	if (!w->f) {
+		return;
+	}
+	if (w->open && type == w->run.type && fn > w->last_fn && fn - w->last_fn <= 8
+			&& fn - w->run.frame < MTCINDEX_MAXRUN) {
+		const double predict = w->run.sample + (fn - w->run.frame) * w->run.spf;
+		if (fabs(sample - predict) <= w->run.spf / 4) {
+			w->run.spf = (sample - w->run.sample) / (double)(fn - w->run.frame);
+			w->last_fn = fn;
+			return;
+		}
+	}
+	mtcindex_flush(w);
+	memset(&w->run, 0, sizeof(mtcindex_rec));
+	w->run.sample = sample;
+	w->run.frame = fn;
+	w->run.type = type;
+	w->run.spf = type == 2 ? w->samplerate * 1001.0 / 30000.0 : w->samplerate / (double) mtcindex_fps[type & 3];
+	w->last_fn = fn;
+	w->open = 1;
+}
+
+static inline void mtcindex_close(MTCIndexWriter *w) {
+	if (!w->f) {
+		return;
+	}
+	mtcindex_flush(w);
+	fclose(w->f);
+	w->f = NULL;
+}
+
+/************************************************
+ * lookup
+ */
+
+/* timecode range of a record */
+typedef struct {
+	uint32_t kfirst;
+	uint32_t klast;
+	uint32_t kmax;         // max. klast of this and all previous entries
+	uint32_t rec;          // record index
+} mtcindex_range;
+
+typedef struct {
+	const mtcindex_header *hdr;
+	const mtcindex_rec *rec;
+	size_t n;
+	size_t size; // of the mapping
+	mtcindex_range *by_tc; // sorted by kfirst, mtcindex_sort()
+} MTCIndex;
+
+static inline int mtcindex_range_cmp(const void *a, const void *b) {
+	const mtcindex_range *x = (const mtcindex_range*) a;
+	const mtcindex_range *y = (const mtcindex_range*) b;
+	if (x->kfirst != y->kfirst) {
+		return x->kfirst < y->kfirst ? -1 : 1;
+	}
+	return x->rec < y->rec ? -1 : (x->rec > y->rec);
+}
+
+/* build the timecode side index of the @x->n records */
+static inline int mtcindex_sort(MTCIndex *x) {
+	size_t i;
+	uint32_t kmax = 0;
+	free(x->by_tc);
+	if (!(x->by_tc = (mtcindex_range*) malloc((x->n + 1) * sizeof(mtcindex_range)))) {
+		return -1;
+	}
+	for (i = 0; i < x->n; ++i) {
+		const mtcindex_rec *r = &x->rec[i];
+		mtcindex_range *e = &x->by_tc[i];
+		e->kfirst = mtcindex_key(r->type, r->frame);
+		e->klast = mtcindex_key(r->type, r->frame + (r->count > 0 ? r->count - 1 : 0));
+		e->rec = i;
+	}
+	qsort(x->by_tc, x->n, sizeof(mtcindex_range), mtcindex_range_cmp);
+	for (i = 0; i < x->n; ++i) {
+		if (x->by_tc[i].klast > kmax) kmax = x->by_tc[i].klast;
+		x->by_tc[i].kmax = kmax;
+	}
+	return 0;
+}
+
+static inline void mtcindex_sort_free(MTCIndex *x) {
+	free(x->by_tc);
+	x->by_tc = NULL;
+}
+
+/* index of the record that contains @sample, or -1 */
+static inline long mtcindex_find_sample(const MTCIndex *x, int64_t sample) {
+	size_t lo = 0, hi = x->n;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (x->rec[mid].sample <= sample) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return -1;
+	}
+	const mtcindex_rec *r = &x->rec[lo - 1];
+	if (sample >= r->sample + r->count * r->spf) {
+		return -1;
+	}
+	return lo - 1;
+}
+
+/* first record that contains timecode @key, or -1; needs mtcindex_sort().
+ * The ranges that start at or before @key are visited backwards until no
+ * earlier one reaches @key. Runs are limited to MTCINDEX_MAXRUN frames,
+ * so that is O(log n) plus the records of the last minute or so of
+ * timecode before @key. */
+static inline long mtcindex_find_tc(const MTCIndex *x, int h, int m, int s, int f) {
+	const uint32_t key = MTCINDEX_KEY(h, m, s, f);
+	size_t lo = 0, hi = x->n;
+	long found = -1;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (x->by_tc[mid].kfirst <= key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	while (lo > 0 && x->by_tc[lo - 1].kmax >= key) {
+		const mtcindex_range *e = &x->by_tc[--lo];
+		if (e->klast < key || (found >= 0 && e->rec > (uint32_t) found)) {
+			continue;
+		}
+		const mtcindex_rec *r = &x->rec[e->rec];
+		const int32_t fn = mtcindex_tc2fn(r->type, h, m, s, f);
+		/* and the timecode exists at the record's rate */
+		if (fn >= r->frame && fn < r->frame + (int32_t)r->count && mtcindex_key(r->type, fn) == key) {
+			found = e->rec;
+		}
+	}
+	return found;
+}
+
+#endif
@@ -0,0 +1,199 @@
+/* MTC round-trip latency measurement
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Quarter-frames written to the output port are remembered with their
+ * (monotonic) sample-time. Every quarter-frame that arrives on the
+ * input port is matched by value against the oldest pending ones;
+ * skipped entries count as lost. Since a QF byte can repeat after
+ * 8 messages (two video-frames), the round-trip must be shorter than
+ * that for the match to be unambiguous.
+ *
+ * The process thread passes latencies through a ringbuffer, the
+ * statistics (1-sample resolution histogram) are kept by the
+ * non-realtime thread.
+ */
+
+#ifndef MTCLOOP_H
+#define MTCLOOP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "jackio.h"
+
+#define MTCLOOP_PENDING (256)
+#define MTCLOOP_HIST (65536) // max. latency with 1 sample resolution
+
+typedef struct {
+	uint8_t data;
+	uint64_t tme;
+} mtcloop_qf;
+
+typedef struct {
+	/* process thread */
+	mtcloop_qf pending[MTCLOOP_PENDING];
+	unsigned int p_head; // next write
+	unsigned int p_tail; // oldest pending
+	jack_ringbuffer_t *rb;
+	uint64_t lost;       // relaxed atomics
+	uint64_t unmatched;
+	uint64_t dropped;
+
+	/* non-realtime statistics */
+	uint32_t samplerate;
+	uint32_t *hist;
+	uint64_t overflow;
+	uint64_t n;
+	double sum;
+	int64_t min;
+	int64_t max;
+} MTCLoop;
+
+static inline int mtcloop_init(MTCLoop *l, uint32_t samplerate) {
+	memset(l, 0, sizeof(MTCLoop));
+	l->samplerate = samplerate;
+	l->hist = calloc(MTCLOOP_HIST, sizeof(uint32_t)); // non-RT only, not locked
+	l->rb = rtmem_ringbuffer(4096 * sizeof(int64_t));
+	if (!l->hist || !l->rb) {
+		return -1;
+	}
+	return 0;
+}
+
+static inline void mtcloop_free(MTCLoop *l) {
+	free(l->hist);
+	l->hist = NULL;
+	rtmem_ringbuffer_free(l->rb);
+	l->rb = NULL;
+}
+
+/************************************************
+ * process thread
+ */
+
+static inline void mtcloop_sent(MTCLoop *l, uint8_t data, uint64_t tme) {
+	if (l->p_head - l->p_tail >= MTCLOOP_PENDING) {
+		++l->p_tail;
+		JIO_RELAXED_ADD(l->lost, 1);
+	}
+	mtcloop_qf *q = &l->pending[l->p_head % MTCLOOP_PENDING];
+	q->data = data;
+	q->tme = tme;
+	++l->p_head;
+}
+
+/* returns 1 if a pending QF was matched */
+static inline int mtcloop_received(MTCLoop *l, uint8_t data, uint64_t tme) {
+	unsigned int k;
+	/* expire QFs that were never received */
+	while (l->p_tail != l->p_head && l->pending[l->p_tail % MTCLOOP_PENDING].tme + MTCLOOP_HIST <= tme) {
+		++l->p_tail;
+		JIO_RELAXED_ADD(l->lost, 1);
+	}
+	for (k = l->p_tail; k != l->p_head; ++k) {
+		const mtcloop_qf *q = &l->pending[k % MTCLOOP_PENDING];
+		if (q->data != data || q->tme > tme) continue;
+		const int64_t latency = tme - q->tme;
+		if (k != l->p_tail) {
+			JIO_RELAXED_ADD(l->lost, k - l->p_tail);
+		}
+		l->p_tail = k + 1;
+		if (jack_ringbuffer_write_space(l->rb) >= sizeof(int64_t)) {
+			jack_ringbuffer_write(l->rb, (const char*) &latency, sizeof(int64_t));
+		} else {
+			JIO_RELAXED_ADD(l->dropped, 1);
+		}
+		return 1;
+	}
+	JIO_RELAXED_ADD(l->unmatched, 1);
+	return 0;
+}
+
+/* QFs in a MIDI port-buffer, @tme: sample-time of the cycle start */
+static inline int mtcloop_scan(MTCLoop *l, void *buf, uint64_t tme, int output) {
+	const int nevents = jio_midi_get_event_count(buf);
+	int n, rv = 0;
+	for (n = 0; n < nevents; ++n) {
+		jack_midi_event_t ev;
+		if (jio_midi_event_get(&ev, buf, n)) continue;
+		if (ev.size != 2 || ev.buffer[0] != 0xf1) continue;
+		if (output) {
+			mtcloop_sent(l, ev.buffer[1], tme + ev.time);
+		} else {
+			rv |= mtcloop_received(l, ev.buffer[1], tme + ev.time);
+		}
+	}
+	return rv;
+}
+
+/************************************************
+ * non-realtime thread
+ */
+
+static inline void mtcloop_collect(MTCLoop *l) {
+	int64_t latency;
+	while (jack_ringbuffer_read_space(l->rb) >= sizeof(int64_t)) {
+		jack_ringbuffer_read(l->rb, (char*) &latency, sizeof(int64_t));
+		if (l->n == 0 || latency < l->min) l->min = latency;
+		if (l->n == 0 || latency > l->max) l->max = latency;
+		++l->n;
+		l->sum += latency;
+		if (latency < MTCLOOP_HIST) {
+			++l->hist[latency];
+		} else {
+			++l->overflow;
+		}
+	}
+}
+
+static inline int64_t mtcloop_percentile(const MTCLoop *l, double p) {
+	const uint64_t want = ceil(l->n * p);
+	uint64_t cnt = 0;
+	int64_t k;
+	for (k = 0; k < MTCLOOP_HIST; ++k) {
+		cnt += l->hist[k];
+		if (cnt >= want) return k;
+	}
+	return l->max;
+}
+
+static inline void mtcloop_print(MTCLoop *l, FILE *f) {
+	mtcloop_collect(l);
+	const double us = 1e6 / l->samplerate;
+	const uint64_t lost = __atomic_load_n(&l->lost, __ATOMIC_RELAXED);
+	const uint64_t unmatched = __atomic_load_n(&l->unmatched, __ATOMIC_RELAXED);
+	const uint64_t dropped = __atomic_load_n(&l->dropped, __ATOMIC_RELAXED);
+
+	fprintf(f, "round-trip: %llu QFs, lost: %llu, unmatched: %llu, not counted: %llu\n",
+			(unsigned long long) l->n, (unsigned long long) lost,
+			(unsigned long long) unmatched, (unsigned long long) dropped);
+	if (l->n == 0) {
+		fflush(f);
+		return;
+	}
+	const double mean = l->sum / l->n;
+	const int64_t p99 = mtcloop_percentile(l, .99);
+	fprintf(f, "  latency [spl]: min %lld mean %.1f p99 %lld max %lld\n",
+			(long long) l->min, mean, (long long) p99, (long long) l->max);
+	fprintf(f, "  latency  [us]: min %.1f mean %.1f p99 %.1f max %.1f, jitter (max-min) %.1f\n",
+			l->min * us, mean * us, p99 * us, l->max * us, (l->max - l->min) * us);
+	fflush(f);
+}
+
+#endif
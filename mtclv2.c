@@ -0,0 +1,420 @@
+/* MTC generator and decoder LV2 plugins
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* The plugins run jmtcgen's generator (mtcgencore.h) and jmtcdump's parser
+ * (mtcparse.h) inside the host, all state is per instance.
+ *
+ * The generator follows the host transport: time:frame and time:speed
+ * of the time:Position objects on its control input. A position that
+ * arrives within a cycle splits the cycle there. While the host is
+ * stopped (or plays backwards) a full-frame message is sent whenever the
+ * position changes, like jmtcgen does. Other speeds are applied like
+ * jmtcgen's internal clock does: the generator runs at a sample-rate
+ * scaled by 1/speed, so the quarter-frames follow the host's varispeed.
+ *
+ * The decoder writes the last complete timecode, quarter-frames or
+ * full-frame, to control outputs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/time/time.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+
+#include "mtcgencore.h"
+#include "mtcparse.h"
+
+#define MTC_URI "http://gareus.org/oss/lv2/mtc#"
+
+#define GEN_MIN_SPEED (.01) // slower is stopped
+#define GEN_MAX_SPEED (100)
+
+typedef struct {
+	LV2_URID atom_Blank;
+	LV2_URID atom_Object;
+	LV2_URID atom_Sequence;
+	LV2_URID atom_Int;
+	LV2_URID atom_Long;
+	LV2_URID atom_Float;
+	LV2_URID atom_Double;
+	LV2_URID midi_MidiEvent;
+	LV2_URID time_Position;
+	LV2_URID time_frame;
+	LV2_URID time_speed;
+} MTCURIs;
+
+static int map_uris(const LV2_Feature * const *features, MTCURIs *u) {
+	LV2_URID_Map *map = NULL;
+	int i;
+	for (i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_URID__map)) {
+			map = (LV2_URID_Map*) features[i]->data;
+		}
+	}
+	if (!map) {
+		return -1;
+	}
+	u->atom_Blank     = map->map(map->handle, LV2_ATOM__Blank);
+	u->atom_Object    = map->map(map->handle, LV2_ATOM__Object);
+	u->atom_Sequence  = map->map(map->handle, LV2_ATOM__Sequence);
+	u->atom_Int       = map->map(map->handle, LV2_ATOM__Int);
+	u->atom_Long      = map->map(map->handle, LV2_ATOM__Long);
+	u->atom_Float     = map->map(map->handle, LV2_ATOM__Float);
+	u->atom_Double    = map->map(map->handle, LV2_ATOM__Double);
+	u->midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+	u->time_Position  = map->map(map->handle, LV2_TIME__Position);
+	u->time_frame     = map->map(map->handle, LV2_TIME__frame);
+	u->time_speed     = map->map(map->handle, LV2_TIME__speed);
+	return 0;
+}
+
+/* numeric atom, @v is unchanged otherwise */
+static void atom_number(const MTCURIs *u, const LV2_Atom *a, double *v) {
+	if (!a) return;
+	if (a->type == u->atom_Long)        *v = ((const LV2_Atom_Long*) a)->body;
+	else if (a->type == u->atom_Int)    *v = ((const LV2_Atom_Int*) a)->body;
+	else if (a->type == u->atom_Float)  *v = ((const LV2_Atom_Float*) a)->body;
+	else if (a->type == u->atom_Double) *v = ((const LV2_Atom_Double*) a)->body;
+}
+
+/************************************************
+ * generator
+ */
+
+typedef enum {
+	GEN_CONTROL = 0,
+	GEN_MIDIOUT,
+	GEN_FPS,
+} GenPort;
+
+typedef struct {
+	/* ports */
+	const LV2_Atom_Sequence *control;
+	LV2_Atom_Sequence *midiout;
+	const float *p_fps;
+
+	MTCURIs uris;
+	MTCGen gen;
+	int fps;            // MTC type of the current rate
+	double rate;        // host sample-rate
+
+	/* host transport */
+	bool have_pos;
+	double frame;
+	double speed;
+
+	/* output sequence of the current cycle */
+	uint32_t capacity;
+} MTCGenLV2;
+
+static void gen_set_fps(MTCGenLV2 *self, int fps) {
+	MTCGen *g = &self->gen;
+	switch (fps) {
+		case 0:  g->framerate = *timecode_FPS24; break;
+		case 2:  g->framerate = *timecode_FPS2997DF; break;
+		case 3:  g->framerate = *timecode_FPS30; break;
+		default: g->framerate = *timecode_FPS25; fps = 1; break;
+	}
+	self->fps = fps;
+	mtcgen_set_rate(g);
+}
+
+static LV2_Handle gen_instantiate(const LV2_Descriptor *descriptor, double rate, const char *bundle_path, const LV2_Feature * const *features) {
+	MTCGenLV2 *self = (MTCGenLV2*) calloc(1, sizeof(MTCGenLV2));
+	if (!self) {
+		return NULL;
+	}
+	if (map_uris(features, &self->uris)) {
+		free(self);
+		return NULL;
+	}
+	self->rate = rate;
+	mtcgen_init(&self->gen, rate);
+	gen_set_fps(self, 1);
+	return (LV2_Handle) self;
+}
+
+static void gen_connect_port(LV2_Handle instance, uint32_t port, void *data) {
+	MTCGenLV2 *self = (MTCGenLV2*) instance;
+	switch ((GenPort) port) {
+		case GEN_CONTROL: self->control = (const LV2_Atom_Sequence*) data; break;
+		case GEN_MIDIOUT: self->midiout = (LV2_Atom_Sequence*) data; break;
+		case GEN_FPS:     self->p_fps = (const float*) data; break;
+	}
+}
+
+static void gen_activate(LV2_Handle instance) {
+	MTCGenLV2 *self = (MTCGenLV2*) instance;
+	const int fps = self->fps;
+	mtcgen_init(&self->gen, self->rate);
+	gen_set_fps(self, fps);
+	self->have_pos = false;
+}
+
+static void gen_midi_write(MTCGenLV2 *self, int64_t time, const jack_midi_data_t *data, size_t size) {
+	LV2_Atom_Sequence *seq = self->midiout;
+	LV2_Atom_Event *ev = lv2_atom_sequence_end(&seq->body, seq->atom.size);
+	const uint32_t used = (const uint8_t*) ev - (const uint8_t*) &seq->body;
+	if (used + sizeof(LV2_Atom_Event) + size > self->capacity) {
+		return;
+	}
+	ev->time.frames = time;
+	ev->body.type = self->uris.midi_MidiEvent;
+	ev->body.size = size;
+	memcpy(ev + 1, data, size);
+	seq->atom.size += lv2_atom_pad_size(sizeof(LV2_Atom_Event) + size);
+}
+
+/* render @n samples at offset @off of the cycle */
+static void gen_render(MTCGenLV2 *self, uint32_t off, uint32_t n) {
+	MTCGen *g = &self->gen;
+	const jack_midi_data_t *data;
+	jack_position_t pos;
+	long long int mt;
+	size_t size;
+
+	if (n == 0) {
+		return;
+	}
+	if (!self->have_pos) {
+		g->monotonic_fcnt += n;
+		return;
+	}
+
+	/* generator samples are host samples scaled by 1/speed */
+	const int rolling = self->speed >= GEN_MIN_SPEED;
+	const double speed = rolling ? fmin(self->speed, GEN_MAX_SPEED) : 1.0;
+	const uint32_t samplerate = rint(self->rate / speed);
+	if (samplerate != g->samplerate) {
+		g->samplerate = samplerate;
+		mtcgen_set_rate(g);
+	}
+
+	memset(&pos, 0, sizeof(jack_position_t));
+	pos.frame_rate = g->samplerate;
+
+	mtcgen_render_at(g, rolling ? JackTransportRolling : JackTransportStopped, &pos,
+			self->frame > 0 ? llrint(self->frame / speed) : 0, n);
+	while (mtcgen_pop(g, n, &mt, &data, &size)) {
+		gen_midi_write(self, off + (mt - g->monotonic_fcnt), data, size);
+		if (size == 2) {
+			MTCGEN_STAT_INC(g->n_qf);
+		} else {
+			MTCGEN_STAT_INC(g->n_sysex);
+		}
+	}
+	g->monotonic_fcnt += n;
+
+	if (rolling) {
+		self->frame += n * speed;
+	}
+}
+
+static void gen_run(LV2_Handle instance, uint32_t n_samples) {
+	MTCGenLV2 *self = (MTCGenLV2*) instance;
+	const MTCURIs *u = &self->uris;
+	uint32_t off = 0;
+
+	const int fps = self->p_fps ? (int) rintf(*self->p_fps) : 1;
+	if (fps != self->fps) {
+		gen_set_fps(self, fps);
+	}
+
+	self->capacity = self->midiout->atom.size;
+	self->midiout->atom.type = u->atom_Sequence;
+	self->midiout->atom.size = sizeof(LV2_Atom_Sequence_Body);
+	self->midiout->body.unit = 0;
+	self->midiout->body.pad = 0;
+
+	LV2_ATOM_SEQUENCE_FOREACH(self->control, ev) {
+		const LV2_Atom_Object *obj = (const LV2_Atom_Object*) &ev->body;
+		const LV2_Atom *frame = NULL, *speed = NULL;
+		if ((ev->body.type != u->atom_Object && ev->body.type != u->atom_Blank)
+				|| obj->body.otype != u->time_Position) {
+			continue;
+		}
+		const uint32_t at = ev->time.frames < n_samples ? ev->time.frames : n_samples;
+		if (at > off) {
+			gen_render(self, off, at - off);
+			off = at;
+		}
+		lv2_atom_object_get(obj, u->time_frame, &frame, u->time_speed, &speed, 0);
+		atom_number(u, frame, &self->frame);
+		atom_number(u, speed, &self->speed);
+		self->have_pos = self->have_pos || frame;
+	}
+	gen_render(self, off, n_samples - off);
+}
+
+static void gen_cleanup(LV2_Handle instance) {
+	free(instance);
+}
+
+/************************************************
+ * decoder
+ */
+
+typedef enum {
+	DEC_MIDIIN = 0,
+	DEC_HOUR,
+	DEC_MINUTE,
+	DEC_SECOND,
+	DEC_FRAME,
+	DEC_FPS,
+	DEC_LOCKED,
+} DecPort;
+
+typedef struct {
+	/* ports */
+	const LV2_Atom_Sequence *midiin;
+	float *p_out[6];    // DEC_HOUR .. DEC_LOCKED
+
+	MTCURIs uris;
+	MTCParser mtc;
+	uint32_t samplerate;
+
+	/* last complete timecode */
+	bool have_tc;
+	MTCTime tc;
+	int64_t age;        // samples since the last quarter-frame timecode
+} MTCDecLV2;
+
+static LV2_Handle dec_instantiate(const LV2_Descriptor *descriptor, double rate, const char *bundle_path, const LV2_Feature * const *features) {
+	MTCDecLV2 *self = (MTCDecLV2*) calloc(1, sizeof(MTCDecLV2));
+	if (!self) {
+		return NULL;
+	}
+	if (map_uris(features, &self->uris)) {
+		free(self);
+		return NULL;
+	}
+	self->samplerate = rate;
+	return (LV2_Handle) self;
+}
+
+static void dec_connect_port(LV2_Handle instance, uint32_t port, void *data) {
+	MTCDecLV2 *self = (MTCDecLV2*) instance;
+	if (port == DEC_MIDIIN) {
+		self->midiin = (const LV2_Atom_Sequence*) data;
+	} else if (port <= DEC_LOCKED) {
+		self->p_out[port - DEC_HOUR] = (float*) data;
+	}
+}
+
+static void dec_activate(LV2_Handle instance) {
+	MTCDecLV2 *self = (MTCDecLV2*) instance;
+	memset(&self->mtc, 0, sizeof(MTCParser));
+	self->have_tc = false;
+	self->age = INT64_MAX / 2;
+}
+
+static void dec_run(LV2_Handle instance, uint32_t n_samples) {
+	MTCDecLV2 *self = (MTCDecLV2*) instance;
+	const MTCURIs *u = &self->uris;
+
+	LV2_ATOM_SEQUENCE_FOREACH(self->midiin, ev) {
+		const uint8_t *msg = (const uint8_t*) (ev + 1);
+		if (ev->body.type != u->midi_MidiEvent) {
+			continue;
+		}
+		if (ev->body.size == 2 && msg[0] == 0xf1) {
+			if (parse_timecode(&self->mtc, msg[1])) {
+				self->tc = self->mtc.tc;
+				self->have_tc = true;
+				self->age = -(int64_t) ev->time.frames;
+			}
+		} else if (ev->body.size == 10 && msg[0] == 0xf0 && msg[1] == 0x7f
+				&& msg[3] == 0x01 && msg[4] == 0x01 && msg[9] == 0xf7) {
+			/* full-frame (locate) */
+			self->tc.hour  = msg[5] & 0x1f;
+			self->tc.type  = (msg[5] >> 5) & 3;
+			self->tc.min   = msg[6];
+			self->tc.sec   = msg[7];
+			self->tc.frame = msg[8];
+			self->have_tc = true;
+			self->age = INT64_MAX / 2;
+			self->mtc.full_tc = 0;
+		}
+	}
+	self->age += n_samples;
+
+	if (!self->have_tc) {
+		int i;
+		for (i = 0; i < 6; ++i) {
+			if (self->p_out[i]) *self->p_out[i] = 0;
+		}
+		return;
+	}
+	/* quarter-frames arrive at 96..120 Hz */
+	const float locked = self->age < self->samplerate / 4 ? 1 : 0;
+	if (self->p_out[0]) *self->p_out[0] = self->tc.hour;
+	if (self->p_out[1]) *self->p_out[1] = self->tc.min;
+	if (self->p_out[2]) *self->p_out[2] = self->tc.sec;
+	if (self->p_out[3]) *self->p_out[3] = self->tc.frame;
+	if (self->p_out[4]) *self->p_out[4] = expected_tme[self->tc.type];
+	if (self->p_out[5]) *self->p_out[5] = locked;
+}
+
+static void dec_cleanup(LV2_Handle instance) {
+	free(instance);
+}
+
+/************************************************
+ * LV2 descriptors
+ */
+
+static const void *extension_data(const char *uri) {
+	return NULL;
+}
+
+static const LV2_Descriptor descriptors[] = {
+	{
+		MTC_URI "generator",
+		gen_instantiate,
+		gen_connect_port,
+		gen_activate,
+		gen_run,
+		NULL,
+		gen_cleanup,
+		extension_data
+	},
+	{
+		MTC_URI "decoder",
+		dec_instantiate,
+		dec_connect_port,
+		dec_activate,
+		dec_run,
+		NULL,
+		dec_cleanup,
+		extension_data
+	},
+};
+
+LV2_SYMBOL_EXPORT
+const LV2_Descriptor *lv2_descriptor(uint32_t index) {
+	if (index < sizeof(descriptors) / sizeof(LV2_Descriptor)) {
+		return &descriptors[index];
+	}
+	return NULL;
+}
@@ -0,0 +1,96 @@
+/* MTC quarter-frame parser
+ *
+ * (C) 2006, 2012  Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef MTCPARSE_H
+#define MTCPARSE_H
+
+static const char MTCTYPE[4][10] = {
+	"24fps",
+	"25fps",
+	"29fps",
+	"30fps",
+};
+
+static const double expected_tme[4] = {
+	24, 25, 30000.0/1001.0, 30
+};
+
+typedef struct {
+	int frame;
+	int sec;
+	int min;
+	int hour;
+
+	int type;
+	int tick;
+} MTCTime;
+
+/* per input-stream decoder state */
+typedef struct {
+	MTCTime tc;
+	int full_tc;
+	int have_first_full;
+} MTCParser;
+
+/************************************************
+ * parse MTC message data
+ */
+
+#define SE(ARG) mtc->tc.tick=ARG; mtc->full_tc|=1<<(ARG);
+#define SL(ARG) ARG = ( ARG &(~0xf)) | (data&0xf);
+#define SH(ARG) ARG = ( ARG &(~0xf0)) | ((data&0xf)<<4);
+
+/* returns 1 when a complete timecode has been received */
+static inline int parse_timecode(MTCParser *mtc, int data) {
+	int rv = 0;
+	switch (data>>4) {
+		case 0x0: // #0000 frame LSN
+			SE(1); SL(mtc->tc.frame); break;
+		case 0x1: // #0001 frame MSN
+			SE(2); SH(mtc->tc.frame); break;
+		case 0x2: // #0010 sec LSN
+			SE(3); SL(mtc->tc.sec); break;
+		case 0x3: // #0011 sec MSN
+			SE(4); SH(mtc->tc.sec); break;
+		case 0x4: // #0100 min LSN
+			SE(5); SL(mtc->tc.min); break;
+		case 0x5: // #0101 min MSN
+			SE(6); SH(mtc->tc.min); break;
+		case 0x6: // #0110 hour LSN
+			SE(7); SL(mtc->tc.hour); break;
+		case 0x7: // #0111 hour MSN and type
+			SE(0);mtc->tc.hour= (mtc->tc.hour&(~0xf0)) | ((data&1)<<4);
+			mtc->tc.type = (data>>1)&3;
+			if (mtc->full_tc!=0xff) break;
+#if 0
+			printf("->- %02i:%02i:%02i.%02i[%s]\n",mtc->tc.hour,mtc->tc.min,mtc->tc.sec,mtc->tc.frame,MTCTYPE[mtc->tc.type]);
+#endif
+			mtc->full_tc = 0; rv = 1; mtc->have_first_full = 1;
+		default:
+			;
+	}
+	return rv;
+}
+
+#undef SE
+#undef SL
+#undef SH
+
+#endif
@@ -0,0 +1,480 @@
+/* Pipelined MTC generation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Once the transport has been rolling steadily for a few cycles, the
+ * process thread hands a copy of its generator to a helper thread. The
+ * helper predicts the transport (rolling, one period per cycle) and
+ * renders timestamped events some periods ahead into a single-producer,
+ * single-consumer ringbuffer.
+ *
+ * The process thread keeps generating inline until the ring covers the
+ * next cycle, then it only checks that the transport matches the
+ * prediction and copies due events to the port. A locate, state, period,
+ * latency or video-offset change (or a helper that falls behind) cancels
+ * the prediction and the process thread generates inline again. Each
+ * cycle in the ring starts with the helper's quarter-frame sequence
+ * state, the inline generator resumes from it: the QF stream continues
+ * unless the transport itself relocated. The helper's late and overflow
+ * counts are folded into the generator's statistics the same way.
+ *
+ * Handoff: an odd epoch asks the helper to render from @snap, an even one
+ * to stop. @snap is only written while the helper is stopped and has
+ * acknowledged the epoch. Ring entries are tagged with the epoch they
+ * were rendered for, stale ones are skipped.
+ */
+
+#ifndef MTCPIPE_H
+#define MTCPIPE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "jackio.h"
+#include "mtcgen.h"
+
+#define MTCPIPE_RING (4096) // entries, power of two
+
+typedef struct {
+	int64_t time;   // monotonic sample-time, latency compensated
+	uint32_t epoch;
+	uint32_t size;  // 0: start of a cycle
+	union {
+		jack_midi_data_t data[16];
+		struct {                // size 0: the helper at the start of the cycle
+			uint64_t cur_tc;      // METRIC_TC() packed timecode
+			int64_t sfn;          // first frame with quarter-frames still queued, -1: n/a
+			uint64_t n_late;      // statistics since the epoch started
+			uint64_t n_overflow;
+			uint64_t n_relocate;
+			uint8_t qf;           // first quarter-frame of @sfn, 0 or 4
+			uint8_t skip;         // of its four, already sent
+		} cycle;
+		char pad[48];           // power of two entries, they never wrap in the ring
+	};
+} mtcpipe_ev;
+
+typedef struct {
+	/* process thread */
+	MTCGen *gen;
+	int lead;               // periods to render ahead
+	uint32_t epoch;         // odd: rendering
+	int live;               // output is taken from the ring
+	int steady;             // continuous cycles
+	int64_t expect;         // sample-position of the next cycle, video-offset applied
+	jack_nframes_t nframes;
+	jack_nframes_t latency;
+	int valid;
+	jack_nframes_t offset;
+	float apv;
+
+	/* handoff */
+	MTCGen snap;
+	jack_position_t snap_pos;
+	int64_t snap_sample;
+	jack_nframes_t snap_nframes;
+	uint32_t ack;           // helper: last epoch seen
+	int64_t consumed;       // process: start of the next cycle
+	int64_t rendered;       // helper: end of the last rendered cycle
+	jack_ringbuffer_t *rb;
+	uint64_t folded[3];     // process: helper statistics already counted, late, overflow, relocate
+
+	/* helper thread */
+	MTCGen ahead;
+	jack_position_t pos;
+	int64_t sample;         // sample-position of the next cycle
+	jack_nframes_t ahead_nframes;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	volatile int run;
+
+	/* statistics, relaxed atomics */
+	uint64_t n_cycles;      // cycles served from the ring
+	uint64_t n_fallback;    // predictions cancelled by a transport change
+	uint64_t n_underrun;    // predictions cancelled, ring was behind
+} MTCPipe;
+
+/************************************************
+ * helper thread
+ */
+
+/* where the quarter-frame sequence of @g stands: the first frame that
+ * still has queued quarter-frames, its phase and how many of its four
+ * were sent already. A pending full-frame message is sent first, the
+ * inline generator relocates instead. */
+static inline void mtcpipe_seq_state(const MTCGen *g, mtcpipe_ev *ev) {
+	const int pend = (g->queued_events_start - g->queued_events_end + JACK_MIDI_QUEUE_SIZE) % JACK_MIDI_QUEUE_SIZE;
+	const int groups = (pend + 3) / 4;
+	ev->cycle.sfn = -1;
+	if (g->pmode != 2 || g->qf_skip > 0 || (pend > 0 && g->ev_data[g->queued_events_end][0] != 0xf1)) {
+		return;
+	}
+	ev->cycle.sfn = g->sfn - groups;
+	ev->cycle.qf = (groups & 1) ? g->next_quarter_frame_to_send ^ 4 : g->next_quarter_frame_to_send;
+	ev->cycle.skip = groups * 4 - pend;
+}
+
+static inline void mtcpipe_render(MTCPipe *p, uint32_t epoch) {
+	MTCGen *g = &p->ahead;
+	const jack_nframes_t nframes = p->ahead_nframes;
+	const jack_midi_data_t *data;
+	long long int mt;
+	size_t size;
+	mtcpipe_ev ev;
+
+	memset(&ev, 0, sizeof(mtcpipe_ev));
+	ev.epoch = epoch;
+	ev.time = g->monotonic_fcnt;
+	mtcpipe_seq_state(g, &ev);
+	ev.cycle.n_late = g->n_late;
+	ev.cycle.n_overflow = g->n_overflow;
+	ev.cycle.n_relocate = g->n_relocate;
+
+	mtcgen_render_at(g, JackTransportRolling, &p->pos, p->sample, nframes);
+
+	ev.cycle.cur_tc = g->cur_tc;
+	jack_ringbuffer_write(p->rb, (const char*) &ev, sizeof(mtcpipe_ev));
+
+	memset(&ev, 0, sizeof(mtcpipe_ev));
+	ev.epoch = epoch;
+	while (mtcgen_pop(g, nframes, &mt, &data, &size)) {
+		ev.time = mt;
+		ev.size = size;
+		memcpy(ev.data, data, size);
+		jack_ringbuffer_write(p->rb, (const char*) &ev, sizeof(mtcpipe_ev));
+	}
+
+	g->monotonic_fcnt += nframes;
+	p->sample += nframes;
+	__atomic_store_n(&p->rendered, g->monotonic_fcnt, __ATOMIC_RELEASE);
+}
+
+static inline void *mtcpipe_thread(void *arg) {
+	MTCPipe *p = (MTCPipe*) arg;
+	uint32_t epoch = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->run) {
+		const uint32_t e = __atomic_load_n(&p->epoch, __ATOMIC_ACQUIRE);
+		if (e != epoch) {
+			epoch = e;
+			if (epoch & 1) {
+				memcpy(&p->ahead, &p->snap, sizeof(MTCGen));
+				p->ahead.msg = NULL; // not RT-thread
+				p->ahead.n_late = p->ahead.n_overflow = p->ahead.n_relocate = 0;
+				p->pos = p->snap_pos;
+				p->sample = p->snap_sample;
+				p->ahead_nframes = p->snap_nframes;
+			}
+			__atomic_store_n(&p->ack, epoch, __ATOMIC_RELEASE);
+		}
+		if ((epoch & 1)
+				&& p->ahead.monotonic_fcnt < __atomic_load_n(&p->consumed, __ATOMIC_RELAXED) + (int64_t) p->lead * p->ahead_nframes
+				&& jack_ringbuffer_write_space(p->rb) >= (JACK_MIDI_QUEUE_SIZE + 1) * sizeof(mtcpipe_ev)) {
+			mtcpipe_render(p, epoch);
+			continue;
+		}
+		pthread_cond_wait(&p->ready, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/************************************************
+ * process thread
+ */
+
+static inline void mtcpipe_signal(MTCPipe *p) {
+	if (pthread_mutex_trylock(&p->lock) == 0) {
+		pthread_cond_signal(&p->ready);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+/* entry at byte-offset @off of the readable part of the ring */
+static inline const mtcpipe_ev *mtcpipe_at(const jack_ringbuffer_data_t *vec, size_t off) {
+	if (off < vec[0].len) return (const mtcpipe_ev*) (vec[0].buf + off);
+	off -= vec[0].len;
+	if (off < vec[1].len) return (const mtcpipe_ev*) (vec[1].buf + off);
+	return NULL;
+}
+
+/* count the helper's late events, overflows and relocates up to the
+ * start of the cycle @ev; with @base only take them as the baseline */
+static inline void mtcpipe_fold(MTCPipe *p, const mtcpipe_ev *ev, int base) {
+	MTCGen *g = p->gen;
+	if (!base) {
+		JIO_RELAXED_ADD(g->n_late, ev->cycle.n_late - p->folded[0]);
+		JIO_RELAXED_ADD(g->n_overflow, ev->cycle.n_overflow - p->folded[1]);
+		JIO_RELAXED_ADD(g->n_relocate, ev->cycle.n_relocate - p->folded[2]);
+	}
+	p->folded[0] = ev->cycle.n_late;
+	p->folded[1] = ev->cycle.n_overflow;
+	p->folded[2] = ev->cycle.n_relocate;
+}
+
+/* hand the output back to the inline generator at the start of this cycle.
+ * With @seq it continues the helper's quarter-frame sequence, otherwise
+ * (or if there is none) it relocates and starts a new one. */
+static inline void mtcpipe_resume(MTCPipe *p, int seq) {
+	MTCGen *g = p->gen;
+	jack_ringbuffer_data_t vec[2];
+	const mtcpipe_ev *ev;
+	size_t off;
+
+	g->queued_events_end = g->queued_events_start;
+	g->qf_skip = 0;
+
+	jack_ringbuffer_get_read_vector(p->rb, vec);
+	for (off = 0; (ev = mtcpipe_at(vec, off)); off += sizeof(mtcpipe_ev)) {
+		if (ev->epoch == p->epoch && ev->size == 0 && ev->time >= g->monotonic_fcnt) break;
+	}
+	if (ev && ev->time == g->monotonic_fcnt) {
+		mtcpipe_fold(p, ev, 0);
+	}
+	if (!seq || !ev || ev->time != g->monotonic_fcnt || ev->cycle.sfn < 0) {
+		g->next_quarter_frame_to_send = 0;
+		return;
+	}
+
+	g->sfn = ev->cycle.sfn;
+	timecode_framenumber_to_time(&g->stime, &g->framerate, g->sfn);
+	g->next_quarter_frame_to_send = ev->cycle.qf;
+	if (ev->cycle.qf == 4) {
+		/* the sequence started with the previous frame */
+		TimecodeTime t;
+		timecode_framenumber_to_time(&t, &g->framerate, g->sfn - 1);
+		mtcgen_encode_qf(g->qf_seq, &t, g->mtc_tc);
+	}
+	g->qf_skip = ev->cycle.skip;
+	g->pfcnt = g->monotonic_fcnt - p->nframes;
+	g->pmode = 2;
+	g->period = p->nframes;
+}
+
+/* @seq: the transport continues, keep the quarter-frame sequence */
+static inline void mtcpipe_cancel(MTCPipe *p, int seq) {
+	if (p->live) {
+		mtcpipe_resume(p, seq);
+	}
+	__atomic_store_n(&p->epoch, p->epoch + 1, __ATOMIC_RELEASE);
+	p->live = 0;
+	p->steady = 0;
+}
+
+/* generate inline from now on, e.g. while freewheeling (the helper
+ * cannot stay ahead of a process thread that runs as fast as possible) */
+static inline void mtcpipe_stop(MTCPipe *p) {
+	if (p->epoch & 1) {
+		mtcpipe_cancel(p, 1);
+		MTCGEN_STAT_INC(p->n_fallback);
+	}
+	p->steady = 0;
+}
+
+/* bytes before the first entry of the current epoch at or after @end,
+ * -1 if the ring does not reach @end yet */
+static inline ssize_t mtcpipe_reach(MTCPipe *p, const jack_ringbuffer_data_t *vec, int64_t end) {
+	const mtcpipe_ev *ev;
+	size_t off;
+	for (off = 0; (ev = mtcpipe_at(vec, off)); off += sizeof(mtcpipe_ev)) {
+		if (ev->epoch == p->epoch && ev->time >= end) {
+			return off;
+		}
+	}
+	return -1;
+}
+
+/* copy the events of this cycle from the ring to @out */
+static inline int mtcpipe_output(MTCPipe *p, jack_nframes_t nframes, void *out) {
+	MTCGen *g = p->gen;
+	jack_ringbuffer_data_t vec[2];
+	ssize_t n, off;
+
+	jack_ringbuffer_get_read_vector(p->rb, vec);
+	if ((n = mtcpipe_reach(p, vec, g->monotonic_fcnt + nframes)) < 0) {
+		return -1;
+	}
+
+	jio_midi_clear_buffer(out);
+	for (off = 0; off < n; off += sizeof(mtcpipe_ev)) {
+		const mtcpipe_ev *ev = mtcpipe_at(vec, off);
+		if (ev->epoch != p->epoch) {
+			continue;
+		}
+		if (ev->size == 0) {
+			__atomic_store_n(&g->cur_tc, ev->cycle.cur_tc, __ATOMIC_RELAXED);
+			mtcpipe_fold(p, ev, 0);
+		} else if (ev->time < g->monotonic_fcnt) {
+			MTCGEN_STAT_INC(g->n_late);
+		} else if (g->wire) {
+			mtcwire_push(g->wire, ev->time, ev->data, ev->size);
+		} else {
+			mtcgen_write(g, out, ev->time, ev->data, ev->size);
+		}
+	}
+	if (g->wire) {
+		mtcgen_wire_output(g, nframes, out);
+	}
+	jack_ringbuffer_read_advance(p->rb, n);
+	return 0;
+}
+
+/* after an inline cycle: drop what was already sent,
+ * go live once the helper has caught up with the process thread */
+static inline void mtcpipe_prime(MTCPipe *p) {
+	MTCGen *g = p->gen;
+	jack_ringbuffer_data_t vec[2];
+	const mtcpipe_ev *ev;
+	size_t off;
+
+	jack_ringbuffer_get_read_vector(p->rb, vec);
+	for (off = 0; (ev = mtcpipe_at(vec, off)); off += sizeof(mtcpipe_ev)) {
+		if (ev->epoch != p->epoch || ev->size != 0) continue;
+		/* the cycles rendered so far were sent inline */
+		mtcpipe_fold(p, ev, 1);
+		if (ev->time >= g->monotonic_fcnt) break;
+	}
+	if (ev) {
+		/* the helper owns the queue from here on */
+		g->queued_events_end = g->queued_events_start;
+		p->live = 1;
+	}
+	jack_ringbuffer_read_advance(p->rb, off);
+}
+
+static inline int mtcpipe_continuous(const MTCPipe *p, jack_transport_state_t state, const jack_position_t *pos, int64_t sample_pos, jack_nframes_t nframes) {
+	const int valid = pos->valid & (JackVideoFrameOffset | JackAudioVideoRatio);
+	return state == JackTransportRolling
+		&& sample_pos == p->expect
+		&& nframes == p->nframes
+		&& p->gen->latency == p->latency
+		&& valid == p->valid
+		&& (!(valid & JackVideoFrameOffset) || pos->video_offset == p->offset)
+		&& (!(valid & JackAudioVideoRatio) || pos->audio_frames_per_video_frame == p->apv);
+}
+
+/**
+ * process callback, replaces mtcgen_process_at()
+ */
+static inline void mtcpipe_process_at(MTCPipe *p, jack_transport_state_t state, const jack_position_t *pos, int64_t sample_pos, jack_nframes_t nframes, void *out) {
+	MTCGen *g = p->gen;
+	const int continuous = mtcpipe_continuous(p, state, pos, sample_pos, nframes);
+	int done = 0;
+
+	if (p->epoch & 1) {
+		if (!continuous) {
+			mtcpipe_cancel(p, state == JackTransportRolling && sample_pos == p->expect);
+			MTCGEN_STAT_INC(p->n_fallback);
+		} else if (p->live) {
+			if (mtcpipe_output(p, nframes, out) == 0) {
+				g->monotonic_fcnt += nframes;
+				MTCGEN_STAT_INC(p->n_cycles);
+				done = 1;
+			} else {
+				mtcpipe_cancel(p, 1);
+				MTCGEN_STAT_INC(p->n_underrun);
+			}
+		}
+	}
+
+	if (!done) {
+		mtcgen_process_at(g, state, pos, sample_pos, nframes, out);
+		if (p->epoch & 1) {
+			mtcpipe_prime(p);
+		} else if (continuous && ++p->steady >= 2
+				&& __atomic_load_n(&p->ack, __ATOMIC_ACQUIRE) == p->epoch) {
+			memcpy(&p->snap, g, sizeof(MTCGen));
+			p->snap_pos = *pos;
+			p->snap_sample = sample_pos + nframes;
+			p->snap_nframes = nframes;
+			__atomic_store_n(&p->epoch, p->epoch + 1, __ATOMIC_RELEASE);
+		} else if (!continuous) {
+			p->steady = 0;
+		}
+	}
+
+	p->expect = sample_pos + nframes;
+	p->nframes = nframes;
+	p->latency = g->latency;
+	p->valid = pos->valid & (JackVideoFrameOffset | JackAudioVideoRatio);
+	p->offset = pos->video_offset;
+	p->apv = pos->audio_frames_per_video_frame;
+
+	__atomic_store_n(&p->consumed, g->monotonic_fcnt, __ATOMIC_RELAXED);
+	mtcpipe_signal(p);
+}
+
+/* mtcpipe_process_at() for the JACK transport position @pos */
+static inline void mtcpipe_process(MTCPipe *p, jack_transport_state_t state, const jack_position_t *pos, jack_nframes_t nframes, void *out) {
+	mtcpipe_process_at(p, state, pos, mtcgen_sample_pos(pos), nframes, out);
+}
+
+/************************************************
+ * non-realtime thread
+ */
+
+/* wait until the helper has caught up (for simulations) */
+static inline void mtcpipe_sync(MTCPipe *p) {
+	for (;;) {
+		const uint32_t epoch = __atomic_load_n(&p->epoch, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&p->ack, __ATOMIC_ACQUIRE) == epoch
+				&& (!(epoch & 1)
+					|| __atomic_load_n(&p->rendered, __ATOMIC_ACQUIRE) >= __atomic_load_n(&p->consumed, __ATOMIC_RELAXED) + (int64_t) p->lead * p->nframes
+					|| jack_ringbuffer_write_space(p->rb) < (JACK_MIDI_QUEUE_SIZE + 1) * sizeof(mtcpipe_ev))) {
+			return;
+		}
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_signal(&p->ready);
+		pthread_mutex_unlock(&p->lock);
+		usleep(10);
+	}
+}
+
+static inline int mtcpipe_init(MTCPipe *p, MTCGen *g, int lead) {
+	memset(p, 0, sizeof(MTCPipe));
+	p->gen = g;
+	p->lead = lead < 2 ? 2 : lead;
+	p->rb = rtmem_ringbuffer(MTCPIPE_RING * sizeof(mtcpipe_ev));
+	if (!p->rb) {
+		return -1;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->ready, NULL);
+	p->run = 1;
+	if (pthread_create(&p->thread, NULL, mtcpipe_thread, p)) {
+		p->run = 0;
+		rtmem_ringbuffer_free(p->rb);
+		p->rb = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void mtcpipe_free(MTCPipe *p) {
+	if (!p->rb) return;
+	pthread_mutex_lock(&p->lock);
+	p->run = 0;
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	rtmem_ringbuffer_free(p->rb);
+	p->rb = NULL;
+}
+
+#endif
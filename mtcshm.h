@@ -0,0 +1,129 @@
+/* Timecode position in POSIX shared memory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* One writer (the process thread) updates the segment once per cycle,
+ * any number of readers poll it. The payload is guarded by a sequence
+ * counter that is odd while an update is in progress, readers retry
+ * until they get a consistent copy. Nothing blocks the writer.
+ *
+ * A reader extrapolates the position to the current time:
+ *   seconds = position + speed * (now_usec - usec) / 1e6
+ */
+
+#ifndef MTCSHM_H
+#define MTCSHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MTCSHM_MAGIC   (0x4d544353) // "MTCS"
+#define MTCSHM_VERSION (1)
+
+typedef struct {
+	uint32_t state;        // 0: stopped, 1: rolling
+	int32_t source;        // selected input, -1: none
+	uint32_t type;         // MTC type 0..3: 24, 25, 30df, 30 fps
+	uint32_t samplerate;
+	double position;       // seconds since 00:00:00:00 at @sample
+	double speed;          // 1.0: nominal
+	int64_t sample;        // monotonic sample-time of the cycle start
+	int64_t usec;          // CLOCK_MONOTONIC at @sample
+	uint8_t hour, minute, second, frame;
+	uint32_t reserved;
+} mtcshm_pos;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;          // odd: update in progress
+	uint32_t size;         // sizeof(mtcshm_pos)
+	mtcshm_pos pos;
+} mtcshm;
+
+typedef struct {
+	mtcshm *shm;
+	char name[64];
+} MTCShm;
+
+/* create (or re-use) segment @name, non-realtime */
+static inline int mtcshm_create(MTCShm *s, const char *name) {
+	memset(s, 0, sizeof(MTCShm));
+	const int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(mtcshm))) {
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, sizeof(mtcshm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+	s->shm = (mtcshm*) p;
+	memset(s->shm, 0, sizeof(mtcshm));
+	s->shm->version = MTCSHM_VERSION;
+	s->shm->size = sizeof(mtcshm_pos);
+	s->shm->pos.source = -1;
+	__atomic_store_n(&s->shm->magic, MTCSHM_MAGIC, __ATOMIC_RELEASE);
+	strncpy(s->name, name, sizeof(s->name) - 1);
+	return 0;
+}
+
+/* realtime-safe */
+static inline void mtcshm_write(MTCShm *s, const mtcshm_pos *pos) {
+	mtcshm *m = s->shm;
+	if (!m) {
+		return;
+	}
+	const uint32_t seq = m->seq;
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->pos = *pos;
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* consistent copy of the position, returns -1 if the segment is not
+ * (yet) valid */
+static inline int mtcshm_read(const mtcshm *m, mtcshm_pos *pos) {
+	uint32_t seq;
+	if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != MTCSHM_MAGIC || m->version != MTCSHM_VERSION) {
+		return -1;
+	}
+	do {
+		while ((seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE)) & 1) ;
+		*pos = m->pos;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) != seq);
+	return 0;
+}
+
+static inline void mtcshm_close(MTCShm *s) {
+	if (!s->shm) {
+		return;
+	}
+	munmap(s->shm, sizeof(mtcshm));
+	shm_unlink(s->name);
+	s->shm = NULL;
+}
+
+#endif
@@ -0,0 +1,347 @@
+/* Timecode distribution as UDP datagrams
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The realtime thread queues fixed-size packets (mtcudp_post) into a
+ * lock-free ringbuffer, a sender thread drains it and hands all queued
+ * packets to the kernel with a single sendmmsg() call. The destination
+ * is a unicast or multicast address, IPv4 or IPv6 ("[addr]:port"),
+ * optionally followed by "@<interface>" to select the network interface
+ * that multicast is sent on (default: the route to the group).
+ *
+ * Each datagram is one 40 byte packet, network byte-order:
+ *   0  uint32 magic      "MTCU"
+ *   4  uint8  version    1
+ *   5  uint8  flags      bit 0: locate (full-frame message)
+ *   6  uint8  type       MTC type 0..3: 24, 25, 30df, 30 fps
+ *   7  uint8  quarter    quarter-frame within the frame 0..3
+ *   8  uint32 seq        incremented for every packet, gaps are losses
+ *  12  uint8  hour, minute, second, frame
+ *  16  int64  sample     sample-time at which this position was reached
+ *  24  int64  usec       host CLOCK_MONOTONIC at @sample
+ *  32  uint32 samplerate
+ *  36  uint32 reserved
+ */
+
+#ifndef MTCUDP_H
+#define MTCUDP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define htobe64(x) OSSwapHostToBigInt64(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
+#elif defined __linux__
+#include <endian.h>
+#else
+#include <sys/endian.h>
+#endif
+#endif
+
+#include <jack/ringbuffer.h>
+
+#include "rtmem.h"
+
+#define MTCUDP_MAGIC   (0x4d544355) // "MTCU"
+#define MTCUDP_VERSION (1)
+#define MTCUDP_RBSIZE  (512) // packets, > quarter-frames in a JIO_MAX_PERIOD cycle
+#define MTCUDP_BATCH   (64)  // packets per sendmmsg()
+
+#define MTCUDP_LOCATE  (1)
+
+typedef struct {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t flags;
+	uint8_t type;
+	uint8_t quarter;
+	uint32_t seq;
+	uint8_t hour, minute, second, frame;
+	int64_t sample;
+	int64_t usec;
+	uint32_t samplerate;
+	uint32_t reserved;
+} mtcudp_pkt;
+
+static struct {
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	uint32_t samplerate;
+	uint32_t seq;
+	jack_ringbuffer_t *rb;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	volatile int run;
+	pthread_t thread;
+	/* statistics, relaxed atomics */
+	uint64_t n_sent;
+	uint64_t n_dropped;  // ringbuffer full
+	uint64_t n_errors;   // rejected by the kernel
+} mtcudp = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+};
+
+/* realtime-safe, fills in magic, version, seq and samplerate */
+static inline void mtcudp_post(mtcudp_pkt *p) {
+	if (mtcudp.fd < 0) {
+		return;
+	}
+	p->magic = MTCUDP_MAGIC;
+	p->version = MTCUDP_VERSION;
+	p->seq = mtcudp.seq++;
+	p->samplerate = mtcudp.samplerate;
+	p->reserved = 0;
+	if (jack_ringbuffer_write_space(mtcudp.rb) >= sizeof(mtcudp_pkt)) {
+		jack_ringbuffer_write(mtcudp.rb, (const char *) p, sizeof(mtcudp_pkt));
+	} else {
+		/* process thread only, no locked read-modify-write */
+		__atomic_store_n(&mtcudp.n_dropped, __atomic_load_n(&mtcudp.n_dropped, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* realtime-safe, wake up the sender, once per cycle */
+static inline void mtcudp_flush(void) {
+	if (mtcudp.fd < 0 || jack_ringbuffer_read_space(mtcudp.rb) == 0) {
+		return;
+	}
+	if (pthread_mutex_trylock (&mtcudp.lock) == 0) {
+		pthread_cond_signal (&mtcudp.ready);
+		pthread_mutex_unlock (&mtcudp.lock);
+	}
+}
+
+#ifndef WIN32
+/* host to network byte-order */
+static inline void mtcudp_hton(mtcudp_pkt *p) {
+	p->magic = htonl(p->magic);
+	p->seq = htonl(p->seq);
+	p->sample = htobe64(p->sample);
+	p->usec = htobe64(p->usec);
+	p->samplerate = htonl(p->samplerate);
+}
+
+/* network to host byte-order, for receivers */
+static inline void mtcudp_ntoh(mtcudp_pkt *p) {
+	p->magic = ntohl(p->magic);
+	p->seq = ntohl(p->seq);
+	p->sample = be64toh(p->sample);
+	p->usec = be64toh(p->usec);
+	p->samplerate = ntohl(p->samplerate);
+}
+
+static inline void mtcudp_send(mtcudp_pkt *pkts, int n) {
+	int i, k = 0;
+	for (i = 0; i < n; ++i) {
+		mtcudp_hton(&pkts[i]);
+	}
+#ifdef __linux__
+	struct mmsghdr msg[MTCUDP_BATCH];
+	struct iovec iov[MTCUDP_BATCH];
+	memset(msg, 0, n * sizeof(struct mmsghdr));
+	for (i = 0; i < n; ++i) {
+		iov[i].iov_base = &pkts[i];
+		iov[i].iov_len = sizeof(mtcudp_pkt);
+		msg[i].msg_hdr.msg_name = &mtcudp.addr;
+		msg[i].msg_hdr.msg_namelen = mtcudp.addrlen;
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (k < n) {
+		const int rv = sendmmsg(mtcudp.fd, &msg[k], n - k, 0);
+		if (rv <= 0) {
+			/* e.g. ICMP port unreachable on unicast, skip one and go on */
+			__atomic_fetch_add(&mtcudp.n_errors, 1, __ATOMIC_RELAXED);
+			++k;
+			continue;
+		}
+		__atomic_fetch_add(&mtcudp.n_sent, rv, __ATOMIC_RELAXED);
+		k += rv;
+	}
+#else
+	for (; k < n; ++k) {
+		if (sendto(mtcudp.fd, &pkts[k], sizeof(mtcudp_pkt), 0, (struct sockaddr*) &mtcudp.addr, mtcudp.addrlen) < 0) {
+			__atomic_fetch_add(&mtcudp.n_errors, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_add(&mtcudp.n_sent, 1, __ATOMIC_RELAXED);
+		}
+	}
+#endif
+}
+
+static inline void *mtcudp_thread(void *arg) {
+	mtcudp_pkt pkts[MTCUDP_BATCH];
+	pthread_mutex_lock (&mtcudp.lock);
+	while (1) {
+		size_t n;
+		while ((n = jack_ringbuffer_read_space(mtcudp.rb) / sizeof(mtcudp_pkt)) > 0) {
+			if (n > MTCUDP_BATCH) n = MTCUDP_BATCH;
+			jack_ringbuffer_read(mtcudp.rb, (char *) pkts, n * sizeof(mtcudp_pkt));
+			mtcudp_send(pkts, n);
+		}
+		if (!mtcudp.run) break;
+		pthread_cond_wait (&mtcudp.ready, &mtcudp.lock);
+	}
+	pthread_mutex_unlock (&mtcudp.lock);
+	return NULL;
+}
+
+/* split "host:port[@iface]" or "[v6-addr]:port[@iface]" */
+static inline int mtcudp_parse(char *dest, char *host, size_t len, const char **port, const char **iface) {
+	char *sep, *at;
+	size_t hl;
+	if ((at = strrchr(dest, '@'))) {
+		*at = '\0';
+		*iface = at + 1;
+	}
+	if (dest[0] == '[') {
+		char *e = strchr(dest, ']');
+		if (!e || e[1] != ':') return -1;
+		++dest;
+		hl = e - dest;
+		sep = e + 1;
+	} else {
+		if (!(sep = strrchr(dest, ':'))) return -1;
+		hl = sep - dest;
+	}
+	if (hl == 0 || hl >= len || sep[1] == '\0') return -1;
+	memcpy(host, dest, hl);
+	host[hl] = '\0';
+	*port = sep + 1;
+	return 0;
+}
+#endif
+
+/* send to @dest "host:port", multicast groups are detected by address */
+static inline int mtcudp_open(const char *dest, uint32_t samplerate) {
+#ifdef WIN32
+	fprintf(stderr, "udp: not supported on this platform.\n");
+	return -1;
+#else
+	struct addrinfo hints, *res;
+	char spec[320], host[256];
+	const char *port;
+	const char *iface = NULL;
+	unsigned int ifindex = 0;
+	int fd, rv;
+
+	strncpy(spec, dest, sizeof(spec) - 1);
+	spec[sizeof(spec) - 1] = '\0';
+	if (mtcudp_parse(spec, host, sizeof(host), &port, &iface)) {
+		fprintf(stderr, "udp: invalid destination '%s', expected host:port.\n", dest);
+		return -1;
+	}
+	if (iface && !(ifindex = if_nametoindex(iface))) {
+		fprintf(stderr, "udp: unknown network interface '%s'.\n", iface);
+		return -1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((rv = getaddrinfo(host, port, &hints, &res))) {
+		fprintf(stderr, "udp: cannot resolve '%s': %s\n", dest, gai_strerror(rv));
+		return -1;
+	}
+	if ((fd = socket(res->ai_family, SOCK_DGRAM, 0)) < 0) {
+		fprintf(stderr, "udp: cannot create socket.\n");
+		freeaddrinfo(res);
+		return -1;
+	}
+	if (res->ai_family == AF_INET
+			&& IN_MULTICAST(ntohl(((struct sockaddr_in*) res->ai_addr)->sin_addr.s_addr))) {
+		const unsigned char ttl = 1, loop = 1;
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+		if (ifindex) {
+#ifdef __linux__
+			struct ip_mreqn mr;
+			memset(&mr, 0, sizeof(mr));
+			mr.imr_ifindex = ifindex;
+			rv = setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mr, sizeof(mr));
+#else
+			rv = -1;
+#endif
+			if (rv) {
+				fprintf(stderr, "udp: cannot send multicast on '%s'.\n", iface);
+				freeaddrinfo(res);
+				close(fd);
+				return -1;
+			}
+		}
+	} else if (res->ai_family == AF_INET6
+			&& IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6*) res->ai_addr)->sin6_addr)) {
+		const int hops = 1, loop = 1;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+		if (ifindex && setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex))) {
+			fprintf(stderr, "udp: cannot send multicast on '%s'.\n", iface);
+			freeaddrinfo(res);
+			close(fd);
+			return -1;
+		}
+	}
+	memcpy(&mtcudp.addr, res->ai_addr, res->ai_addrlen);
+	mtcudp.addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	mtcudp.samplerate = samplerate;
+	if (!(mtcudp.rb = rtmem_ringbuffer(MTCUDP_RBSIZE * sizeof(mtcudp_pkt)))) {
+		close(fd);
+		return -1;
+	}
+	mtcudp.fd = fd;
+	mtcudp.run = 1;
+	if (pthread_create(&mtcudp.thread, NULL, mtcudp_thread, NULL)) {
+		rtmem_ringbuffer_free(mtcudp.rb);
+		close(fd);
+		mtcudp.fd = -1;
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+/* send what is queued and close the socket */
+static inline void mtcudp_close(void) {
+	if (mtcudp.fd < 0) {
+		return;
+	}
+#ifndef WIN32
+	pthread_mutex_lock (&mtcudp.lock);
+	mtcudp.run = 0;
+	pthread_cond_signal (&mtcudp.ready);
+	pthread_mutex_unlock (&mtcudp.lock);
+	pthread_join(mtcudp.thread, NULL);
+	close(mtcudp.fd);
+#endif
+	rtmem_ringbuffer_free(mtcudp.rb);
+	mtcudp.fd = -1;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/* MIDI link bandwidth model
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A serial MIDI link carries one byte per 10 bit-periods (start, 8 data,
+ * stop), 3125 bytes/s at 31.25 kbaud. JACK does not know about that, a
+ * hardware interface queues whatever does not fit and sends it later.
+ *
+ * The model keeps the time at which the wire becomes idle, and stamps
+ * each event no earlier than that, so the port-buffer holds what the
+ * wire can actually deliver:
+ *
+ *  - quarter-frames go first, they are sent as soon as the wire is idle;
+ *    those that would be more than MTCWIRE_MAX_DELAY late are dropped.
+ *  - a pending full-frame message goes out before the next quarter-frame,
+ *    which is deferred until the wire is idle again: the quarter-frames
+ *    queued after it belong to the new position. A newer one replaces a
+ *    pending message that has not been sent yet (e.g. scrubbing while
+ *    stopped), and discards the quarter-frames queued before it, as the
+ *    generator does.
+ *
+ * The requested stream is measured over one-second windows; a window
+ * that asks for more than the link's capacity is reported as overload.
+ */
+
+#ifndef MTCWIRE_H
+#define MTCWIRE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "jackio.h"
+
+#define MTCWIRE_QUEUE (64)        // quarter-frames, power of two
+#define MTCWIRE_MAX_DELAY (0.010) // [sec]
+
+typedef struct {
+	long long int time;       // monotonic sample-time, due
+	jack_midi_data_t data[2];
+} mtcwire_qf;
+
+typedef struct MTCWire {
+	/* configuration, mtcwire_init() */
+	double spb;               // audio-frames per byte on the wire
+	double max_delay;         // [audio-frames]
+	uint32_t samplerate;
+	long long int window;     // load measurement, one second [audio-frames]
+	void (*msg)(const char *fmt, ...); // RT-safe message callback, may be NULL
+
+	/* state */
+	double idle;              // monotonic sample-time the wire is idle from
+	mtcwire_qf qf[MTCWIRE_QUEUE];
+	unsigned int qf_head;
+	unsigned int qf_tail;
+	jack_midi_data_t sysex[16];
+	size_t sysex_size;        // pending full-frame message, 0: none
+	long long int sysex_time;
+
+	long long int win_start;
+	uint64_t win_bytes;       // requested in the current window
+	uint64_t win_delay;       // largest delay in the current window [audio-frames]
+	int overload;
+
+	/* statistics, relaxed atomics (read by the metrics thread) */
+	uint64_t n_coalesced;     // full-frame messages replaced before they were sent
+	uint64_t n_delayed;       // events sent late, the wire was busy
+	uint64_t n_dropped;       // quarter-frames dropped, too late or queue full
+	uint64_t n_overload;      // windows that exceeded the link capacity
+	uint64_t load;            // requested/capacity of the last window [percent]
+	uint64_t max_delay_us;    // largest delay in the last window
+} MTCWire;
+
+#define MTCWIRE_MSG(w, ...) do { if ((w)->msg) (w)->msg(__VA_ARGS__); } while (0)
+
+static inline void mtcwire_init(MTCWire *w, uint32_t samplerate, double baud) {
+	memset(w, 0, sizeof(MTCWire));
+	w->spb = samplerate * 10.0 / baud;
+	w->max_delay = samplerate * MTCWIRE_MAX_DELAY;
+	w->samplerate = samplerate;
+	w->window = samplerate;
+}
+
+/* close the measurement window(s) that ended before @mfcnt */
+static inline void mtcwire_measure(MTCWire *w, long long int mfcnt) {
+	if (mfcnt < w->win_start + w->window) {
+		return;
+	}
+	const uint64_t load = rint(100.0 * w->win_bytes * w->spb / w->window);
+	__atomic_store_n(&w->load, load, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->max_delay_us, (uint64_t) rint(1e6 * w->win_delay / w->samplerate), __ATOMIC_RELAXED);
+	if (load > 100) {
+		JIO_RELAXED_ADD(w->n_overload, 1);
+		if (!w->overload) {
+			MTCWIRE_MSG(w, "WARNING: MIDI link overloaded, %d%% of its capacity requested.\n", (int) load);
+		}
+		w->overload = 1;
+	} else if (w->overload) {
+		MTCWIRE_MSG(w, "MIDI link load back to %d%%.\n", (int) load);
+		w->overload = 0;
+	}
+	w->win_bytes = 0;
+	w->win_delay = 0;
+	w->win_start = mfcnt - (mfcnt - w->win_start) % w->window;
+}
+
+/* queue an event for monotonic sample-time @mt (in order) */
+static inline void mtcwire_push(MTCWire *w, long long int mt, const jack_midi_data_t *data, size_t size) {
+	w->win_bytes += size;
+	if (size == 2) {
+		if (w->qf_tail - w->qf_head >= MTCWIRE_QUEUE) {
+			JIO_RELAXED_ADD(w->n_dropped, 1);
+			return;
+		}
+		mtcwire_qf *q = &w->qf[w->qf_tail++ & (MTCWIRE_QUEUE - 1)];
+		q->time = mt;
+		memcpy(q->data, data, 2);
+		return;
+	}
+	if (size > sizeof(w->sysex)) {
+		return;
+	}
+	if (w->sysex_size > 0) {
+		JIO_RELAXED_ADD(w->n_coalesced, 1);
+	}
+	w->qf_head = w->qf_tail; // superseded
+	memcpy(w->sysex, data, size);
+	w->sysex_size = size;
+	w->sysex_time = mt;
+}
+
+/**
+ * the next event that the wire can start in the cycle [@mfcnt, @mfcnt + @nframes),
+ * returns 0 if there is none. @data remains valid until the next call.
+ */
+static inline int mtcwire_next(MTCWire *w, long long int mfcnt, jack_nframes_t nframes, long long int *mt, const jack_midi_data_t **data, size_t *size) {
+	const long long int end = mfcnt + nframes;
+	const double idle = w->idle > mfcnt ? w->idle : mfcnt;
+
+	mtcwire_measure(w, mfcnt);
+
+	while (w->qf_head != w->qf_tail) {
+		const mtcwire_qf *q = &w->qf[w->qf_head & (MTCWIRE_QUEUE - 1)];
+		if (idle - q->time <= w->max_delay) {
+			break;
+		}
+		++w->qf_head;
+		JIO_RELAXED_ADD(w->n_dropped, 1);
+	}
+
+	const mtcwire_qf *q = w->qf_head != w->qf_tail ? &w->qf[w->qf_head & (MTCWIRE_QUEUE - 1)] : NULL;
+	long long int due;
+	double start;
+
+	if (w->sysex_size > 0) {
+		due = w->sysex_time;
+		start = due > idle ? due : idle;
+		*data = w->sysex;
+		*size = w->sysex_size;
+	} else if (q) {
+		due = q->time;
+		start = due > idle ? due : idle;
+		*data = q->data;
+		*size = 2;
+	} else {
+		return 0;
+	}
+
+	*mt = ceil(start);
+	if (*mt >= end) {
+		return 0;
+	}
+	if (*size == 2) {
+		++w->qf_head;
+	} else {
+		w->sysex_size = 0;
+	}
+	if (*mt > due) {
+		JIO_RELAXED_ADD(w->n_delayed, 1);
+		if (*mt - due > w->win_delay) {
+			w->win_delay = *mt - due;
+		}
+	}
+	w->idle = *mt + *size * w->spb;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,284 @@
+/* Preallocated, locked memory for the realtime thread
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Everything the process callback touches is allocated from one arena
+ * (rtmem_alloc, rtmem_ringbuffer) at startup; pages are prefaulted on
+ * allocation. rtmem_lock() then mlock()s only what is needed:
+ *  - the used part of the arena,
+ *  - the program image (code, constants, static state),
+ *  - the top RTMEM_STACK bytes of the JACK process thread's stack,
+ *    from its thread-init callback.
+ * Later allocations (e.g. when a capture starts after setup) are locked
+ * as they are made. The arena is bump-only: blocks that only the non-RT
+ * side touches belong on the heap. Unlike mlockall(MCL_FUTURE) this does not pin stdio
+ * buffers, the stacks of other threads or library heaps, and it needs
+ * a few hundred KB of RLIMIT_MEMLOCK. If locking fails, the tools run
+ * unlocked but prefaulted.
+ *
+ * Shared libraries (libjack, libltc, libc) and objects they allocate
+ * internally are not locked.
+ */
+
+#ifndef RTMEM_H
+#define RTMEM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#include <jack/ringbuffer.h>
+
+#define RTMEM_RESERVE (64 << 20) // address space for the arena, only used pages are committed
+#define RTMEM_ALIGN   (64)
+#define RTMEM_STACK   (64 << 10)
+
+#if !defined(WIN32) && !defined(__APPLE__)
+#define RTMEM_IMAGE
+extern char __executable_start[];
+extern char _end[];
+#endif
+
+static struct {
+	char *base;
+	size_t used;
+	size_t reserved;
+	size_t locked_end; // arena pages below are locked
+	int n_blocks;
+	int locking;       // rtmem_lock() succeeded, lock new blocks right away
+	uint64_t locked;   // bytes, relaxed atomic (metrics)
+	size_t image;
+	size_t stack;      // locked by rtmem_thread_init, relaxed atomic
+	int stack_pending; // rtmem_thread_init is registered with the process thread
+	int failed;
+} rtmem;
+
+static inline size_t rtmem_pagesize(void) {
+#ifdef WIN32
+	return 4096;
+#else
+	return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/* mlock() the pages spanning [p, p + size) */
+static inline int rtmem_mlock(const void *p, size_t size) {
+#ifdef WIN32
+	return -1;
+#else
+	const uintptr_t ps = rtmem_pagesize();
+	const uintptr_t a = (uintptr_t) p & ~(ps - 1);
+	const uintptr_t b = ((uintptr_t) p + size + ps - 1) & ~(ps - 1);
+	if (b == a) {
+		return 0;
+	}
+	if (mlock((const void*) a, b - a)) {
+		return -1;
+	}
+	__atomic_fetch_add(&rtmem.locked, b - a, __ATOMIC_RELAXED);
+	return 0;
+#endif
+}
+
+/* lock the arena pages that are in use and not yet locked */
+static inline int rtmem_lock_arena(void) {
+	const size_t ps = rtmem_pagesize();
+	const size_t end = (rtmem.used + ps - 1) & ~(ps - 1);
+	if (end <= rtmem.locked_end) {
+		return 0;
+	}
+	if (rtmem_mlock(rtmem.base + rtmem.locked_end, end - rtmem.locked_end)) {
+		return -1;
+	}
+	rtmem.locked_end = end;
+	return 0;
+}
+
+static inline int rtmem_reserve(void) {
+#ifndef WIN32
+	void *p = mmap(NULL, RTMEM_RESERVE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p != MAP_FAILED) {
+		rtmem.base = (char*) p;
+		rtmem.reserved = RTMEM_RESERVE;
+		return 0;
+	}
+#endif
+	rtmem.reserved = 1; // do not retry, use the heap
+	return -1;
+}
+
+static inline size_t rtmem_image_size(void) {
+#ifdef RTMEM_IMAGE
+	return _end - __executable_start;
+#else
+	return 0;
+#endif
+}
+
+static inline int rtmem_own(const void *p) {
+	return rtmem.base && (const char*) p >= rtmem.base && (const char*) p < rtmem.base + rtmem.reserved;
+}
+
+/* zeroed and prefaulted, not realtime-safe */
+static inline void *rtmem_alloc(size_t size) {
+	char *p;
+	size_t off;
+	if (!rtmem.reserved) {
+		rtmem_reserve();
+	}
+	if (!rtmem.base) {
+		return calloc(1, size);
+	}
+	off = (rtmem.used + RTMEM_ALIGN - 1) & ~(size_t)(RTMEM_ALIGN - 1);
+	if (size > rtmem.reserved - off) {
+		return NULL;
+	}
+	p = rtmem.base + off;
+	memset(p, 0, size);
+	rtmem.used = off + size;
+	++rtmem.n_blocks;
+	if (rtmem.locking && rtmem_lock_arena()) {
+		rtmem.failed = 1;
+	}
+	return p;
+}
+
+/* arena memory is released at exit, by rtmem_release() */
+static inline void rtmem_free(void *p) {
+	if (!rtmem_own(p)) {
+		free(p);
+	}
+}
+
+/* a jack ringbuffer of at least @size bytes, in the arena */
+static inline jack_ringbuffer_t *rtmem_ringbuffer(size_t size) {
+	jack_ringbuffer_t *rb;
+	int p2;
+	for (p2 = 1; ((size_t)1 << p2) < size; ++p2) ;
+	if (!(rb = (jack_ringbuffer_t*) rtmem_alloc(sizeof(jack_ringbuffer_t)))) {
+		return NULL;
+	}
+	if (!rtmem_own(rb)) {
+		/* no arena */
+		rtmem_free(rb);
+		if ((rb = jack_ringbuffer_create(size))) {
+			jack_ringbuffer_mlock(rb);
+		}
+		return rb;
+	}
+	if (!(rb->buf = (char*) rtmem_alloc((size_t)1 << p2))) {
+		return NULL;
+	}
+	rb->size = (size_t)1 << p2;
+	rb->size_mask = rb->size - 1;
+	rb->write_ptr = 0;
+	rb->read_ptr = 0;
+	rb->mlocked = 0;
+	return rb;
+}
+
+static inline void rtmem_ringbuffer_free(jack_ringbuffer_t *rb) {
+	if (rb && !rtmem_own(rb)) {
+		jack_ringbuffer_free(rb);
+	}
+}
+
+/* the stack is locked later, when the process thread starts; until then
+ * it is reported as pending */
+static inline void rtmem_report(FILE *f) {
+	const unsigned long total = __atomic_load_n(&rtmem.locked, __ATOMIC_RELAXED);
+	const unsigned long stack = __atomic_load_n(&rtmem.stack, __ATOMIC_RELAXED);
+	const int pending = rtmem.stack_pending && stack == 0;
+	if (total == 0) {
+#ifndef WIN32
+		struct rlimit rl;
+		if (!getrlimit(RLIMIT_MEMLOCK, &rl) && rl.rlim_cur != RLIM_INFINITY) {
+			fprintf(f, "Warning: Can not lock memory (RLIMIT_MEMLOCK: %lu KiB, need %lu KiB), running unlocked.\n",
+					(unsigned long) rl.rlim_cur >> 10,
+					(unsigned long) (rtmem.used + rtmem_image_size() + (rtmem.stack_pending ? RTMEM_STACK : 0)) >> 10);
+			return;
+		}
+#endif
+		fprintf(f, "Warning: Can not lock memory.\n");
+		return;
+	}
+	fprintf(f, "locked memory: %lu KiB: arena %lu KiB in %d blocks, image %lu KiB, stack %lu KiB%s%s\n",
+			total >> 10, (unsigned long) rtmem.used >> 10, rtmem.n_blocks,
+			(unsigned long) rtmem.image >> 10, (pending ? RTMEM_STACK : stack) >> 10,
+			pending ? " pending" : "", rtmem.failed ? " (incomplete)" : "");
+}
+
+/* lock the arena and the program image, call once after setup */
+static inline int rtmem_lock(FILE *report) {
+	if (rtmem.base) {
+		if (rtmem_lock_arena()) {
+			rtmem.failed = 1;
+		} else {
+			rtmem.locking = 1;
+		}
+	}
+#ifdef RTMEM_IMAGE
+	if (!rtmem.failed) {
+		const size_t size = rtmem_image_size();
+		if (rtmem_mlock(__executable_start, size)) {
+			rtmem.failed = 1;
+		} else {
+			rtmem.image = size;
+		}
+	}
+#endif
+	if (report) {
+		rtmem_report(report);
+	}
+	return rtmem.failed ? -1 : 0;
+}
+
+/* JackThreadInitCallback: prefault and lock the stack of the calling thread,
+ * it is only ever called through a pointer, so @stack is a frame of its own */
+static inline void rtmem_thread_init(void *arg) {
+	volatile char stack[RTMEM_STACK];
+	size_t i;
+	const size_t ps = rtmem_pagesize();
+	for (i = 0; i < sizeof(stack); i += ps) {
+		stack[i] = 0;
+	}
+	if (!rtmem.locking) {
+		return;
+	}
+	if (rtmem_mlock((const void*) stack, sizeof(stack))) {
+		fprintf(stderr, "Warning: Can not lock the process thread's stack.\n");
+	} else {
+		__atomic_store_n(&rtmem.stack, sizeof(stack), __ATOMIC_RELAXED);
+	}
+}
+
+static inline void rtmem_release(void) {
+#ifndef WIN32
+	if (rtmem.base) {
+		munmap(rtmem.base, rtmem.reserved);
+	}
+#endif
+	memset(&rtmem, 0, sizeof(rtmem));
+}
+
+#endif